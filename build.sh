@@ -15,6 +15,7 @@ CLEAN=0
 DRY_RUN=0
 USERDATA=0
 RUNNING_MODE="avs"
+RUNNING_MODE_SET=0
 VERSION="1.0.0"
 VERSION_CODE=1
 
@@ -22,11 +23,7 @@ build() {
 	# info print
 	echo "printing basic info..."
 	echo ">>> buildroot dir: $ROOT"
-	if [ $FOR_586 == 0 ]; then
-		echo ">>> build for: imx334/imx678"
-	else
-		echo ">>> build for: imx586"
-	fi
+	echo ">>> build for: imx334/imx678/imx586 (detected at boot)"
 	if [ $ENABLE_ADB == 0 ]; then
 		echo ">>> adb enabled: false"
 	else
@@ -186,24 +183,32 @@ check_prerequisite() {
 		cp -f $SCRIPT_DIR/files/imx678.c $ROOT/kernel/drivers/media/i2c
 	fi
 	echo "checking imx678.c....copied"
+	if [ $DRY_RUN == 0 ]; then
+		cp -f $SCRIPT_DIR/files/weewa_sensor.h $ROOT/kernel/drivers/media/i2c
+	fi
+	echo "checking weewa_sensor.h....copied"
+	if [ $DRY_RUN == 0 ]; then
+		cp -f $SCRIPT_DIR/files/weewa_frame.h $ROOT/kernel/drivers/media/i2c
+	fi
+	echo "checking weewa_frame.h....copied"
+	if [ $DRY_RUN == 0 ]; then
+		cp -f $SCRIPT_DIR/files/weewa_mode.h $ROOT/kernel/drivers/media/i2c
+	fi
+	echo "checking weewa_mode.h....copied"
+	if [ $DRY_RUN == 0 ]; then
+		cp -f $SCRIPT_DIR/files/weewa_timing.h $ROOT/kernel/drivers/media/i2c
+	fi
+	echo "checking weewa_timing.h....copied"
 
 	# check configs
 	if [ $DRY_RUN == 0 ]; then
-		if [ $FOR_586 == 0 ]; then
-			cp -f $SCRIPT_DIR/files/for_334_678/rk3588_weewa.config $ROOT/kernel/arch/arm64/configs
-		else
-			cp -f $SCRIPT_DIR/files/for_586/rk3588_weewa.config $ROOT/kernel/arch/arm64/configs
-		fi
+		cp -f $SCRIPT_DIR/files/rk3588_weewa.config $ROOT/kernel/arch/arm64/configs
 	fi
 	echo "checking rk3588 weewa config...copied"
 
 	# check dts
 	if [ $DRY_RUN == 0 ]; then
-		if [ $FOR_586 == 0 ]; then
-			cp -f $SCRIPT_DIR/files/for_334_678/rk3588-weewa-v10-linux.dts $ROOT/kernel/arch/arm64/boot/dts/rockchip
-		else
-			cp -f $SCRIPT_DIR/files/for_586/rk3588-weewa-v10-linux.dts $ROOT/kernel/arch/arm64/boot/dts/rockchip
-		fi
+		cp -f $SCRIPT_DIR/files/rk3588-weewa-v10-linux.dts $ROOT/kernel/arch/arm64/boot/dts/rockchip
 	fi
 	echo "checking rk3588-weewa-v10-linux.dts...copied"
 	if [ $DRY_RUN == 0 ]; then
@@ -218,10 +223,6 @@ check_prerequisite() {
 		cp -f $SCRIPT_DIR/files/rk3588-weewa-cam-v10.dtsi $ROOT/kernel/arch/arm64/boot/dts/rockchip
 	fi
 	echo "checking rk3588-weewa-cam-v10.dtsi...copied"
-	if [ $DRY_RUN == 0 ]; then
-		cp -f $SCRIPT_DIR/files/rk3588-weewa-cam-imx586-one.dtsi $ROOT/kernel/arch/arm64/boot/dts/rockchip
-	fi
-	echo "checking rk3588-weewa-cam-imx586-one.dtsi...copied"
 
 	# check adb enabled or not
 	if [ $DRY_RUN == 0 ]; then
@@ -322,10 +323,16 @@ for i in "$@"; do
 	 		;;
 	 	--mode=*|--running_mode=*|--running-mode=*)
 	 		RUNNING_MODE="${i#*=}"
+	 		RUNNING_MODE_SET=1
 	 		;;
 	 	*)
 	 		;;
 	 esac
 done
 
+# the firmware is the same for all sensors, --586 only picks the default mode
+if [ $FOR_586 == 1 ] && [ $RUNNING_MODE_SET == 0 ]; then
+	RUNNING_MODE="single"
+fi
+
 build
\ No newline at end of file
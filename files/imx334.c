@@ -8,6 +8,14 @@
  *	1.add parse mclk pinctrl.
  *	2.add set flip ctrl.
  * V0.0X01.0X05 add quick stream on/off
+ * V0.0X01.0X06 asynchronous probe, skip re-detection when already identified
+ * V0.0X01.0X07 support 2-lane wiring
+ * V0.0X01.0X08 add s_frame_interval, frame rate set through VTS
+ * V0.0X01.0X09 add set_selection window cropping
+ * V0.0X01.0X0A add WEEWA_CMD_SWITCH_MODE, mode switch while streaming
+ * V0.0X01.0X0B pick modes by size, bus format, HDR and frame interval
+ * V0.0X01.0X0C add exposure control in microseconds
+ * V0.0X01.0X0D apply flips while streaming, bus code follows the Bayer order
  */
 
 #include <linux/clk.h>
@@ -15,6 +23,7 @@
 #include <linux/delay.h>
 #include <linux/gpio/consumer.h>
 #include <linux/i2c.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/pm_runtime.h>
 #include <linux/regulator/consumer.h>
@@ -36,8 +45,9 @@
 #include <linux/of_gpio.h>
 #include <linux/mfd/syscon.h>
 #include <linux/rk-preisp.h>
+#include "weewa_sensor.h"
 
-#define DRIVER_VERSION			KERNEL_VERSION(0, 0x01, 0x05)
+#define DRIVER_VERSION			KERNEL_VERSION(0, 0x01, 0x0D)
 
 #ifndef V4L2_CID_DIGITAL_GAIN
 #define V4L2_CID_DIGITAL_GAIN		V4L2_CID_GAIN
@@ -48,6 +58,7 @@
 #define IMX334_LINK_FREQ_891		891000000// 1782Mbps
 
 #define IMX334_LANES			4
+#define IMX334_LANES_2			2
 
 #define IMX334_PIXEL_RATE_WITH_445M_10BIT	(IMX334_LINK_FREQ_445 * 2 / 10 * 4)
 #define IMX334_PIXEL_RATE_WITH_594M_12BIT	(IMX334_LINK_FREQ_594 * 2 / 12 * 4)
@@ -63,6 +74,7 @@
 #define IMX334_REG_CTRL_MODE		0x3000
 #define IMX334_MODE_SW_STANDBY		0x1
 #define IMX334_MODE_STREAMING		0x0
+#define IMX334_REG_HOLD			0x3001
 
 #define imx334_REG_MARSTER_MODE		0x3002
 #define imx334_MODE_STOP		BIT(0)
@@ -116,8 +128,31 @@
 #define IMX334_VREVERSE_REG	0x304f
 #define IMX334_HREVERSE_REG	0x304e
 
+/*
+ * Window cropping. HNUM and AREA3_WIDTH_1 read a few pixels and lines
+ * beyond the output for colour processing, as the all-pixel tables do.
+ * The window starts are absolute: the all-pixel origin is their reset
+ * value, which the mode tables leave alone (HTRIMMING_START's is what the
+ * chip ID check reads back).
+ */
+#define IMX334_REG_WINMODE		0x3018
+#define IMX334_WINMODE_ALL		0x00
+#define IMX334_WINMODE_CROP		0x04
+#define IMX334_REG_HTRIMMING_START	0x302C
+#define IMX334_HTRIMMING_START_DEF	0x0030
+#define IMX334_REG_HNUM			0x302E
+#define IMX334_REG_AREA3_ST_ADR_1	0x3074
+#define IMX334_AREA3_ST_ADR_1_DEF	0x00B0
+#define IMX334_REG_AREA3_WIDTH_1	0x3076
+#define IMX334_REG_Y_OUT_SIZE		0x3308
+#define IMX334_CROP_H_MARGIN		24
+#define IMX334_CROP_V_MARGIN		20
+#define IMX334_CROP_ALIGN		4
+#define IMX334_CROP_MIN		64
+
 #define IMX334_REG_DELAY			0xFFFE
 #define IMX334_REG_NULL			0xFFFF
+#define IMX334_BURST_LEN		32
 
 #define IMX334_REG_VALUE_08BIT		1
 #define IMX334_REG_VALUE_16BIT		2
@@ -132,6 +167,8 @@
 #define BRL				2200
 #define RHS1_MAX			4397 // <2*BRL && 4n+1
 #define SHR1_MIN			9
+#define RHS1_MIN			13
+#define SHR0_FSC_MARGIN			2 // SHR0 <= FSC - 2
 
 static const char * const imx334_supply_names[] = {
 	"avdd",		/* Analog power */
@@ -141,6 +178,12 @@ static const char * const imx334_supply_names[] = {
 
 #define IMX334_NUM_SUPPLIES ARRAY_SIZE(imx334_supply_names)
 
+#ifndef INNOSZ_WEEWA_DRIVER
+static bool boot_timing;
+module_param(boot_timing, bool, 0644);
+MODULE_PARM_DESC(boot_timing, "print per-phase probe timing");
+#endif
+
 struct imx334_regval {
 	u16 addr;
 	u8 val;
@@ -185,10 +228,20 @@ struct imx334 {
 	struct v4l2_ctrl	*test_pattern;
 	struct v4l2_ctrl	*pixel_rate;
 	struct v4l2_ctrl	*link_freq;
+	/* clustered, h_flip is the master */
+	struct v4l2_ctrl	*h_flip;
+	struct v4l2_ctrl	*v_flip;
+	u8			flip;	/* WEEWA_FLIP_* */
 	struct mutex		mutex;
 	bool			streaming;
 	bool			power_on;
 	const struct imx334_mode *cur_mode;
+	const struct imx334_mode *supported_modes;
+	u32			cfg_num;
+	struct weewa_mode_key	*mode_index;
+	/* last s_frame_interval request, set_fmt keeps to it */
+	struct v4l2_fract	want_interval;
+	u32			lanes;
 	u32			module_index;
 	const char		*module_facing;
 	const char		*module_name;
@@ -197,10 +250,22 @@ struct imx334 {
 	
 	
 	u32			cur_vts;
+	struct v4l2_rect	crop;
 	bool			has_init_exp;
 	struct preisp_hdrae_exp_s init_hdrae_exp;
+	/* last HDR exposure recorded or applied, and the SHR0 it got */
+	bool			has_hdrae_exp;
+	struct preisp_hdrae_exp_s cur_hdrae_exp;
+	u32			cur_shr0;
 	u32			cur_vclk_freq;
 	u32			cur_mipi_freq_idx;
+	struct weewa_pwr_member	pwr;
+	struct weewa_sync_member	sync;
+	struct weewa_frame_track frames;
+	struct weewa_skew	skew;
+	struct weewa_exp_us	exp_us;
+	/* set_ctrl only stores exposure and gain, see imx334_sync_set_ae */
+	bool			group_ae;
 };
 
 #define to_imx334(sd) container_of(sd, struct imx334, subdev)
@@ -529,6 +594,90 @@ static const struct imx334_regval imx334_hdr_12_74M_3840x2160_regs[] = {
 	{IMX334_REG_NULL, 0x00},
 };
 
+/*
+ *IMX334LQR All-pixel scan CSI-2_2lane 37.125Mhz
+ *AD:10bit Output:10bit 891Mbps Master Mode 15fps
+ */
+static const struct imx334_regval imx334_linear_10_3840x2160_2lane_regs[] = {
+	{0x302E, 0x18},
+	{0x302F, 0x0f},
+	{0x3030, 0xCA},// VMAX[19:0]
+	{0x3031, 0x08},//
+	{0x3034, 0x98},// HMAX[15:0]
+	{0x3035, 0x08},//
+	{0x3048, 0x00},// WDMODE[0]
+	{0x3049, 0x00},// WDSEL[1:0]
+	{0x304A, 0x00},// WD_SET1[2:0]
+	{0x304B, 0x01},// WD_SET2[3:0]
+	{0x304C, 0x14},// OPB_SIZE_V[5:0]
+	{0x3058, 0x05},// SHR0[19:0]
+	{0x3059, 0x00},//
+	{0x3068, 0x8B},// RHS1[19:0]
+	{0x3069, 0x00},//{
+	{0x3076, 0x84},
+	{0x3077, 0x08},
+	//{0x315a, 0x06},
+	{0x319e, 0x02},
+	{0x31D7, 0x00},// XVSMSKCNT_INT[1:0]
+	{0x3200, 0x11},// FGAINEN[0]
+	{0x341C, 0x47},// ADBIT1[8:0]
+	{0x3a18, 0x7f},
+	{0x3a1a, 0x37},
+	{0x3a1c, 0x37},
+	{0x3a1e, 0xf7},
+	{0x3a1f, 0x00},
+	{0x3a20, 0x3f},
+	{0x3a22, 0x6f},
+	{0x3a24, 0x3f},
+	{0x3a26, 0x5f},
+	{0x3a28, 0x2f},
+	{0x3A01, 0x01},// LANEMODE[2:0]
+	{IMX334_REG_NULL, 0x00},
+};
+
+/*
+ *IMX334LQR All-pixel scan CSI-2_2lane 37.125Mhz
+ *AD:12bit Output:12bit 1188Mbps Master Mode 15fps
+ */
+static const struct imx334_regval imx334_linear_12_3840x2160_2lane_regs[] = {
+	{0x302E, 0x18},
+	{0x302F, 0x0f},
+	{0x3030, 0xCA},// VMAX[19:0]
+	{0x3031, 0x08},//
+	{0x300C, 0x5B},// BCWAIT_TIME[7:0]
+	{0x300D, 0x40},// CPWAIT_TIME[7:0]
+	{0x3034, 0x98},// HMAX[15:0]
+	{0x3035, 0x08},//
+	{0x3048, 0x00},// WDMODE[0]
+	{0x3049, 0x00},// WDSEL[1:0]
+	{0x304A, 0x00},// WD_SET1[2:0]
+	{0x304B, 0x01},// WD_SET2[3:0]
+	{0x304C, 0x14},// OPB_SIZE_V[5:0]
+	{0x3058, 0x17},// SHR0[19:0]
+	{0x3059, 0x00},//
+	{0x3068, 0x8B},// RHS1[19:0]
+	{0x3069, 0x00},//
+	{0x3076, 0x84},
+	{0x3077, 0x08},
+	{0x314C, 0x80},// INCKSEL 1[8:0]
+	//{0x315A, 0x02},// INCKSEL2[1:0]
+	{0x316A, 0x7E},// INCKSEL4[1:0]
+	{0x319E, 0x01},// SYS_MODE
+	{0x31D7, 0x00},// XVSMSKCNT_INT[1:0]
+	{0x3200, 0x11},// FGAINEN[0]
+	{0x3A18, 0x8F},// TCLKPOST[15:0]
+	{0x3A1A, 0x4F},// TCLKPREPARE[15:0]
+	{0x3A1C, 0x47},// TCLKTRAIL[15:0]
+	{0x3A1E, 0x37},// TCLKZERO[15:0]
+	{0x3A20, 0x4F},// THSPREPARE[15:0]
+	{0x3A22, 0x87},// THSZERO[15:0]
+	{0x3A24, 0x4F},// THSTRAIL[15:0]
+	{0x3A26, 0x7F},// THSEXIT[15:0]
+	{0x3A28, 0x3F},// TLPX[15:0]
+	{0x3A01, 0x01},// LANEMODE[2:0]
+	{IMX334_REG_NULL, 0x00},
+};
+
 static __maybe_unused const struct imx334_regval imx334_interal_sync_master_start_regs[] = {
 	{0x3010, 0x07},
 	{0x31a1, 0x00},
@@ -637,6 +786,47 @@ static const struct imx334_mode imx334_supported_modes[] = {
 	},
 };
 
+/* same per-lane rate as the 4-lane modes, so half the frame rate */
+static const struct imx334_mode imx334_supported_modes_2lane[] = {
+	{
+		.width = 3840,
+		.height = 2160,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 150000,
+		},
+		.exp_def = 0x0600,
+		.hts_def = 0x044C * 4,
+		.vts_def = 0x08CA,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
+		.global_reg_list = imx334_10_3840x2160_global_regs,
+		.reg_list = imx334_linear_10_3840x2160_2lane_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX334_XVCLK_FREQ_37,
+		.bpp = 10,
+		.mipi_freq_idx = 0,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	}, {
+		.width = 3840,
+		.height = 2160,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 150000,
+		},
+		.exp_def = 0x0600,
+		.hts_def = 0x044C * 4,
+		.vts_def = 0x08CA,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB12_1X12,
+		.global_reg_list = imx334_12_3840x2160_global_regs,
+		.reg_list = imx334_linear_12_3840x2160_2lane_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX334_XVCLK_FREQ_37,
+		.bpp = 12,
+		.mipi_freq_idx = 1,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},
+};
+
 static const s64 imx334_link_freq_menu_items[] = {
 	IMX334_LINK_FREQ_445,
 	IMX334_LINK_FREQ_594,
@@ -680,21 +870,32 @@ static int imx334_write_reg(struct i2c_client *client, u16 reg,
 	return 0;
 }
 
+/* consecutive addresses are batched, see imx678_write_array */
 static int imx334_write_array(struct i2c_client *client,
 			      const struct imx334_regval *regs)
 {
-	u32 i;
-	int ret = 0;
+	u8 buf[IMX334_BURST_LEN + 2];
+	u32 i = 0, n;
 
-	for (i = 0; ret == 0 && regs[i].addr != IMX334_REG_NULL; i++)
-		if (unlikely(regs[i].addr == IMX334_REG_DELAY))
+	while (regs[i].addr != IMX334_REG_NULL) {
+		if (unlikely(regs[i].addr == IMX334_REG_DELAY)) {
 			usleep_range(regs[i].val, regs[i].val * 2);
-		else
-			ret = imx334_write_reg(client, regs[i].addr,
-					       IMX334_REG_VALUE_08BIT,
-					       regs[i].val);
+			i++;
+			continue;
+		}
 
-	return ret;
+		buf[0] = regs[i].addr >> 8;
+		buf[1] = regs[i].addr & 0xff;
+		for (n = 0; n < IMX334_BURST_LEN &&
+		     regs[i + n].addr == regs[i].addr + n; n++)
+			buf[n + 2] = regs[i + n].val;
+
+		if (i2c_master_send(client, buf, n + 2) != n + 2)
+			return -EIO;
+		i += n;
+	}
+
+	return 0;
 }
 
 /* Read registers up to 4 at a time */
@@ -736,23 +937,107 @@ static int imx334_read_reg(struct i2c_client *client, u16 reg, unsigned int len,
 	return 0;
 }
 
+/* the crop window covers the whole mode again after a mode change */
+static void imx334_reset_crop(struct imx334 *imx334)
+{
+	imx334->crop.left = 0;
+	imx334->crop.top = 0;
+	imx334->crop.width = imx334->cur_mode->width;
+	imx334->crop.height = imx334->cur_mode->height;
+}
+
+/* a crop window keeps the mode's blanking, so shorter frames run faster */
+static u32 imx334_vts_min(struct imx334 *imx334)
+{
+	const struct imx334_mode *mode = imx334->cur_mode;
+
+	return mode->vts_def - mode->height + imx334->crop.height;
+}
+
+/* make @mode current and bring the controls in line, mutex held */
+static int imx334_change_mode(struct imx334 *imx334,
+			      const struct imx334_mode *mode)
+{
+	s64 h_blank, vblank_def;
+	s64 dst_pixel_rate = 0;
+	int ret = 0;
+
+	imx334->cur_mode = mode;
+	imx334->cur_vts = mode->vts_def;
+	imx334_reset_crop(imx334);
+	h_blank = mode->hts_def - mode->width;
+	__v4l2_ctrl_modify_range(imx334->hblank, h_blank,
+				 h_blank, 1, h_blank);
+	vblank_def = mode->vts_def - mode->height;
+	__v4l2_ctrl_modify_range(imx334->vblank, vblank_def,
+				 IMX334_VTS_MAX - mode->height,
+				 1, vblank_def);
+	weewa_skew_update(&imx334->skew, &mode->max_fps, mode->vts_def,
+			  mode->height, mode->hdr_mode);
+	weewa_exp_us_update(&imx334->exp_us, &mode->max_fps, mode->vts_def,
+			    imx334->exposure->val);
+	if (imx334->cur_vclk_freq != mode->vclk_freq) {
+		clk_disable_unprepare(imx334->xvclk);
+		ret = clk_set_rate(imx334->xvclk, mode->vclk_freq);
+		ret |= clk_prepare_enable(imx334->xvclk);
+		if (ret < 0) {
+			dev_err(&imx334->client->dev, "Failed to enable xvclk\n");
+			return ret;
+		}
+		imx334->cur_vclk_freq = mode->vclk_freq;
+	}
+	if (imx334->cur_mipi_freq_idx != mode->mipi_freq_idx) {
+		dst_pixel_rate = ((u32)imx334_link_freq_menu_items[mode->mipi_freq_idx]) /
+			mode->bpp * 2 * imx334->lanes;
+		__v4l2_ctrl_s_ctrl_int64(imx334->pixel_rate,
+					 dst_pixel_rate);
+		__v4l2_ctrl_s_ctrl(imx334->link_freq,
+				   mode->mipi_freq_idx);
+		imx334->cur_mipi_freq_idx = mode->mipi_freq_idx;
+	}
+
+	return 0;
+}
+
+/* VTS for @interval in the current mode, @interval becomes the rate set */
+static int imx334_set_interval(struct imx334 *imx334,
+			       struct v4l2_fract *interval)
+{
+	const struct imx334_mode *mode = imx334->cur_mode;
+	u32 vts;
+	int ret;
+
+	vts = weewa_interval_to_vts(&mode->max_fps, mode->vts_def,
+				    imx334_vts_min(imx334), IMX334_VTS_MAX,
+				    interval);
+	/* the vblank control updates the exposure range along with VTS */
+	ret = __v4l2_ctrl_s_ctrl(imx334->vblank, vts - imx334->crop.height);
+	weewa_vts_to_interval(&mode->max_fps, mode->vts_def,
+			      imx334->crop.height + imx334->vblank->val,
+			      interval);
+
+	return ret;
+}
+
 static int imx334_set_fmt(struct v4l2_subdev *sd,
 			  struct v4l2_subdev_pad_config *cfg,
 			  struct v4l2_subdev_format *fmt)
 {
 	struct imx334 *imx334 = to_imx334(sd);
 	const struct imx334_mode *mode;
-	s64 h_blank, vblank_def;
-	s64 dst_pixel_rate = 0;
+	struct v4l2_fract interval;
+	u32 idx;
 	int ret = 0;
 
 	mutex_lock(&imx334->mutex);
 
-	mode = v4l2_find_nearest_size(imx334_supported_modes,
-				      ARRAY_SIZE(imx334_supported_modes),
-				      width, height,
-				      fmt->format.width, fmt->format.height);
-	fmt->format.code = mode->bus_fmt;
+	idx = weewa_mode_index_find(imx334->mode_index, imx334->cfg_num,
+				    fmt->format.width, fmt->format.height,
+				    weewa_bayer_flip(fmt->format.code, imx334->flip),
+				    imx334->cur_mode->hdr_mode,
+				    &imx334->want_interval);
+	mode = &imx334->supported_modes[idx];
+	fmt->format.code = weewa_bayer_flip(mode->bus_fmt, imx334->flip);
 	fmt->format.width = mode->width;
 	fmt->format.height = mode->height;
 	fmt->format.field = V4L2_FIELD_NONE;
@@ -764,38 +1049,13 @@ static int imx334_set_fmt(struct v4l2_subdev *sd,
 		return -ENOTTY;
 #endif
 	} else {
-		imx334->cur_mode = mode;
-		imx334->cur_vts = imx334->cur_mode->vts_def;
-		h_blank = mode->hts_def - mode->width;
-		__v4l2_ctrl_modify_range(imx334->hblank, h_blank,
-					 h_blank, 1, h_blank);
-		vblank_def = mode->vts_def - mode->height;
-		__v4l2_ctrl_modify_range(imx334->vblank, vblank_def,
-					 IMX334_VTS_MAX - mode->height,
-					 1, vblank_def);
-		if (imx334->cur_vclk_freq != mode->vclk_freq) {
-			clk_disable_unprepare(imx334->xvclk);
-			ret = clk_set_rate(imx334->xvclk, mode->vclk_freq);
-			ret |= clk_prepare_enable(imx334->xvclk);
-			if (ret < 0) {
-				dev_err(&imx334->client->dev, "Failed to enable xvclk\n");
-				mutex_unlock(&imx334->mutex);
-				return ret;
-			}
-			imx334->cur_vclk_freq = mode->vclk_freq;
-		}
-		if (imx334->cur_mipi_freq_idx != mode->mipi_freq_idx) {
-			dst_pixel_rate = ((u32)imx334_link_freq_menu_items[mode->mipi_freq_idx]) /
-				mode->bpp * 2 * IMX334_LANES;
-			__v4l2_ctrl_s_ctrl_int64(imx334->pixel_rate,
-						 dst_pixel_rate);
-			__v4l2_ctrl_s_ctrl(imx334->link_freq,
-					   mode->mipi_freq_idx);
-			imx334->cur_mipi_freq_idx = mode->mipi_freq_idx;
-		}
+		interval = imx334->want_interval;
+		ret = imx334_change_mode(imx334, mode);
+		if (!ret && interval.numerator)
+			ret = imx334_set_interval(imx334, &interval);
 	}
 	mutex_unlock(&imx334->mutex);
-	return 0;
+	return ret;
 }
 
 static int imx334_get_fmt(struct v4l2_subdev *sd,
@@ -814,9 +1074,9 @@ static int imx334_get_fmt(struct v4l2_subdev *sd,
 		return -ENOTTY;
 #endif
 	} else {
-		fmt->format.width = mode->width;
-		fmt->format.height = mode->height;
-		fmt->format.code = mode->bus_fmt;
+		fmt->format.width = imx334->crop.width;
+		fmt->format.height = imx334->crop.height;
+		fmt->format.code = weewa_bayer_flip(mode->bus_fmt, imx334->flip);
 		fmt->format.field = V4L2_FIELD_NONE;
 		/* format info: width/height/data type/virctual channel */
 		if (fmt->pad < PAD_MAX && mode->hdr_mode != NO_HDR)
@@ -837,7 +1097,7 @@ static int imx334_enum_mbus_code(struct v4l2_subdev *sd,
 
 	if (code->index != 0)
 		return -EINVAL;
-	code->code = imx334->cur_mode->bus_fmt;
+	code->code = weewa_bayer_flip(imx334->cur_mode->bus_fmt, imx334->flip);
 
 	return 0;
 }
@@ -846,16 +1106,19 @@ static int imx334_enum_frame_sizes(struct v4l2_subdev *sd,
 				   struct v4l2_subdev_pad_config *cfg,
 				   struct v4l2_subdev_frame_size_enum *fse)
 {
-	if (fse->index >= ARRAY_SIZE(imx334_supported_modes))
+	struct imx334 *imx334 = to_imx334(sd);
+
+	if (fse->index >= imx334->cfg_num)
 		return -EINVAL;
 
-	if (fse->code != imx334_supported_modes[0].bus_fmt)
+	if (weewa_bayer_flip(fse->code, imx334->flip) !=
+	    imx334->supported_modes[0].bus_fmt)
 		return -EINVAL;
 
-	fse->min_width = imx334_supported_modes[fse->index].width;
-	fse->max_width = imx334_supported_modes[fse->index].width;
-	fse->max_height = imx334_supported_modes[fse->index].height;
-	fse->min_height = imx334_supported_modes[fse->index].height;
+	fse->min_width = imx334->supported_modes[fse->index].width;
+	fse->max_width = imx334->supported_modes[fse->index].width;
+	fse->max_height = imx334->supported_modes[fse->index].height;
+	fse->min_height = imx334->supported_modes[fse->index].height;
 
 	return 0;
 }
@@ -882,12 +1145,45 @@ static int imx334_g_frame_interval(struct v4l2_subdev *sd,
 	const struct imx334_mode *mode = imx334->cur_mode;
 
 	mutex_lock(&imx334->mutex);
-	fi->interval = mode->max_fps;
+	weewa_vts_to_interval(&mode->max_fps, mode->vts_def,
+			      imx334->crop.height + imx334->vblank->val,
+			      &fi->interval);
 	mutex_unlock(&imx334->mutex);
 
 	return 0;
 }
 
+/*
+ * Before streaming the cheapest mode of the current size, format and HDR
+ * setting that reaches the interval is taken, faster ones cost link rate.
+ */
+static int imx334_s_frame_interval(struct v4l2_subdev *sd,
+				   struct v4l2_subdev_frame_interval *fi)
+{
+	struct imx334 *imx334 = to_imx334(sd);
+	const struct imx334_mode *cur = imx334->cur_mode;
+	const struct imx334_mode *mode;
+	u32 idx;
+	int ret = 0;
+
+	mutex_lock(&imx334->mutex);
+	imx334->want_interval = fi->interval;
+	if (!imx334->streaming) {
+		idx = weewa_mode_index_find(imx334->mode_index,
+					    imx334->cfg_num, cur->width,
+					    cur->height, cur->bus_fmt,
+					    cur->hdr_mode, &fi->interval);
+		mode = &imx334->supported_modes[idx];
+		if (mode != cur)
+			ret = imx334_change_mode(imx334, mode);
+	}
+	if (!ret)
+		ret = imx334_set_interval(imx334, &fi->interval);
+	mutex_unlock(&imx334->mutex);
+
+	return ret;
+}
+
 static int imx334_g_mbus_config(struct v4l2_subdev *sd, unsigned int pad_id,
 				struct v4l2_mbus_config *config)
 {
@@ -895,7 +1191,7 @@ static int imx334_g_mbus_config(struct v4l2_subdev *sd, unsigned int pad_id,
 	const struct imx334_mode *mode = imx334->cur_mode;
 	u32 val = 0;
 
-	val = 1 << (IMX334_LANES - 1) |
+	val = 1 << (imx334->lanes - 1) |
 	      V4L2_MBUS_CSI2_CHANNEL_0 |
 	      V4L2_MBUS_CSI2_CONTINUOUS_CLOCK;
 
@@ -929,6 +1225,8 @@ static int imx334_set_hdrae(struct imx334 *imx334,
 	int ret = 0;
 	u32 fsc = imx334->cur_vts;
 
+	imx334->cur_hdrae_exp = *ae;
+	imx334->has_hdrae_exp = true;
 	if (!imx334->has_init_exp && !imx334->streaming) {
 		imx334->init_hdrae_exp = *ae;
 		imx334->has_init_exp = true;
@@ -968,15 +1266,15 @@ static int imx334_set_hdrae(struct imx334 *imx334,
 	rhs1_max = (rhs1_max >> 2) * 4 + 1;
 	rhs1 = ((SHR1_MIN + s_exp_time + 3) >> 2) * 4 + 1;
 	dev_dbg(&client->dev, "line(%d) rhs1 %d\n", __LINE__, rhs1);
-	if (rhs1 < 13)
-		rhs1 = 13;
+	if (rhs1 < RHS1_MIN)
+		rhs1 = RHS1_MIN;
 	else if (rhs1 > rhs1_max)
 		rhs1 = rhs1_max;
 	dev_dbg(&client->dev, "line(%d) rhs1 %d\n", __LINE__, rhs1);
 
 	//Dynamic adjustment rhs1 must meet the following conditions
 	rhs1_change_limit = rhs1_old + 2 * BRL - fsc + 2;
-	rhs1_change_limit = (rhs1_change_limit < 13) ?  13 : rhs1_change_limit;
+	rhs1_change_limit = (rhs1_change_limit < RHS1_MIN) ?  RHS1_MIN : rhs1_change_limit;
 	rhs1_change_limit = ((rhs1_change_limit + 3) >> 2) * 4 + 1;
 	if (rhs1 < rhs1_change_limit)
 		rhs1 = rhs1_change_limit;
@@ -989,15 +1287,15 @@ static int imx334_set_hdrae(struct imx334 *imx334,
 	rhs1_old = rhs1;
 	shr1 = rhs1 - s_exp_time;
 
-	if (shr1 < 9)
-		shr1 = 9;
+	if (shr1 < SHR1_MIN)
+		shr1 = SHR1_MIN;
 	else if (shr1 > (rhs1 - 2))
 		shr1 = rhs1 - 2;
 
-	if (shr0 < (rhs1 + 9))
-		shr0 = rhs1 + 9;
-	else if (shr0 > (fsc - 2))
-		shr0 = fsc - 2;
+	if (shr0 < (rhs1 + SHR1_MIN))
+		shr0 = rhs1 + SHR1_MIN;
+	else if (shr0 > (fsc - SHR0_FSC_MARGIN))
+		shr0 = fsc - SHR0_FSC_MARGIN;
 
 	dev_dbg(&client->dev,
 		"fsc=%d,RHS1_MAX=%d,SHR1_MIN=%d,rhs1_max=%d\n",
@@ -1043,6 +1341,48 @@ static int imx334_set_hdrae(struct imx334 *imx334,
 		IMX334_LF_EXPO_REG_H,
 		IMX334_REG_VALUE_08BIT,
 		IMX334_FETCH_EXP_H(shr0));
+	imx334->cur_shr0 = shr0;
+	return ret;
+}
+
+/*
+ * HDR_X2 exposure in microseconds: the long frame goes through
+ * imx334_set_hdrae with the last short exposure and gains, the control
+ * reads back what its RHS1 and SHR0 limits left. Before stream on it is
+ * recorded into the exposure applied there. The short exposure and gains
+ * only exist once AE has sent an HDR exposure, so refuse until then; a
+ * control setup replaying the unchanged value is let through. mutex held.
+ */
+static int imx334_set_hdr_exposure_us(struct imx334 *imx334,
+				      struct v4l2_ctrl *ctrl)
+{
+	struct preisp_hdrae_exp_s ae = imx334->cur_hdrae_exp;
+	u32 fsc = imx334->cur_vts;
+	u32 lines;
+	int ret;
+
+	if (!imx334->has_hdrae_exp)
+		return ctrl->val == ctrl->cur.val ? 0 : -EAGAIN;
+
+	/* SHR0 in [RHS1 + SHR1_MIN, fsc - SHR0_FSC_MARGIN] */
+	lines = weewa_us_to_lines(&imx334->exp_us, ctrl->val);
+	lines = clamp_t(u32, lines, SHR0_FSC_MARGIN,
+			fsc - RHS1_MIN - SHR1_MIN);
+	ae.long_exp_reg = lines;
+	ae.middle_exp_reg = lines;
+	if (!imx334->streaming) {
+		imx334->cur_hdrae_exp = ae;
+		imx334->init_hdrae_exp = ae;
+		imx334->has_init_exp = true;
+		ctrl->val = weewa_lines_to_us(&imx334->exp_us, lines);
+		return 0;
+	}
+
+	ret = imx334_set_hdrae(imx334, &ae);
+	if (!ret)
+		ctrl->val = weewa_lines_to_us(&imx334->exp_us,
+					      fsc - imx334->cur_shr0);
+
 	return ret;
 }
 
@@ -1051,92 +1391,279 @@ static int imx334_get_channel_info(struct imx334 *imx334, struct rkmodule_channe
 	if (ch_info->index < PAD0 || ch_info->index >= PAD_MAX)
 		return -EINVAL;
 	ch_info->vc = imx334->cur_mode->vc[ch_info->index];
-	ch_info->width = imx334->cur_mode->width;
-	ch_info->height = imx334->cur_mode->height;
-	ch_info->bus_fmt = imx334->cur_mode->bus_fmt;
+	ch_info->width = imx334->crop.width;
+	ch_info->height = imx334->crop.height;
+	ch_info->bus_fmt = weewa_bayer_flip(imx334->cur_mode->bus_fmt,
+					    imx334->flip);
 	return 0;
 }
 
-static long imx334_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
+static u64 imx334_frame_ns(struct imx334 *imx334)
+{
+	const struct imx334_mode *mode = imx334->cur_mode;
+
+	if (!mode->max_fps.denominator || !mode->vts_def)
+		return 0;
+
+	return div64_u64((u64)NSEC_PER_SEC * mode->max_fps.numerator * imx334->cur_vts,
+			 (u64)mode->max_fps.denominator * mode->vts_def);
+}
+
+static void imx334_get_timing_model(struct imx334 *imx334,
+				    struct weewa_timing_model *tm)
 {
-	struct imx334 *imx334 = to_imx334(sd);
-	struct rkmodule_hdr_cfg *hdr;
-    struct rkmodule_channel_info *ch_info;
-	long ret = 0;
-	u32 i, h, w;
-	s64 dst_pixel_rate = 0;
 	const struct imx334_mode *mode;
-	u32 stream = 0;
-    u32 *sync_mode = NULL;
-	
-	
-	switch (cmd) {
-	case PREISP_CMD_SET_HDRAE_EXP:
-		return imx334_set_hdrae(imx334, arg);
-	case RKMODULE_GET_MODULE_INFO:
-		imx334_get_module_inf(imx334, (struct rkmodule_inf *)arg);
-		break;
-	case RKMODULE_GET_HDR_CFG:
-		hdr = (struct rkmodule_hdr_cfg *)arg;
-		hdr->esp.mode = HDR_NORMAL_VC;
-		hdr->hdr_mode = imx334->cur_mode->hdr_mode;
-		break;
-	case RKMODULE_SET_HDR_CFG:
-		hdr = (struct rkmodule_hdr_cfg *)arg;
-		w = imx334->cur_mode->width;
-		h = imx334->cur_mode->height;
-		for (i = 0; i < ARRAY_SIZE(imx334_supported_modes); i++) {
-			if (w == imx334_supported_modes[i].width &&
-			    h == imx334_supported_modes[i].height &&
-			    imx334_supported_modes[i].hdr_mode == hdr->hdr_mode) {
-				imx334->cur_mode = &imx334_supported_modes[i];
-				break;
-			}
+
+	mutex_lock(&imx334->mutex);
+	mode = imx334->cur_mode;
+	weewa_timing_fill(tm, &mode->max_fps, mode->vts_def, imx334->cur_vts,
+			  imx334->crop.height, mode->hdr_mode);
+	tm->width = imx334->crop.width;
+	tm->vts_min = imx334_vts_min(imx334);
+	tm->vts_max = IMX334_VTS_MAX;
+	tm->exposure_min = IMX334_EXPOSURE_MIN;
+	tm->exposure_margin = 4;
+	tm->exposure_step = imx334->exposure->step;
+	tm->gain_min = imx334->anal_gain->minimum;
+	tm->gain_max = imx334->anal_gain->maximum;
+	tm->gain_step = imx334->anal_gain->step;
+	/* exposure, gain and frame length all latch at the next frame */
+	tm->exposure_delay = 1;
+	tm->gain_delay = 1;
+	tm->vts_delay = 1;
+	if (mode->hdr_mode == HDR_X2) {
+		tm->hdr_brl = BRL;
+		tm->hdr_rhs1_max = RHS1_MAX;
+		tm->hdr_shr1_min = SHR1_MIN;
+	}
+	mutex_unlock(&imx334->mutex);
+}
+
+/* window registers are little endian, low byte first */
+static int imx334_write_crop(struct imx334 *imx334)
+{
+	const struct imx334_mode *mode = imx334->cur_mode;
+	const struct v4l2_rect *c = &imx334->crop;
+	const struct {
+		u16 reg;
+		u32 val;
+	} win[] = {
+		{ IMX334_REG_HTRIMMING_START,
+		  IMX334_HTRIMMING_START_DEF + c->left },
+		{ IMX334_REG_HNUM, c->width + IMX334_CROP_H_MARGIN },
+		{ IMX334_REG_AREA3_ST_ADR_1,
+		  IMX334_AREA3_ST_ADR_1_DEF + c->top },
+		{ IMX334_REG_AREA3_WIDTH_1, c->height + IMX334_CROP_V_MARGIN },
+		{ IMX334_REG_Y_OUT_SIZE, c->height },
+	};
+	u32 i;
+	int ret;
+
+	if (c->width == mode->width && c->height == mode->height)
+		return imx334_write_reg(imx334->client, IMX334_REG_WINMODE,
+					IMX334_REG_VALUE_08BIT, IMX334_WINMODE_ALL);
+
+	ret = imx334_write_reg(imx334->client, IMX334_REG_WINMODE,
+			       IMX334_REG_VALUE_08BIT, IMX334_WINMODE_CROP);
+	for (i = 0; i < ARRAY_SIZE(win); i++) {
+		ret |= imx334_write_reg(imx334->client, win[i].reg,
+					IMX334_REG_VALUE_08BIT, win[i].val & 0xff);
+		ret |= imx334_write_reg(imx334->client, win[i].reg + 1,
+					IMX334_REG_VALUE_08BIT, win[i].val >> 8);
+	}
+
+	return ret;
+}
+
+/* value @mode leaves in @addr, its reg_list over the global table */
+static bool imx334_mode_reg(const struct imx334_mode *mode, u16 addr, u8 *val)
+{
+	const struct imx334_regval *r;
+
+	for (r = mode->reg_list; r->addr != IMX334_REG_NULL; r++) {
+		if (r->addr == addr) {
+			*val = r->val;
+			return true;
 		}
-		if (i == ARRAY_SIZE(imx334_supported_modes)) {
-			dev_err(&imx334->client->dev,
-				"not find hdr mode:%d %dx%d config\n",
-				hdr->hdr_mode, w, h);
-			ret = -EINVAL;
-		} else {
-			mode = imx334->cur_mode;
-			imx334->cur_vts = mode->vts_def;
-			w = mode->hts_def - mode->width;
-			h = mode->vts_def - mode->height;
-			__v4l2_ctrl_modify_range(imx334->hblank, w, w, 1, w);
-			__v4l2_ctrl_modify_range(imx334->vblank, h,
-						 IMX334_VTS_MAX -
-						 mode->height,
-						 1, h);
-			if (imx334->cur_vclk_freq != mode->vclk_freq) {
-				clk_disable_unprepare(imx334->xvclk);
-				ret = clk_set_rate(imx334->xvclk, mode->vclk_freq);
-				ret |= clk_prepare_enable(imx334->xvclk);
-				if (ret < 0) {
-					dev_err(&imx334->client->dev, "Failed to enable xvclk\n");
-					return ret;
-				}
-				imx334->cur_vclk_freq = mode->vclk_freq;
-			}
-			if (imx334->cur_mipi_freq_idx != mode->mipi_freq_idx) {
-				dst_pixel_rate = ((u32)imx334_link_freq_menu_items[mode->mipi_freq_idx]) /
-						 mode->bpp * 2 * IMX334_LANES;
-				__v4l2_ctrl_s_ctrl_int64(imx334->pixel_rate,
-							 dst_pixel_rate);
-				__v4l2_ctrl_s_ctrl(imx334->link_freq,
-						   mode->mipi_freq_idx);
-				imx334->cur_mipi_freq_idx = mode->mipi_freq_idx;
-			}
+	}
+	for (r = mode->global_reg_list; r->addr != IMX334_REG_NULL; r++) {
+		if (r->addr == addr) {
+			*val = r->val;
+			return true;
 		}
-		break;
-	case RKMODULE_SET_QUICK_STREAM:
+	}
 
-		stream = *((u32 *)arg);
+	return false;
+}
 
-		if (stream)
+/*
+ * Registers whose value differs between the two modes: @from's reg_list
+ * entries fall back to @to's value, then @to's own reg_list is applied.
+ */
+static int imx334_write_mode_diff(struct imx334 *imx334,
+				  const struct imx334_mode *from,
+				  const struct imx334_mode *to)
+{
+	const struct imx334_regval *r;
+	u8 val;
+	int ret = 0;
+
+	for (r = from->reg_list; r->addr != IMX334_REG_NULL; r++) {
+		if (r->addr == IMX334_REG_DELAY ||
+		    !imx334_mode_reg(to, r->addr, &val) || val == r->val)
+			continue;
+		ret |= imx334_write_reg(imx334->client, r->addr,
+					IMX334_REG_VALUE_08BIT, val);
+	}
+	for (r = to->reg_list; r->addr != IMX334_REG_NULL; r++) {
+		if (r->addr == IMX334_REG_DELAY ||
+		    (imx334_mode_reg(from, r->addr, &val) && val == r->val))
+			continue;
+		ret |= imx334_write_reg(imx334->client, r->addr,
+					IMX334_REG_VALUE_08BIT, r->val);
+	}
+
+	return ret;
+}
+
+/*
+ * Same link format, clock and data rate. The linear and HDR_X2 tables run
+ * at different rates, so for now a switch between them waits for a stream
+ * restart.
+ */
+static bool imx334_can_switch(struct imx334 *imx334,
+			      const struct imx334_mode *mode)
+{
+	const struct imx334_mode *cur = imx334->cur_mode;
+
+	return mode->bus_fmt == cur->bus_fmt &&
+	       mode->vclk_freq == cur->vclk_freq &&
+	       mode->global_reg_list == cur->global_reg_list &&
+	       mode->mipi_freq_idx == cur->mipi_freq_idx;
+}
+
+static int imx334_switch_mode(struct imx334 *imx334,
+			      struct weewa_mode_switch *ms)
+{
+	const struct imx334_mode *mode, *found = NULL;
+	struct i2c_client *client = imx334->client;
+	struct v4l2_rect old_crop;
+	u32 old_code;
+	u32 code = ms->code ? weewa_bayer_flip(ms->code, imx334->flip) :
+			      imx334->cur_mode->bus_fmt;
+	bool match = false;
+	u64 old_ns;
+	u32 i;
+	int ret = 0;
+
+	mutex_lock(&imx334->mutex);
+	for (i = 0; i < imx334->cfg_num; i++) {
+		mode = &imx334->supported_modes[i];
+		if (mode->width != ms->width || mode->height != ms->height ||
+		    mode->bus_fmt != code || mode->hdr_mode != ms->hdr_mode)
+			continue;
+		match = true;
+		if (mode == imx334->cur_mode) {
+			found = mode;
+			break;
+		}
+		if (!found && (!imx334->streaming ||
+			       imx334_can_switch(imx334, mode)))
+			found = mode;
+	}
+	if (!found) {
+		ret = match ? -EBUSY : -EINVAL;
+		goto unlock;
+	}
+
+	if (!imx334->streaming) {
+		ms->frame = 0;
+		ret = imx334_change_mode(imx334, found);
+		goto unlock;
+	}
+
+	old_ns = imx334_frame_ns(imx334);
+	if (found == imx334->cur_mode) {
+		ms->frame = weewa_frame_estimate(&imx334->frames, old_ns);
+		goto unlock;
+	}
+
+	old_code = imx334->cur_mode->bus_fmt;
+	old_crop = imx334->crop;
+	ret = imx334_write_reg(client, IMX334_REG_HOLD, IMX334_REG_VALUE_08BIT, 1);
+	ret |= imx334_write_mode_diff(imx334, imx334->cur_mode, found);
+	ret |= imx334_change_mode(imx334, found);
+	ret |= imx334_write_crop(imx334);
+	ret |= __v4l2_ctrl_handler_setup(&imx334->ctrl_handler);
+	ret |= imx334_write_reg(client, IMX334_REG_HOLD, IMX334_REG_VALUE_08BIT, 0);
+	ms->frame = weewa_frame_estimate(&imx334->frames, old_ns) + 1;
+	weewa_frame_rebase(&imx334->frames, ms->frame, old_ns,
+			   imx334_frame_ns(imx334));
+	/* the receiver's buffers no longer fit the output */
+	if (found->bus_fmt != old_code || imx334->crop.width != old_crop.width ||
+	    imx334->crop.height != old_crop.height)
+		weewa_notify_src_change(&imx334->subdev);
+
+unlock:
+	mutex_unlock(&imx334->mutex);
+
+	return ret;
+}
+
+static long imx334_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
+{
+	struct imx334 *imx334 = to_imx334(sd);
+	struct rkmodule_hdr_cfg *hdr;
+    struct rkmodule_channel_info *ch_info;
+	long ret = 0;
+	u32 i, h, w;
+	u32 stream = 0;
+    u32 *sync_mode = NULL;
+	
+	
+	switch (cmd) {
+	case PREISP_CMD_SET_HDRAE_EXP:
+		return imx334_set_hdrae(imx334, arg);
+	case RKMODULE_GET_MODULE_INFO:
+		imx334_get_module_inf(imx334, (struct rkmodule_inf *)arg);
+		break;
+	case RKMODULE_GET_HDR_CFG:
+		hdr = (struct rkmodule_hdr_cfg *)arg;
+		hdr->esp.mode = HDR_NORMAL_VC;
+		hdr->hdr_mode = imx334->cur_mode->hdr_mode;
+		break;
+	case RKMODULE_SET_HDR_CFG:
+		hdr = (struct rkmodule_hdr_cfg *)arg;
+		w = imx334->cur_mode->width;
+		h = imx334->cur_mode->height;
+		for (i = 0; i < imx334->cfg_num; i++) {
+			if (w == imx334->supported_modes[i].width &&
+			    h == imx334->supported_modes[i].height &&
+			    imx334->supported_modes[i].hdr_mode == hdr->hdr_mode)
+				break;
+		}
+		if (i == imx334->cfg_num) {
+			dev_err(&imx334->client->dev,
+				"not find hdr mode:%d %dx%d config\n",
+				hdr->hdr_mode, w, h);
+			ret = -EINVAL;
+		} else {
+			mutex_lock(&imx334->mutex);
+			ret = imx334_change_mode(imx334,
+						 &imx334->supported_modes[i]);
+			mutex_unlock(&imx334->mutex);
+		}
+		break;
+	case RKMODULE_SET_QUICK_STREAM:
+
+		stream = *((u32 *)arg);
+
+		if (stream) {
 			ret = imx334_write_reg(imx334->client, IMX334_REG_CTRL_MODE,
 				IMX334_REG_VALUE_08BIT, 0);
-		else
+			if (!ret)
+				weewa_frame_start(&imx334->frames);
+		} else
 			ret = imx334_write_reg(imx334->client, IMX334_REG_CTRL_MODE,
 				IMX334_REG_VALUE_08BIT, 1);
 		break;
@@ -1154,6 +1681,26 @@ static long imx334_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
 		imx334->sync_mode = *sync_mode;	
 		v4l2_err(&imx334->subdev, "set sync mode %d\n",*sync_mode);
 		break;
+	case WEEWA_CMD_GET_SYNC_INFO:
+		weewa_sync_get_info(&imx334->sync, (struct weewa_sync_info *)arg);
+		break;
+	case WEEWA_CMD_SET_GROUP_AE:
+		ret = weewa_sync_set_ae(&imx334->sync, (struct weewa_group_ae *)arg);
+		break;
+	case WEEWA_CMD_GET_FRAME_INFO:
+		if (!imx334->streaming) {
+			ret = -EAGAIN;
+			break;
+		}
+		weewa_frame_get_timing(&imx334->frames, imx334_frame_ns(imx334),
+				       (struct weewa_frame_info *)arg);
+		break;
+	case WEEWA_CMD_GET_TIMING_MODEL:
+		imx334_get_timing_model(imx334, (struct weewa_timing_model *)arg);
+		break;
+	case WEEWA_CMD_SWITCH_MODE:
+		ret = imx334_switch_mode(imx334, (struct weewa_mode_switch *)arg);
+		break;
 	default:
 		ret = -ENOIOCTLCMD;
 		break;
@@ -1172,6 +1719,11 @@ static long imx334_compat_ioctl32(struct v4l2_subdev *sd,
 	struct rkmodule_hdr_cfg *hdr;
 	struct preisp_hdrae_exp_s *hdrae;
 	struct rkmodule_channel_info *ch_info;
+	struct weewa_sync_info sync_info;
+	struct weewa_group_ae *group_ae;
+	struct weewa_frame_info frame_info;
+	struct weewa_timing_model timing;
+	struct weewa_mode_switch mode_switch;
 	long ret;
 	u32 stream = 0;
 	u32 sync_mode;
@@ -1272,6 +1824,57 @@ static long imx334_compat_ioctl32(struct v4l2_subdev *sd,
 		else
 			ret = -EFAULT;	
 		break;
+	case WEEWA_CMD_GET_SYNC_INFO:
+		ret = imx334_ioctl(sd, cmd, &sync_info);
+		if (!ret) {
+			ret = copy_to_user(up, &sync_info, sizeof(sync_info));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
+	case WEEWA_CMD_SET_GROUP_AE:
+		group_ae = kzalloc(sizeof(*group_ae), GFP_KERNEL);
+		if (!group_ae) {
+			ret = -ENOMEM;
+			return ret;
+		}
+
+		ret = copy_from_user(group_ae, up, sizeof(*group_ae));
+		if (!ret) {
+			ret = imx334_ioctl(sd, cmd, group_ae);
+			if (!ret && copy_to_user(up, group_ae, sizeof(*group_ae)))
+				ret = -EFAULT;
+		} else {
+			ret = -EFAULT;
+		}
+		kfree(group_ae);
+		break;
+	case WEEWA_CMD_GET_FRAME_INFO:
+		ret = imx334_ioctl(sd, cmd, &frame_info);
+		if (!ret) {
+			ret = copy_to_user(up, &frame_info, sizeof(frame_info));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
+	case WEEWA_CMD_GET_TIMING_MODEL:
+		ret = imx334_ioctl(sd, cmd, &timing);
+		if (!ret) {
+			ret = copy_to_user(up, &timing, sizeof(timing));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
+	case WEEWA_CMD_SWITCH_MODE:
+		if (copy_from_user(&mode_switch, up, sizeof(mode_switch)))
+			return -EFAULT;
+		ret = imx334_ioctl(sd, cmd, &mode_switch);
+		if (!ret) {
+			ret = copy_to_user(up, &mode_switch, sizeof(mode_switch));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
 	default:
 		ret = -ENOIOCTLCMD;
 		break;
@@ -1289,6 +1892,9 @@ static int __imx334_start_stream(struct imx334 *imx334)
 	if (ret)
 		return ret;
 	ret = imx334_write_array(imx334->client, imx334->cur_mode->reg_list);
+	if (ret)
+		return ret;
+	ret = imx334_write_crop(imx334);
 	if (ret)
 		return ret;
 	/* In case these controls are set before streaming */
@@ -1326,18 +1932,25 @@ static int __imx334_start_stream(struct imx334 *imx334)
 		usleep_range(30000, 40000);
 		ret |= imx334_write_reg(imx334->client, imx334_REG_MARSTER_MODE,
 					IMX334_REG_VALUE_08BIT, 0);
+		if (!ret)
+			weewa_frame_start(&imx334->frames);
 	} else {
 		ret |= imx334_write_reg(imx334->client, imx334_REG_MARSTER_MODE,
 					IMX334_REG_VALUE_08BIT, 0);
 	}
 	
+	if (!ret && imx334->sync_mode != NO_SYNC_MODE)
+		weewa_sync_start(&imx334->sync);
+
 	return ret;
 }
 
 static int __imx334_stop_stream(struct imx334 *imx334)
 {
 	int ret = 0;
-	
+
+	weewa_sync_stop(&imx334->sync);
+
 	ret = imx334_write_reg(imx334->client, IMX334_REG_CTRL_MODE,
 				IMX334_REG_VALUE_08BIT, 1);
 	
@@ -1345,7 +1958,7 @@ static int __imx334_stop_stream(struct imx334 *imx334)
 		ret |= imx334_write_array(imx334->client, imx334_external_sync_master_stop_regs);
 	else if (imx334->sync_mode == INTERNAL_MASTER_MODE)
 		ret |= imx334_write_array(imx334->client, imx334_interal_sync_master_stop_regs);
-	
+
 	return ret;
 }
 
@@ -1419,83 +2032,25 @@ unlock_and_return:
 	return ret;
 }
 
-/* Calculate the delay in us by clock rate and clock cycles */
-static inline u32 imx334_cal_delay(u32 cycles, struct imx334 *imx334)
+/* input clock the current mode runs from */
+static void imx334_set_xvclk_rate(struct imx334 *imx334)
 {
 	if (imx334->cur_mode->vclk_freq == IMX334_XVCLK_FREQ_37)
-		return DIV_ROUND_UP(cycles, IMX334_XVCLK_FREQ_37 / 1000 / 1000);
+		imx334->pwr.xvclk_rate = IMX334_XVCLK_FREQ_37;
 	else
-		return DIV_ROUND_UP(cycles, IMX334_XVCLK_FREQ_74 / 1000 / 1000);
+		imx334->pwr.xvclk_rate = IMX334_XVCLK_FREQ_74;
 }
 
 static int __imx334_power_on(struct imx334 *imx334)
 {
-	int ret;
-	u32 delay_us;
-	s64 vclk_freq;
-	struct device *dev = &imx334->client->dev;
-
-	if (!IS_ERR_OR_NULL(imx334->pins_default)) {
-		ret = pinctrl_select_state(imx334->pinctrl,
-					   imx334->pins_default);
-		if (ret < 0)
-			dev_err(dev, "could not set pins\n");
-	}
-
-	if (imx334->cur_mode->vclk_freq == IMX334_XVCLK_FREQ_37)
-		vclk_freq = IMX334_XVCLK_FREQ_37;
-	else
-		vclk_freq = IMX334_XVCLK_FREQ_74;
-
-	ret = clk_set_rate(imx334->xvclk, vclk_freq);
-	if (ret < 0) {
-		dev_err(dev, "Failed to set xvclk rate (24MHz)\n");
-		return ret;
-	}
-	if (clk_get_rate(imx334->xvclk) != vclk_freq)
-		dev_warn(dev, "xvclk mismatched, modes are based on 37.125MHz\n");
-	ret = clk_prepare_enable(imx334->xvclk);
-	if (ret < 0) {
-		dev_err(dev, "Failed to enable xvclk\n");
-		return ret;
-	}
+	imx334_set_xvclk_rate(imx334);
 
-	if (!IS_ERR(imx334->reset_gpio))
-		gpiod_set_value_cansleep(imx334->reset_gpio, 0);
-
-	ret = regulator_bulk_enable(IMX334_NUM_SUPPLIES, imx334->supplies);
-	if (ret < 0) {
-		dev_err(dev, "Failed to enable regulators\n");
-		goto disable_clk;
-	}
-
-	if (!IS_ERR(imx334->reset_gpio))
-		gpiod_set_value_cansleep(imx334->reset_gpio, 1);
-
-	usleep_range(500, 1000);
-	if (!IS_ERR(imx334->pwdn_gpio))
-		gpiod_set_value_cansleep(imx334->pwdn_gpio, 1);
-
-	/* 8192 cycles prior to first SCCB transaction */
-	delay_us = imx334_cal_delay(8192, imx334);
-	usleep_range(delay_us, delay_us * 2);
-
-	return 0;
-
-disable_clk:
-	clk_disable_unprepare(imx334->xvclk);
-
-	return ret;
+	return weewa_pwr_get(&imx334->pwr);
 }
 
 static void __imx334_power_off(struct imx334 *imx334)
 {
-	if (!IS_ERR(imx334->pwdn_gpio))
-		gpiod_set_value_cansleep(imx334->pwdn_gpio, 0);
-	clk_disable_unprepare(imx334->xvclk);
-	if (!IS_ERR(imx334->reset_gpio))
-		gpiod_set_value_cansleep(imx334->reset_gpio, 0);
-	regulator_bulk_disable(IMX334_NUM_SUPPLIES, imx334->supplies);
+	weewa_pwr_put(&imx334->pwr);
 }
 
 static int imx334_runtime_resume(struct device *dev)
@@ -1524,7 +2079,7 @@ static int imx334_open(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
 	struct imx334 *imx334 = to_imx334(sd);
 	struct v4l2_mbus_framefmt *try_fmt =
 				v4l2_subdev_get_try_format(sd, fh->pad, 0);
-	const struct imx334_mode *def_mode = &imx334_supported_modes[0];
+	const struct imx334_mode *def_mode = &imx334->supported_modes[0];
 
 	mutex_lock(&imx334->mutex);
 	/* Initialize try_fmt */
@@ -1544,39 +2099,167 @@ static int imx334_enum_frame_interval(struct v4l2_subdev *sd,
 				      struct v4l2_subdev_pad_config *cfg,
 				struct v4l2_subdev_frame_interval_enum *fie)
 {
-	if (fie->index >= ARRAY_SIZE(imx334_supported_modes))
-		return -EINVAL;
+	struct imx334 *imx334 = to_imx334(sd);
+	const struct imx334_mode *mode;
+	u32 index = fie->index;
+	u32 i;
 
-	fie->code = imx334_supported_modes[fie->index].bus_fmt;
+	/* each mode's max_fps first, then the standard rates below it */
+	for (i = 0; i < imx334->cfg_num; i++) {
+		mode = &imx334->supported_modes[i];
+		if (weewa_mode_interval(&mode->max_fps, index, &fie->interval)) {
+			fie->code = weewa_bayer_flip(mode->bus_fmt,
+						     imx334->flip);
+			fie->width = mode->width;
+			fie->height = mode->height;
+			fie->reserved[0] = mode->hdr_mode;
+			return 0;
+		}
+		index -= weewa_mode_intervals(&mode->max_fps);
+	}
 
-	fie->width = imx334_supported_modes[fie->index].width;
-	fie->height = imx334_supported_modes[fie->index].height;
-	fie->interval = imx334_supported_modes[fie->index].max_fps;
-	fie->reserved[0] = imx334_supported_modes[fie->index].hdr_mode;
-	return 0;
+	return -EINVAL;
 }
 
-#define CROP_START(SRC, DST) (((SRC) - (DST)) / 2 / 4 * 4)
-#define DST_WIDTH 3840
-#define DST_HEIGHT 2160
-
+/*
+ * CROP_BOUNDS is what the receiver keeps of the output, which is all of it;
+ * CROP is the sensor window within the mode, DEFAULT the whole mode.
+ */
 static int imx334_get_selection(struct v4l2_subdev *sd,
 				struct v4l2_subdev_pad_config *cfg,
 				struct v4l2_subdev_selection *sel)
 {
 	struct imx334 *imx334 = to_imx334(sd);
+	int ret = 0;
 
-	if (sel->target == V4L2_SEL_TGT_CROP_BOUNDS) {
-		sel->r.left = CROP_START(imx334->cur_mode->width, DST_WIDTH);
-		sel->r.width = DST_WIDTH;
-		sel->r.top = CROP_START(imx334->cur_mode->height, DST_HEIGHT);
-		sel->r.height = DST_HEIGHT;
-		return 0;
+	mutex_lock(&imx334->mutex);
+	switch (sel->target) {
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+		sel->r.left = 0;
+		sel->r.top = 0;
+		sel->r.width = imx334->crop.width;
+		sel->r.height = imx334->crop.height;
+		break;
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+		sel->r.left = 0;
+		sel->r.top = 0;
+		sel->r.width = imx334->cur_mode->width;
+		sel->r.height = imx334->cur_mode->height;
+		break;
+	case V4L2_SEL_TGT_CROP:
+		sel->r = imx334->crop;
+		break;
+	default:
+		ret = -EINVAL;
+		break;
 	}
-	return -EINVAL;
+	mutex_unlock(&imx334->mutex);
+
+	return ret;
+}
+
+/*
+ * Program a readout window within the current linear mode. The blanking is
+ * kept, so VTS shrinks with the window height and the frame rate goes up.
+ */
+static int imx334_set_selection(struct v4l2_subdev *sd,
+				struct v4l2_subdev_pad_config *cfg,
+				struct v4l2_subdev_selection *sel)
+{
+	struct imx334 *imx334 = to_imx334(sd);
+	const struct imx334_mode *mode;
+	struct v4l2_rect r;
+	u32 vblank_def;
+	int ret = 0;
+
+	if (sel->target != V4L2_SEL_TGT_CROP)
+		return -EINVAL;
+
+	mutex_lock(&imx334->mutex);
+	mode = imx334->cur_mode;
+	if (mode->hdr_mode != NO_HDR) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	r.width = clamp_t(u32, ALIGN_DOWN(sel->r.width, IMX334_CROP_ALIGN),
+			  IMX334_CROP_MIN, mode->width);
+	r.height = clamp_t(u32, ALIGN_DOWN(sel->r.height, IMX334_CROP_ALIGN),
+			   IMX334_CROP_MIN, mode->height);
+	r.left = min_t(u32, ALIGN_DOWN(max(sel->r.left, 0), IMX334_CROP_ALIGN),
+		       mode->width - r.width);
+	r.top = min_t(u32, ALIGN_DOWN(max(sel->r.top, 0), IMX334_CROP_ALIGN),
+		      mode->height - r.height);
+	sel->r = r;
+	if (sel->which == V4L2_SUBDEV_FORMAT_TRY)
+		goto unlock;
+
+	if (imx334->streaming) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	imx334->crop = r;
+	vblank_def = mode->vts_def - mode->height;
+	imx334->cur_vts = imx334_vts_min(imx334);
+	__v4l2_ctrl_modify_range(imx334->vblank, vblank_def,
+				 IMX334_VTS_MAX - r.height, 1, vblank_def);
+	__v4l2_ctrl_s_ctrl(imx334->vblank, vblank_def);
+	__v4l2_ctrl_modify_range(imx334->exposure, imx334->exposure->minimum,
+				 imx334->cur_vts - 4, imx334->exposure->step,
+				 imx334->exposure->default_value);
+	weewa_skew_update(&imx334->skew, &mode->max_fps, mode->vts_def,
+			  r.height, mode->hdr_mode);
+
+unlock:
+	mutex_unlock(&imx334->mutex);
+	return ret;
+}
+
+/* stop and power down, resume restarts a running stream */
+static int __maybe_unused imx334_suspend(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct imx334 *imx334 = to_imx334(sd);
+	int ret;
+
+	mutex_lock(&imx334->mutex);
+	if (imx334->streaming)
+		__imx334_stop_stream(imx334);
+	mutex_unlock(&imx334->mutex);
+
+	ret = pm_runtime_force_suspend(dev);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+static int __maybe_unused imx334_resume(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct imx334 *imx334 = to_imx334(sd);
+	int ret;
+
+	ret = pm_runtime_force_resume(dev);
+	if (ret)
+		return ret;
+
+	mutex_lock(&imx334->mutex);
+	if (imx334->streaming) {
+		ret = __imx334_start_stream(imx334);
+		if (ret)
+			dev_err(dev, "restart stream after resume failed\n");
+	}
+	mutex_unlock(&imx334->mutex);
+
+	return ret;
 }
 
 static const struct dev_pm_ops imx334_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(imx334_suspend, imx334_resume)
 	SET_RUNTIME_PM_OPS(imx334_runtime_suspend,
 			   imx334_runtime_resume, NULL)
 };
@@ -1593,11 +2276,14 @@ static const struct v4l2_subdev_core_ops imx334_core_ops = {
 #ifdef CONFIG_COMPAT
 	.compat_ioctl32 = imx334_compat_ioctl32,
 #endif
+	.subscribe_event = weewa_subscribe_event,
+	.unsubscribe_event = v4l2_event_subdev_unsubscribe,
 };
 
 static const struct v4l2_subdev_video_ops imx334_video_ops = {
 	.s_stream = imx334_s_stream,
 	.g_frame_interval = imx334_g_frame_interval,
+	.s_frame_interval = imx334_s_frame_interval,
 };
 
 static const struct v4l2_subdev_pad_ops imx334_pad_ops = {
@@ -1607,6 +2293,7 @@ static const struct v4l2_subdev_pad_ops imx334_pad_ops = {
 	.get_fmt = imx334_get_fmt,
 	.set_fmt = imx334_set_fmt,
 	.get_selection = imx334_get_selection,
+	.set_selection = imx334_set_selection,
 	.get_mbus_config = imx334_g_mbus_config,
 };
 
@@ -1616,29 +2303,78 @@ static const struct v4l2_subdev_ops imx334_subdev_ops = {
 	.pad	= &imx334_pad_ops,
 };
 
+/* mirror and flip, latched together at the next frame while streaming */
+static int imx334_set_flip(struct imx334 *imx334)
+{
+	struct i2c_client *client = imx334->client;
+	u8 vadj = (imx334->flip & WEEWA_FLIP_V) ? 0xfe : 0x02;
+	int ret = 0;
+
+	if (imx334->streaming)
+		ret = imx334_write_reg(client, IMX334_REG_HOLD,
+				       IMX334_REG_VALUE_08BIT, 1);
+	ret |= imx334_write_reg(client, IMX334_HREVERSE_REG,
+				IMX334_REG_VALUE_08BIT,
+				!!(imx334->flip & WEEWA_FLIP_H));
+	ret |= imx334_write_reg(client, IMX334_VREVERSE_REG,
+				IMX334_REG_VALUE_08BIT,
+				!!(imx334->flip & WEEWA_FLIP_V));
+	ret |= imx334_write_reg(client, 0x3080, IMX334_REG_VALUE_08BIT, vadj);
+	ret |= imx334_write_reg(client, 0x309b, IMX334_REG_VALUE_08BIT, vadj);
+	if (imx334->streaming)
+		ret |= imx334_write_reg(client, IMX334_REG_HOLD,
+					IMX334_REG_VALUE_08BIT, 0);
+
+	return ret;
+}
+
 static int imx334_set_ctrl(struct v4l2_ctrl *ctrl)
 {
 	struct imx334 *imx334 = container_of(ctrl->handler,
 					     struct imx334, ctrl_handler);
 	struct i2c_client *client = imx334->client;
 	s64 max;
+	u64 old_ns;
 	int ret = 0;
 	u32 shr0 = 0;
 	u32 vts = 0;
-	u32 flip = 0;
+	u8 flip;
 
 	/* Propagate change of current control to all related controls */
 	switch (ctrl->id) {
+	case V4L2_CID_HFLIP:
+		/* the cluster brings VFLIP along, both values are the new ones */
+		flip = (imx334->h_flip->val ? WEEWA_FLIP_H : 0) |
+		       (imx334->v_flip->val ? WEEWA_FLIP_V : 0);
+		if (flip != imx334->flip) {
+			imx334->flip = flip;
+			weewa_notify_src_change(&imx334->subdev);
+		}
+		break;
 	case V4L2_CID_VBLANK:
 		/* Update max exposure while meeting expected vblanking */
-		max = imx334->cur_mode->height + ctrl->val - 4;
+		max = imx334->crop.height + ctrl->val - 4;
 		__v4l2_ctrl_modify_range(imx334->exposure,
 					 imx334->exposure->minimum, max,
 					 imx334->exposure->step,
 					 imx334->exposure->default_value);
 		break;
+	case V4L2_CID_EXPOSURE:
+		weewa_exp_us_track(&imx334->exp_us, ctrl->val);
+		break;
+	case WEEWA_CID_EXPOSURE_US:
+		if (imx334->cur_mode->hdr_mode == HDR_X2)
+			return imx334_set_hdr_exposure_us(imx334, ctrl);
+		/* written to the sensor through V4L2_CID_EXPOSURE */
+		return weewa_exp_us_apply(&imx334->exp_us, imx334->exposure,
+					  ctrl);
 	}
 
+	/* written by imx334_sync_set_ae under its own register hold */
+	if (imx334->group_ae && (ctrl->id == V4L2_CID_EXPOSURE ||
+				 ctrl->id == V4L2_CID_ANALOGUE_GAIN))
+		return 0;
+
 	if (!pm_runtime_get_if_in_use(&client->dev))
 		return 0;
 
@@ -1658,14 +2394,23 @@ static int imx334_set_ctrl(struct v4l2_ctrl *ctrl)
 					IMX334_LF_EXPO_REG_L,
 					IMX334_REG_VALUE_08BIT,
 					IMX334_FETCH_EXP_L(shr0));
+		if (!ret)
+			weewa_frame_set_ae(&imx334->frames, ctrl->val,
+					   imx334->anal_gain->val, imx334->streaming,
+					   imx334_frame_ns(imx334));
 		break;
 	case V4L2_CID_ANALOGUE_GAIN:
 		ret = imx334_write_reg(imx334->client,
 				       IMX334_REG_GAIN,
 				       IMX334_REG_VALUE_08BIT, ctrl->val);
+		if (!ret)
+			weewa_frame_set_ae(&imx334->frames, imx334->exposure->val,
+					   ctrl->val, imx334->streaming,
+					   imx334_frame_ns(imx334));
 		break;
 	case V4L2_CID_VBLANK:
-		vts = ctrl->val + imx334->cur_mode->height;
+		old_ns = imx334_frame_ns(imx334);
+		vts = ctrl->val + imx334->crop.height;
 		/*
 		 * vts of hdr mode is double to correct T-line calculation.
 		 * Restore before write to reg.
@@ -1689,31 +2434,15 @@ static int imx334_set_ctrl(struct v4l2_ctrl *ctrl)
 					IMX334_REG_VTS_L,
 					IMX334_REG_VALUE_08BIT,
 					IMX334_FETCH_VTS_L(vts));
+		if (!ret)
+			weewa_frame_relength(&imx334->frames, imx334->streaming,
+					     old_ns, imx334_frame_ns(imx334));
 		break;
 	case V4L2_CID_TEST_PATTERN:
 		ret = imx334_enable_test_pattern(imx334, ctrl->val);
 		break;
 	case V4L2_CID_HFLIP:
-		ret = imx334_write_reg(imx334->client, IMX334_HREVERSE_REG,
-				       IMX334_REG_VALUE_08BIT, !!ctrl->val);
-		break;
-	case V4L2_CID_VFLIP:
-		flip = ctrl->val;
-		if (flip) {
-			ret = imx334_write_reg(imx334->client, IMX334_VREVERSE_REG,
-				IMX334_REG_VALUE_08BIT, !!flip);
-			ret |= imx334_write_reg(imx334->client, 0x3080,
-				IMX334_REG_VALUE_08BIT, 0xfe);
-			ret |= imx334_write_reg(imx334->client, 0x309b,
-				IMX334_REG_VALUE_08BIT, 0xfe);
-		} else {
-			ret = imx334_write_reg(imx334->client, IMX334_VREVERSE_REG,
-				IMX334_REG_VALUE_08BIT, !!flip);
-			ret |= imx334_write_reg(imx334->client, 0x3080,
-				IMX334_REG_VALUE_08BIT, 0x02);
-			ret |= imx334_write_reg(imx334->client, 0x309b,
-				IMX334_REG_VALUE_08BIT, 0x02);
-		}
+		ret = imx334_set_flip(imx334);
 		break;
 	default:
 		dev_warn(&client->dev, "%s Unhandled id:0x%x, val:0x%x\n",
@@ -1741,7 +2470,7 @@ static int imx334_initialize_controls(struct imx334 *imx334)
 
 	handler = &imx334->ctrl_handler;
 	mode = imx334->cur_mode;
-	ret = v4l2_ctrl_handler_init(handler, 9);
+	ret = v4l2_ctrl_handler_init(handler, 12);
 	if (ret)
 		return ret;
 	handler->lock = &imx334->mutex;
@@ -1751,7 +2480,7 @@ static int imx334_initialize_controls(struct imx334 *imx334)
 						   2, 0, imx334_link_freq_menu_items);
 
 	dst_pixel_rate = ((u32)imx334_link_freq_menu_items[mode->mipi_freq_idx]) /
-		mode->bpp * 2 * IMX334_LANES;
+		mode->bpp * 2 * imx334->lanes;
 
 	imx334->pixel_rate = v4l2_ctrl_new_std(handler, NULL,
 					       V4L2_CID_PIXEL_RATE,
@@ -1768,6 +2497,7 @@ static int imx334_initialize_controls(struct imx334 *imx334)
 	if (imx334->hblank)
 		imx334->hblank->flags |= V4L2_CTRL_FLAG_READ_ONLY;
 
+	imx334_reset_crop(imx334);
 	vblank_def = mode->vts_def - mode->height;
 	imx334->vblank = v4l2_ctrl_new_std(handler, &imx334_ctrl_ops,
 					   V4L2_CID_VBLANK, vblank_def,
@@ -1795,8 +2525,15 @@ static int imx334_initialize_controls(struct imx334 *imx334)
 				ARRAY_SIZE(imx334_test_pattern_menu) - 1,
 				0, 0, imx334_test_pattern_menu);
 
-	v4l2_ctrl_new_std(handler, &imx334_ctrl_ops, V4L2_CID_HFLIP, 0, 1, 1, 0);
-	v4l2_ctrl_new_std(handler, &imx334_ctrl_ops, V4L2_CID_VFLIP, 0, 1, 1, 0);
+	imx334->h_flip = v4l2_ctrl_new_std(handler, &imx334_ctrl_ops,
+					   V4L2_CID_HFLIP, 0, 1, 1, 0);
+	imx334->v_flip = v4l2_ctrl_new_std(handler, &imx334_ctrl_ops,
+					   V4L2_CID_VFLIP, 0, 1, 1, 0);
+	v4l2_ctrl_cluster(2, &imx334->h_flip);
+	imx334->flip = 0;
+
+	weewa_skew_init(handler, &imx334->skew);
+	weewa_exp_us_init(handler, &imx334_ctrl_ops, &imx334->exp_us);
 
 	if (handler->error) {
 		ret = handler->error;
@@ -1805,8 +2542,16 @@ static int imx334_initialize_controls(struct imx334 *imx334)
 		goto err_free_handler;
 	}
 
+	mutex_lock(&imx334->mutex);
+	weewa_skew_update(&imx334->skew, &mode->max_fps, mode->vts_def,
+			  mode->height, mode->hdr_mode);
+	weewa_exp_us_update(&imx334->exp_us, &mode->max_fps, mode->vts_def,
+			    imx334->exposure->val);
+	mutex_unlock(&imx334->mutex);
+
 	imx334->subdev.ctrl_handler = handler;
 	imx334->has_init_exp = false;
+	imx334->has_hdrae_exp = false;
 	return 0;
 
 err_free_handler:
@@ -1840,6 +2585,178 @@ static int imx334_check_sensor_id(struct imx334 *imx334,
 	return 0;
 }
 
+static int imx334_parse_lanes(struct imx334 *imx334)
+{
+	struct device *dev = &imx334->client->dev;
+	int ret;
+
+	ret = weewa_parse_lanes(dev, &imx334->lanes);
+	if (ret)
+		return ret;
+
+	switch (imx334->lanes) {
+	case IMX334_LANES:
+		imx334->supported_modes = imx334_supported_modes;
+		imx334->cfg_num = ARRAY_SIZE(imx334_supported_modes);
+		break;
+	case IMX334_LANES_2:
+		imx334->supported_modes = imx334_supported_modes_2lane;
+		imx334->cfg_num = ARRAY_SIZE(imx334_supported_modes_2lane);
+		break;
+	default:
+		dev_err(dev, "unsupported data-lanes %u\n", imx334->lanes);
+		return -EINVAL;
+	}
+	dev_info(dev, "%u data lanes\n", imx334->lanes);
+
+	return 0;
+}
+
+/* (code, hdr_mode) bucketed keys of the lane count's mode table */
+static int imx334_build_mode_index(struct imx334 *imx334)
+{
+	const struct imx334_mode *mode;
+	u32 i;
+
+	imx334->mode_index = devm_kcalloc(&imx334->client->dev, imx334->cfg_num,
+					  sizeof(*imx334->mode_index),
+					  GFP_KERNEL);
+	if (!imx334->mode_index)
+		return -ENOMEM;
+
+	for (i = 0; i < imx334->cfg_num; i++) {
+		mode = &imx334->supported_modes[i];
+		weewa_mode_key_fill(&imx334->mode_index[i], i, mode->width,
+				    mode->height, mode->bus_fmt, mode->hdr_mode,
+				    &mode->max_fps, mode->bpp, mode->vts_def);
+	}
+	weewa_mode_index_sort(imx334->mode_index, imx334->cfg_num);
+
+	return 0;
+}
+
+static int imx334_join_power_group(struct imx334 *imx334)
+{
+	struct weewa_pwr_member *pwr = &imx334->pwr;
+
+	pwr->dev = &imx334->client->dev;
+	pwr->xvclk = imx334->xvclk;
+	pwr->reset_gpio = imx334->reset_gpio;
+	pwr->pwdn_gpio = imx334->pwdn_gpio;
+	pwr->supplies = imx334->supplies;
+	pwr->num_supplies = IMX334_NUM_SUPPLIES;
+	pwr->pinctrl = imx334->pinctrl;
+	pwr->pins_default = imx334->pins_default;
+	pwr->reset_delay_us = 500;
+	/* a sibling may power the group before this sensor first does */
+	imx334_set_xvclk_rate(imx334);
+
+	return weewa_pwr_join(pwr);
+}
+
+static int imx334_sync_release(void *priv)
+{
+	struct imx334 *imx334 = priv;
+	int ret;
+
+	ret = imx334_write_reg(imx334->client, IMX334_REG_CTRL_MODE,
+			       IMX334_REG_VALUE_08BIT, IMX334_MODE_STREAMING);
+	if (!ret)
+		weewa_frame_start(&imx334->frames);
+
+	return ret;
+}
+
+static bool imx334_sync_running(void *priv)
+{
+	struct imx334 *imx334 = priv;
+	u32 val = 0;
+
+	if (imx334_read_reg(imx334->client, IMX334_REG_CTRL_MODE,
+			    IMX334_REG_VALUE_08BIT, &val))
+		return false;
+
+	return val == IMX334_MODE_STREAMING;
+}
+
+static int imx334_sync_set_ae(void *priv, u32 exposure, u32 gain)
+{
+	struct imx334 *imx334 = priv;
+	struct i2c_client *client = imx334->client;
+	u32 shr0;
+	int ret;
+
+	if (!mutex_trylock(&imx334->mutex))
+		return -EBUSY;
+
+	if (imx334->cur_mode->hdr_mode != NO_HDR) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	exposure = clamp_t(u32, exposure, imx334->exposure->minimum,
+			   imx334->exposure->maximum);
+	gain = clamp_t(u32, gain, IMX334_GAIN_MIN, IMX334_GAIN_MAX);
+	shr0 = imx334->cur_vts - exposure;
+
+	ret = imx334_write_reg(client, IMX334_REG_HOLD, IMX334_REG_VALUE_08BIT, 1);
+	ret |= imx334_write_reg(client, IMX334_LF_EXPO_REG_L, IMX334_REG_VALUE_08BIT,
+				IMX334_FETCH_EXP_L(shr0));
+	ret |= imx334_write_reg(client, IMX334_LF_EXPO_REG_M, IMX334_REG_VALUE_08BIT,
+				IMX334_FETCH_EXP_M(shr0));
+	ret |= imx334_write_reg(client, IMX334_LF_EXPO_REG_H, IMX334_REG_VALUE_08BIT,
+				IMX334_FETCH_EXP_H(shr0));
+	ret |= imx334_write_reg(client, IMX334_REG_GAIN, IMX334_REG_VALUE_08BIT, gain);
+	ret |= imx334_write_reg(client, IMX334_REG_HOLD, IMX334_REG_VALUE_08BIT, 0);
+	if (!ret) {
+		/* already in the registers, only bring the controls in line */
+		imx334->group_ae = true;
+		__v4l2_ctrl_s_ctrl(imx334->exposure, exposure);
+		__v4l2_ctrl_s_ctrl(imx334->anal_gain, gain);
+		imx334->group_ae = false;
+		weewa_frame_set_ae(&imx334->frames, exposure, gain, true,
+				   imx334_frame_ns(imx334));
+	}
+unlock:
+	mutex_unlock(&imx334->mutex);
+
+	return ret;
+}
+
+static int imx334_sync_frame_pos(void *priv, u32 *frame, u64 *pos_ns,
+				 u64 *frame_ns)
+{
+	struct imx334 *imx334 = priv;
+
+	if (!mutex_trylock(&imx334->mutex))
+		return -EBUSY;
+	*frame_ns = imx334_frame_ns(imx334);
+	*frame = weewa_frame_position(&imx334->frames, *frame_ns, pos_ns);
+	mutex_unlock(&imx334->mutex);
+
+	return 0;
+}
+
+static const struct weewa_sync_ops imx334_sync_ops = {
+	.release = imx334_sync_release,
+	.running = imx334_sync_running,
+	.set_ae = imx334_sync_set_ae,
+	.frame_pos = imx334_sync_frame_pos,
+};
+
+static int imx334_join_sync_group(struct imx334 *imx334)
+{
+	struct weewa_sync_member *sync = &imx334->sync;
+
+	sync->dev = &imx334->client->dev;
+	sync->ops = &imx334_sync_ops;
+	sync->priv = imx334;
+	sync->mode = &imx334->sync_mode;
+	sync->index = imx334->module_index;
+
+	return weewa_sync_join(sync);
+}
+
 static int imx334_configure_regulators(struct imx334 *imx334)
 {
 	unsigned int i;
@@ -1852,8 +2769,13 @@ static int imx334_configure_regulators(struct imx334 *imx334)
 				       imx334->supplies);
 }
 
-static int imx334_probe(struct i2c_client *client,
-			const struct i2c_device_id *id)
+/*
+ * When @detected is set the caller has already powered the sensor and read
+ * its chip id, so the power-on sequence and the id check are left to the
+ * first runtime resume instead of being repeated on the boot path.
+ */
+static int __imx334_probe(struct i2c_client *client,
+			  const struct i2c_device_id *id, bool detected)
 {
 	struct device *dev = &client->dev;
 	struct device_node *node = dev->of_node;
@@ -1863,12 +2785,14 @@ static int imx334_probe(struct i2c_client *client,
 	int ret;
 	u32 i, hdr_mode = 0;
 	const char *sync_mode_name = NULL;
+	ktime_t t_start, t_ctrl, t_power, t_id, t_end;
 
 	dev_info(dev, "driver version: %02x.%02x.%02x",
 		 DRIVER_VERSION >> 16,
 		 (DRIVER_VERSION & 0xff00) >> 8,
 		 DRIVER_VERSION & 0x00ff);
 
+	t_start = ktime_get();
 	imx334 = devm_kzalloc(dev, sizeof(*imx334), GFP_KERNEL);
 	if (!imx334)
 		return -ENOMEM;
@@ -1901,14 +2825,21 @@ static int imx334_probe(struct i2c_client *client,
 			imx334->sync_mode = SLAVE_MODE;
 	}
 	imx334->client = client;
-	for (i = 0; i < ARRAY_SIZE(imx334_supported_modes); i++) {
-		if (hdr_mode == imx334_supported_modes[i].hdr_mode) {
-			imx334->cur_mode = &imx334_supported_modes[i];
+	ret = imx334_parse_lanes(imx334);
+	if (ret)
+		return ret;
+	ret = imx334_build_mode_index(imx334);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < imx334->cfg_num; i++) {
+		if (hdr_mode == imx334->supported_modes[i].hdr_mode) {
+			imx334->cur_mode = &imx334->supported_modes[i];
 			break;
 		}
 	}
-	if (i == ARRAY_SIZE(imx334_supported_modes))
-		imx334->cur_mode = &imx334_supported_modes[0];
+	if (i == imx334->cfg_num)
+		imx334->cur_mode = &imx334->supported_modes[0];
 
 	imx334->xvclk = devm_clk_get(dev, "xvclk");
 	if (IS_ERR(imx334->xvclk)) {
@@ -1947,6 +2878,16 @@ static int imx334_probe(struct i2c_client *client,
 		return ret;
 	}
 
+	ret = imx334_join_power_group(imx334);
+	if (ret)
+		return ret;
+
+	ret = imx334_join_sync_group(imx334);
+	if (ret) {
+		weewa_pwr_leave(&imx334->pwr);
+		return ret;
+	}
+
 	mutex_init(&imx334->mutex);
 
 	sd = &imx334->subdev;
@@ -1955,18 +2896,25 @@ static int imx334_probe(struct i2c_client *client,
 	ret = imx334_initialize_controls(imx334);
 	if (ret)
 		goto err_destroy_mutex;
+	t_ctrl = ktime_get();
 
-	ret = __imx334_power_on(imx334);
-	if (ret)
-		goto err_free_handler;
+	if (!detected) {
+		ret = __imx334_power_on(imx334);
+		if (ret)
+			goto err_free_handler;
+		t_power = ktime_get();
 
-	ret = imx334_check_sensor_id(imx334, client);
-	if (ret)
-		goto err_power_off;
+		ret = imx334_check_sensor_id(imx334, client);
+		if (ret)
+			goto err_power_off;
+	} else {
+		t_power = t_ctrl;
+	}
+	t_id = ktime_get();
 
 #ifdef CONFIG_VIDEO_V4L2_SUBDEV_API
 	sd->internal_ops = &imx334_internal_ops;
-	sd->flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
+	sd->flags |= V4L2_SUBDEV_FL_HAS_DEVNODE | V4L2_SUBDEV_FL_HAS_EVENTS;
 #endif
 #if defined(CONFIG_MEDIA_CONTROLLER)
 	imx334->pad.flags = MEDIA_PAD_FL_SOURCE;
@@ -1991,9 +2939,22 @@ static int imx334_probe(struct i2c_client *client,
 		goto err_clean_entity;
 	}
 
-	pm_runtime_set_active(dev);
-	pm_runtime_enable(dev);
-	pm_runtime_idle(dev);
+	if (detected) {
+		pm_runtime_enable(dev);
+	} else {
+		pm_runtime_set_active(dev);
+		pm_runtime_enable(dev);
+		pm_runtime_idle(dev);
+	}
+
+	t_end = ktime_get();
+	if (boot_timing)
+		dev_info(dev, "probe timing(us): ctrls %lld, power %lld, id %lld, register %lld, total %lld\n",
+			 ktime_us_delta(t_ctrl, t_start),
+			 ktime_us_delta(t_power, t_ctrl),
+			 ktime_us_delta(t_id, t_power),
+			 ktime_us_delta(t_end, t_id),
+			 ktime_us_delta(t_end, t_start));
 
 	return 0;
 
@@ -2002,11 +2963,14 @@ err_clean_entity:
 	media_entity_cleanup(&sd->entity);
 #endif
 err_power_off:
-	__imx334_power_off(imx334);
+	if (!detected)
+		__imx334_power_off(imx334);
 err_free_handler:
 	v4l2_ctrl_handler_free(&imx334->ctrl_handler);
 err_destroy_mutex:
 	mutex_destroy(&imx334->mutex);
+	weewa_sync_leave(&imx334->sync);
+	weewa_pwr_leave(&imx334->pwr);
 
 	return ret;
 }
@@ -2027,11 +2991,19 @@ static int imx334_remove(struct i2c_client *client)
 	if (!pm_runtime_status_suspended(&client->dev))
 		__imx334_power_off(imx334);
 	pm_runtime_set_suspended(&client->dev);
+	weewa_sync_leave(&imx334->sync);
+	weewa_pwr_leave(&imx334->pwr);
 
 	return 0;
 }
 
 #ifndef INNOSZ_WEEWA_DRIVER
+static int imx334_probe(struct i2c_client *client,
+			const struct i2c_device_id *id)
+{
+	return __imx334_probe(client, id, false);
+}
+
 #if IS_ENABLED(CONFIG_OF)
 static const struct of_device_id imx334_of_match[] = {
 	{ .compatible = "sony,imx334" },
@@ -2050,6 +3022,7 @@ static struct i2c_driver imx334_i2c_driver = {
 		.name = IMX334_NAME,
 		.pm = &imx334_pm_ops,
 		.of_match_table = of_match_ptr(imx334_of_match),
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe		= &imx334_probe,
 	.remove		= &imx334_remove,
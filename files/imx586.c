@@ -4,6 +4,16 @@
  *
  * Copyright (C) 2017 Rockchip Electronics Co., Ltd.
  * V0.0X01.0X00 init version.
+ * V0.0X01.0X01 asynchronous probe, optional probe timing.
+ * V0.0X01.0X02 real power off, clock gated standby tier on short idle.
+ * V0.0X01.0X03 can be built into the weewa wrapper driver.
+ * V0.0X01.0X04 add s_frame_interval, frame rate set through VTS
+ * V0.0X01.0X05 enable 48MP modes, write only changed registers on switch
+ * V0.0X01.0X06 add 3840x2160 50fps and 1920x1080 120fps binned modes
+ * V0.0X01.0X07 add WEEWA_CMD_SWITCH_MODE, mode switch while streaming
+ * V0.0X01.0X08 pick modes by size, bus format, HDR and frame interval
+ * V0.0X01.0X09 add exposure control in microseconds
+ * V0.0X01.0X0A apply flips while streaming, bus code follows the Bayer order
  */
 
 //#define DEBUG
@@ -12,12 +22,14 @@
 #include <linux/delay.h>
 #include <linux/gpio/consumer.h>
 #include <linux/i2c.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/pm_runtime.h>
 #include <linux/regulator/consumer.h>
 #include <linux/sysfs.h>
 #include <linux/slab.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 #include <linux/rk-camera-module.h>
 #include <media/media-entity.h>
 #include <media/v4l2-async.h>
@@ -33,28 +45,33 @@
 #include <linux/mfd/syscon.h>
 #include <linux/rk-preisp.h>
 #include "otp_eeprom.h"
+#include "weewa_frame.h"
+#include "weewa_mode.h"
+#include "weewa_timing.h"
 
-#define DRIVER_VERSION			KERNEL_VERSION(0, 0x01, 0x00)
+#define IMX586_DRIVER_VERSION			KERNEL_VERSION(0, 0x01, 0x0A)
 
 #ifndef V4L2_CID_DIGITAL_GAIN
 #define V4L2_CID_DIGITAL_GAIN		V4L2_CID_GAIN
 #endif
 
 #define IMX586_LINK_FREQ_400		400000000	// 800Mbps per lane
+#define IMX586_LINK_FREQ_574		574000000	// 1148Mbps per lane
 #define IMX586_LINK_FREQ_625		625000000	// 1250Mbps per lane
 
 #define IMX586_LANES			4
 
-#define PIXEL_RATE_WITH_848M_10BIT	(IMX586_LINK_FREQ_400 * 2 / 10 * 4)
-#define PIXEL_RATE_WITH_848M_12BIT	(IMX586_LINK_FREQ_400 * 2 / 12 * 4)
+#define PIXEL_RATE_WITH_625M_10BIT	(IMX586_LINK_FREQ_625 * 2 / 10 * 4)
 
 #define IMX586_XVCLK_FREQ		24000000
 
-#define CHIP_ID				0x0586
+#define IMX586_CHIP_ID				0x0586
 #define IMX586_REG_CHIP_ID_H		0x0016
 #define IMX586_REG_CHIP_ID_L		0x0017
 
+#define IMX586_REG_FRAME_COUNT		0x0005
 #define IMX586_REG_CTRL_MODE		0x0100
+#define IMX586_REG_HOLD			0x0104
 #define IMX586_MODE_SW_STANDBY		0x0
 #define IMX586_MODE_STREAMING		0x1
 
@@ -109,8 +126,9 @@
 #define IMX586_FETCH_RHS1_M(VAL)	(((VAL) >> 8) & 0xFF)
 #define IMX586_FETCH_RHS1_L(VAL)	((VAL) & 0xFF)
 
-#define REG_DELAY			0xFFFE
-#define REG_NULL			0xFFFF
+#define IMX586_REG_DELAY			0xFFFE
+#define IMX586_REG_NULL			0xFFFF
+#define IMX586_BURST_LEN		32
 
 #define IMX586_REG_VALUE_08BIT		1
 #define IMX586_REG_VALUE_16BIT		2
@@ -130,12 +148,34 @@ static const char * const imx586_supply_names[] = {
 
 #define IMX586_NUM_SUPPLIES ARRAY_SIZE(imx586_supply_names)
 
-struct regval {
+#ifndef INNOSZ_WEEWA_DRIVER
+static bool boot_timing;
+module_param(boot_timing, bool, 0644);
+MODULE_PARM_DESC(boot_timing, "print per-phase probe timing");
+#endif
+
+static unsigned int poweroff_delay_ms = 3000;
+module_param(poweroff_delay_ms, uint, 0644);
+MODULE_PARM_DESC(poweroff_delay_ms,
+		 "idle time in standby before full power off, 0 powers off at once");
+
+/*
+ * Power tiers, cheapest resume first. In STANDBY the supplies stay up and
+ * XCLR stays released so the register contents survive, only xvclk is
+ * gated; OFF drops everything and needs the full power-up sequence.
+ */
+enum imx586_pwr_state {
+	IMX586_PWR_OFF = 0,
+	IMX586_PWR_STANDBY,
+	IMX586_PWR_ON,
+};
+
+struct imx586_regval {
 	u16 addr;
 	u8 val;
 };
 
-struct other_data {
+struct imx586_other_data {
 	u32 width;
 	u32 height;
 	u32 bus_fmt;
@@ -151,11 +191,11 @@ struct imx586_mode {
 	u32 hts_def;
 	u32 vts_def;
 	u32 exp_def;
-	const struct regval *global_reg_list;
-	const struct regval *reg_list;
+	const struct imx586_regval *global_reg_list;
+	const struct imx586_regval *reg_list;
 	u32 hdr_mode;
 	u32 mipi_freq_idx;
-	const struct other_data *spd;
+	const struct imx586_other_data *spd;
 	u32 vc[PAD_MAX];
 };
 
@@ -188,6 +228,9 @@ struct imx586 {
 	bool			power_on;
 	const struct imx586_mode *cur_mode;
 	u32			cfg_num;
+	struct weewa_mode_key	*mode_index;
+	/* last s_frame_interval request, set_fmt keeps to it */
+	struct v4l2_fract	want_interval;
 	u32			cur_pixel_rate;
 	u32			cur_link_freq;
 	u32			module_index;
@@ -197,9 +240,20 @@ struct imx586 {
 	u32			cur_vts;
 	bool			has_init_exp;
 	struct preisp_hdrae_exp_s init_hdrae_exp;
+	/* IMX586_*_BIT_MASK, the same bits as WEEWA_FLIP_* */
 	u8			flip;
 	struct otp_info		*otp;
 	u32			spd_id;
+	struct mutex		pwr_lock;
+	struct delayed_work	pwr_work;
+	enum imx586_pwr_state	pwr_state;
+	bool			global_regs_ok;
+	/* mode whose table the sensor holds, NULL when unknown */
+	const struct imx586_mode *loaded_mode;
+	u32			resume_us[IMX586_PWR_ON];
+	struct weewa_frame_track frames;
+	struct weewa_skew	skew;
+	struct weewa_exp_us	exp_us;
 };
 
 #define to_imx586(sd) container_of(sd, struct imx586, subdev)
@@ -209,7 +263,7 @@ struct imx586 {
  *AD:10bit Output:10bit 1696Mbps Master Mode 30fps
  *
  */
-static const struct regval imx586_linear_10bit_global_regs[] = {
+static const struct imx586_regval imx586_linear_10bit_global_regs[] = {
 	/* External Clock Setting */
 	{0x0136, 0x18},
 	{0x0137, 0x00},
@@ -323,10 +377,10 @@ static const struct regval imx586_linear_10bit_global_regs[] = {
 	{0xAF05, 0x48},
 	{0xB07C, 0x02},
 
-	{REG_NULL, 0x00},
+	{IMX586_REG_NULL, 0x00},
 };
 
-static const struct regval imx586_linear_10bit_4000x3000_30fps_nopd_regs[] = {
+static const struct imx586_regval imx586_linear_10bit_4000x3000_30fps_nopd_regs[] = {
 	/* MIPI output setting */
 	{0x0112, 0x0A},
 	{0x0113, 0x0A},
@@ -441,10 +495,262 @@ static const struct regval imx586_linear_10bit_4000x3000_30fps_nopd_regs[] = {
 	{0x3E20, 0x01},
 	{0x3E37, 0x01},
 
-	{REG_NULL, 0x00},
+	{IMX586_REG_NULL, 0x00},
+};
+
+/*
+ * 2x2 binned like 4000x3000 from a 7680x4320 window at 50fps. The 625MHz
+ * link carries 3840 RAW10 pixels per 9.1us line; 60fps would need 1244Mbps
+ * of payload per lane, no margin left on a 1250Mbps link.
+ */
+static const struct imx586_regval imx586_linear_10bit_3840x2160_50fps_regs[] = {
+	/* MIPI output setting */
+	{0x0112, 0x0A},
+	{0x0113, 0x0A},
+	{0x0114, 0x03},
+
+	/* Line Length PCK Setting */
+	{0x0342, 0x1D},  // 7504
+	{0x0343, 0x50},
+
+	/* Frame Length Lines Setting */
+	{0x0340, 0x08},  // 2200
+	{0x0341, 0x98},
+
+	/* ROI Setting */
+	{0x0344, 0x00},
+	{0x0345, 0xA0},
+	{0x0346, 0x03},
+	{0x0347, 0x48},
+	{0x0348, 0x1E},
+	{0x0349, 0x9F},
+	{0x034A, 0x14},
+	{0x034B, 0x27},
+
+	/* Mode Setting */
+	{0x0220, 0x62},
+	{0x0222, 0x01},
+	{0x0900, 0x01},
+	{0x0901, 0x22},
+	{0x0902, 0x08},
+	{0x3140, 0x00},
+	{0x3246, 0x81},
+	{0x3247, 0x81},
+	{0x3F15, 0x00},
+
+	/* Digital Crop & Scaling */
+	{0x0401, 0x00},
+	{0x0404, 0x00},
+	{0x0405, 0x10},
+	{0x0408, 0x00},
+	{0x0409, 0x00},
+	{0x040A, 0x00},
+	{0x040B, 0x00},
+	{0x040C, 0x0F},
+	{0x040D, 0x00},
+	{0x040E, 0x08},
+	{0x040F, 0x70},
+
+	/* Output Size Setting */
+	{0x034C, 0x0F},
+	{0x034D, 0x00},
+	{0x034E, 0x08},
+	{0x034F, 0x70},
+
+	/* Clock Setting */
+	{0x0301, 0x05},
+	{0x0303, 0x04},
+	{0x0305, 0x04},
+	{0x0306, 0x01},
+	{0x0307, 0x58},
+	{0x030B, 0x02},
+	{0x030D, 0x06},
+	{0x030E, 0x02},
+	{0x030F, 0x71},
+	{0x0310, 0x01},
+
+	/* Other Setting */
+	{0x3620, 0x00},
+	{0x3621, 0x00},
+	{0x3C11, 0x04},
+	{0x3C12, 0x03},
+	{0x3C13, 0x2D},
+	{0x3F0C, 0x00},
+	{0x3F14, 0x00},
+	{0x3F80, 0x01},
+	{0x3F81, 0x90},
+	{0x3F8C, 0x00},
+	{0x3F8D, 0x14},
+	{0x3FF8, 0x01},
+	{0x3FF9, 0x2A},
+	{0x3FFE, 0x00},
+	{0x3FFF, 0x6C},
+
+	/* Integration Setting */
+	{0x0202, 0x08},
+	{0x0203, 0x64},
+	{0x0224, 0x01},
+	{0x0225, 0xF4},
+	{0x3FE0, 0x01},
+	{0x3FE1, 0xF4},
+
+	/* Gain Setting */
+	{0x0204, 0x00},
+	{0x0205, 0x70},
+	{0x0216, 0x00},
+	{0x0217, 0x70},
+	{0x0218, 0x01},
+	{0x0219, 0x00},
+	{0x020E, 0x01},
+	{0x020F, 0x00},
+	{0x0210, 0x01},
+	{0x0211, 0x00},
+	{0x0212, 0x01},
+	{0x0213, 0x00},
+	{0x0214, 0x01},
+	{0x0215, 0x00},
+	{0x3FE2, 0x00},
+	{0x3FE3, 0x70},
+	{0x3FE4, 0x01},
+	{0x3FE5, 0x00},
+
+	/* PDAF TYPE1 Setting */
+	{0x3E20, 0x01},
+	{0x3E37, 0x01},
+
+	{IMX586_REG_NULL, 0x00},
+};
+
+/*
+ * 4x4 binned from the same 7680x4320 window, 120fps. 400MHz would carry
+ * it, it runs at the 4000x3000 mode's 574MHz so WEEWA_CMD_SWITCH_MODE can
+ * move between the two while streaming.
+ */
+static const struct imx586_regval imx586_linear_10bit_1920x1080_120fps_regs[] = {
+	/* MIPI output setting */
+	{0x0112, 0x0A},
+	{0x0113, 0x0A},
+	{0x0114, 0x03},
+
+	/* Line Length PCK Setting */
+	{0x0342, 0x17},  // 6115
+	{0x0343, 0xE3},
+
+	/* Frame Length Lines Setting */
+	{0x0340, 0x04},  // 1125
+	{0x0341, 0x65},
+
+	/* ROI Setting */
+	{0x0344, 0x00},
+	{0x0345, 0xA0},
+	{0x0346, 0x03},
+	{0x0347, 0x48},
+	{0x0348, 0x1E},
+	{0x0349, 0x9F},
+	{0x034A, 0x14},
+	{0x034B, 0x27},
+
+	/* Mode Setting */
+	{0x0220, 0x62},
+	{0x0222, 0x01},
+	{0x0900, 0x01},
+	{0x0901, 0x44},
+	{0x0902, 0x08},
+	{0x3140, 0x00},
+	{0x3246, 0x81},
+	{0x3247, 0x81},
+	{0x3F15, 0x00},
+
+	/* Digital Crop & Scaling */
+	{0x0401, 0x00},
+	{0x0404, 0x00},
+	{0x0405, 0x10},
+	{0x0408, 0x00},
+	{0x0409, 0x00},
+	{0x040A, 0x00},
+	{0x040B, 0x00},
+	{0x040C, 0x07},
+	{0x040D, 0x80},
+	{0x040E, 0x04},
+	{0x040F, 0x38},
+
+	/* Output Size Setting */
+	{0x034C, 0x07},
+	{0x034D, 0x80},
+	{0x034E, 0x04},
+	{0x034F, 0x38},
+
+	/* Clock Setting */
+	{0x0301, 0x05},
+	{0x0303, 0x04},
+	{0x0305, 0x04},
+	{0x0306, 0x01},
+	{0x0307, 0x58},
+	{0x030B, 0x02},
+	{0x030D, 0x03},
+	{0x030E, 0x01},
+	{0x030F, 0x1F},
+	{0x0310, 0x01},
+
+	/* Other Setting */
+	{0x3620, 0x00},
+	{0x3621, 0x00},
+	{0x3C11, 0x04},
+	{0x3C12, 0x03},
+	{0x3C13, 0x2D},
+	{0x3F0C, 0x00},
+	{0x3F14, 0x00},
+	{0x3F80, 0x01},
+	{0x3F81, 0x90},
+	{0x3F8C, 0x00},
+	{0x3F8D, 0x14},
+	{0x3FF8, 0x01},
+	{0x3FF9, 0x2A},
+	{0x3FFE, 0x00},
+	{0x3FFF, 0x6C},
+
+	/* Integration Setting */
+	{0x0202, 0x04},
+	{0x0203, 0x31},
+	{0x0224, 0x01},
+	{0x0225, 0xF4},
+	{0x3FE0, 0x01},
+	{0x3FE1, 0xF4},
+
+	/* Gain Setting */
+	{0x0204, 0x00},
+	{0x0205, 0x70},
+	{0x0216, 0x00},
+	{0x0217, 0x70},
+	{0x0218, 0x01},
+	{0x0219, 0x00},
+	{0x020E, 0x01},
+	{0x020F, 0x00},
+	{0x0210, 0x01},
+	{0x0211, 0x00},
+	{0x0212, 0x01},
+	{0x0213, 0x00},
+	{0x0214, 0x01},
+	{0x0215, 0x00},
+	{0x3FE2, 0x00},
+	{0x3FE3, 0x70},
+	{0x3FE4, 0x01},
+	{0x3FE5, 0x00},
+
+	/* PDAF TYPE1 Setting */
+	{0x3E20, 0x01},
+	{0x3E37, 0x01},
+
+	{IMX586_REG_NULL, 0x00},
 };
 
-static const struct regval imx586_linear_10bit_full_raw_6fps_regs[] = {
+/*
+ * Quad Bayer readout of the full array, not in imx586_supported_modes:
+ * there is no media bus code for its 2x2 colour tiles and it shares size,
+ * code and max_fps with the remosaic 6fps mode, so it could never be
+ * picked nor told apart by the ISP.
+ */
+static __maybe_unused const struct imx586_regval imx586_linear_10bit_full_raw_6fps_regs[] = {
 	/* MIPI output setting */
 	{0x0112, 0x0A},
 	{0x0113, 0x0A},
@@ -559,10 +865,10 @@ static const struct regval imx586_linear_10bit_full_raw_6fps_regs[] = {
 	{0x3E20, 0x01},
 	{0x3E37, 0x01},
 
-	{REG_NULL, 0x00},
+	{IMX586_REG_NULL, 0x00},
 };
 
-static const struct regval imx586_linear_10bit_full_remosaic_6fps_regs[] = {
+static const struct imx586_regval imx586_linear_10bit_full_remosaic_6fps_regs[] = {
 	/* MIPI output setting */
 	{0x0112, 0x0A},
 	{0x0113, 0x0A},
@@ -677,10 +983,10 @@ static const struct regval imx586_linear_10bit_full_remosaic_6fps_regs[] = {
 	{0x3E20, 0x01},
 	{0x3E37, 0x01},
 
-	{REG_NULL, 0x00},
+	{IMX586_REG_NULL, 0x00},
 };
 
-static const struct regval imx586_linear_10bit_full_remosaic_10fps_regs[] = {
+static const struct imx586_regval imx586_linear_10bit_full_remosaic_10fps_regs[] = {
 	/* MIPI output setting */
 	{0x0112, 0x0A},
 	{0x0113, 0x0A},
@@ -795,10 +1101,10 @@ static const struct regval imx586_linear_10bit_full_remosaic_10fps_regs[] = {
 	{0x3E20, 0x01},
 	{0x3E37, 0x01},
 
-	{REG_NULL, 0x00},
+	{IMX586_REG_NULL, 0x00},
 };
 
-static const struct imx586_mode supported_modes[] = {
+static const struct imx586_mode imx586_supported_modes[] = {
 	{
 		.width = 4000,
 		.height = 3000,
@@ -813,42 +1119,62 @@ static const struct imx586_mode supported_modes[] = {
 		.global_reg_list = imx586_linear_10bit_global_regs,
 		.reg_list = imx586_linear_10bit_4000x3000_30fps_nopd_regs,
 		.hdr_mode = NO_HDR,
-		.mipi_freq_idx = 0,
+		.mipi_freq_idx = 1,
 		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
 	},
-#if 0	
 	{
-		.width = 8000,
-		.height = 6000,
+		.width = 3840,
+		.height = 2160,
 		.max_fps = {
 			.numerator = 10000,
-			.denominator = 64100,
+			.denominator = 500000,
 		},
-		.exp_def = 0x0B00,
-		.hts_def = 0x3970,
-		.vts_def = 0x17AC,
+		.exp_def = 0x0800,
+		.hts_def = 0x1D50,
+		.vts_def = 0x0898,
 		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
 		.global_reg_list = imx586_linear_10bit_global_regs,
-		.reg_list = imx586_linear_10bit_full_raw_6fps_regs,
+		.reg_list = imx586_linear_10bit_3840x2160_50fps_regs,
 		.hdr_mode = NO_HDR,
-		.mipi_freq_idx = 0,
+		.mipi_freq_idx = 2,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},
+	{
+		.width = 1920,
+		.height = 1080,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 1200000,
+		},
+		.exp_def = 0x0400,
+		.hts_def = 0x17E3,
+		.vts_def = 0x0465,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
+		.global_reg_list = imx586_linear_10bit_global_regs,
+		.reg_list = imx586_linear_10bit_1920x1080_120fps_regs,
+		.hdr_mode = NO_HDR,
+		.mipi_freq_idx = 1,
 		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
 	},
+	/*
+	 * 48MP remosaic to Bayer: set_fmt alone gets the cheaper 6fps mode,
+	 * a 10fps s_frame_interval the 10fps one.
+	 */
 	{
 		.width = 8000,
 		.height = 6000,
 		.max_fps = {
 			.numerator = 10000,
-			.denominator = 64100,
+			.denominator = 97000,
 		},
 		.exp_def = 0x0B00,
 		.hts_def = 0x3970,
 		.vts_def = 0x17AC,
 		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
 		.global_reg_list = imx586_linear_10bit_global_regs,
-		.reg_list = imx586_linear_10bit_full_remosaic_6fps_regs,
+		.reg_list = imx586_linear_10bit_full_remosaic_10fps_regs,
 		.hdr_mode = NO_HDR,
-		.mipi_freq_idx = 0,
+		.mipi_freq_idx = 2,
 		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
 	},
 	{
@@ -856,23 +1182,24 @@ static const struct imx586_mode supported_modes[] = {
 		.height = 6000,
 		.max_fps = {
 			.numerator = 10000,
-			.denominator = 97000,
+			.denominator = 64100,
 		},
 		.exp_def = 0x0B00,
 		.hts_def = 0x3970,
 		.vts_def = 0x17AC,
 		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
 		.global_reg_list = imx586_linear_10bit_global_regs,
-		.reg_list = imx586_linear_10bit_full_remosaic_10fps_regs,
+		.reg_list = imx586_linear_10bit_full_remosaic_6fps_regs,
 		.hdr_mode = NO_HDR,
-		.mipi_freq_idx = 1,
+		.mipi_freq_idx = 0,
 		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
 	},
-#endif	
 };
 
-static const s64 link_freq_items[] = {
+/* lane rate is 24MHz / OPPRE_DIV (0x030D) * OP_MPY (0x030E) / 2 */
+static const s64 imx586_link_freq_items[] = {
 	IMX586_LINK_FREQ_400,
+	IMX586_LINK_FREQ_574,
 	IMX586_LINK_FREQ_625,
 };
 
@@ -913,21 +1240,32 @@ static int imx586_write_reg(struct i2c_client *client, u16 reg,
 	return 0;
 }
 
+/* consecutive addresses are batched, see imx678_write_array */
 static int imx586_write_array(struct i2c_client *client,
-			      const struct regval *regs)
+			      const struct imx586_regval *regs)
 {
-	u32 i;
-	int ret = 0;
+	u8 buf[IMX586_BURST_LEN + 2];
+	u32 i = 0, n;
 
-	for (i = 0; ret == 0 && regs[i].addr != REG_NULL; i++)
-		if (unlikely(regs[i].addr == REG_DELAY))
+	while (regs[i].addr != IMX586_REG_NULL) {
+		if (unlikely(regs[i].addr == IMX586_REG_DELAY)) {
 			usleep_range(regs[i].val, regs[i].val * 2);
-		else
-			ret = imx586_write_reg(client, regs[i].addr,
-					       IMX586_REG_VALUE_08BIT,
-					       regs[i].val);
+			i++;
+			continue;
+		}
 
-	return ret;
+		buf[0] = regs[i].addr >> 8;
+		buf[1] = regs[i].addr & 0xff;
+		for (n = 0; n < IMX586_BURST_LEN &&
+		     regs[i + n].addr == regs[i].addr + n; n++)
+			buf[n + 2] = regs[i + n].val;
+
+		if (i2c_master_send(client, buf, n + 2) != n + 2)
+			return -EIO;
+		i += n;
+	}
+
+	return 0;
 }
 
 /* Read registers up to 4 at a time */
@@ -964,36 +1302,112 @@ static int imx586_read_reg(struct i2c_client *client, u16 reg, unsigned int len,
 	if (ret != ARRAY_SIZE(msgs) && i == 3)
 		return -EIO;
 
-	*val = be32_to_cpu(data_be);
+	*val = be32_to_cpu(data_be);
+
+	return 0;
+}
+
+/*
+ * All mode tables share one register layout, so a sensor that still holds
+ * @from only needs the registers whose value differs in @to: a preview to
+ * 48MP still switch writes 35 registers instead of the whole table.
+ */
+static int imx586_write_mode_diff(struct i2c_client *client,
+				  const struct imx586_regval *from,
+				  const struct imx586_regval *to)
+{
+	const struct imx586_regval *f;
+	int ret;
+
+	if (from == to)
+		return 0;
+
+	for (; to->addr != IMX586_REG_NULL; to++) {
+		if (to->addr == IMX586_REG_DELAY) {
+			usleep_range(to->val, to->val * 2);
+			continue;
+		}
+		for (f = from; f->addr != IMX586_REG_NULL; f++)
+			if (f->addr == to->addr)
+				break;
+		if (f->addr == to->addr && f->val == to->val)
+			continue;
+		ret = imx586_write_reg(client, to->addr,
+				       IMX586_REG_VALUE_08BIT, to->val);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* link frequency and pixel rate follow the mode's output PLL setting */
+static void imx586_update_link_freq(struct imx586 *imx586,
+				    const struct imx586_mode *mode)
+{
+	u32 bpp = mode->bus_fmt == MEDIA_BUS_FMT_SRGGB12_1X12 ? 12 : 10;
+
+	imx586->cur_link_freq = mode->mipi_freq_idx;
+	imx586->cur_pixel_rate = (u32)imx586_link_freq_items[mode->mipi_freq_idx] /
+				 bpp * 2 * IMX586_LANES;
+}
+
+static const struct imx586_mode *
+imx586_find_mode(struct imx586 *imx586, u32 width, u32 height, u32 code,
+		 const struct v4l2_fract *interval)
+{
+	u32 idx;
+
+	idx = weewa_mode_index_find(imx586->mode_index, imx586->cfg_num,
+				    width, height, code,
+				    imx586->cur_mode->hdr_mode, interval);
 
-	return 0;
+	return &imx586_supported_modes[idx];
 }
 
-static int imx586_get_reso_dist(const struct imx586_mode *mode,
-				struct v4l2_mbus_framefmt *framefmt)
+/* make @mode current and bring the controls in line, mutex held */
+static void imx586_change_mode(struct imx586 *imx586,
+			       const struct imx586_mode *mode)
 {
-	return abs(mode->width - framefmt->width) +
-		   abs(mode->height - framefmt->height);
+	s64 h_blank, vblank_def;
+
+	imx586->cur_mode = mode;
+	imx586->cur_vts = mode->vts_def;
+	h_blank = mode->hts_def - mode->width;
+	__v4l2_ctrl_modify_range(imx586->hblank, h_blank,
+				 h_blank, 1, h_blank);
+	vblank_def = mode->vts_def - mode->height;
+	__v4l2_ctrl_modify_range(imx586->vblank, vblank_def,
+				 IMX586_VTS_MAX - mode->height,
+				 1, vblank_def);
+	weewa_skew_update(&imx586->skew, &mode->max_fps, mode->vts_def,
+			  mode->height, mode->hdr_mode);
+	weewa_exp_us_update(&imx586->exp_us, &mode->max_fps, mode->vts_def,
+			    imx586->exposure->val);
+
+	__v4l2_ctrl_s_ctrl(imx586->vblank, vblank_def);
+	imx586_update_link_freq(imx586, mode);
+	__v4l2_ctrl_s_ctrl(imx586->link_freq, imx586->cur_link_freq);
+	__v4l2_ctrl_s_ctrl_int64(imx586->pixel_rate,
+				 imx586->cur_pixel_rate);
 }
 
-static const struct imx586_mode *
-imx586_find_best_fit(struct imx586 *imx586, struct v4l2_subdev_format *fmt)
+/* VTS for @interval in the current mode, @interval becomes the rate set */
+static int imx586_set_interval(struct imx586 *imx586,
+			       struct v4l2_fract *interval)
 {
-	struct v4l2_mbus_framefmt *framefmt = &fmt->format;
-	int dist;
-	int cur_best_fit = 0;
-	int cur_best_fit_dist = -1;
-	unsigned int i;
+	const struct imx586_mode *mode = imx586->cur_mode;
+	u32 vts;
+	int ret;
 
-	for (i = 0; i < imx586->cfg_num; i++) {
-		dist = imx586_get_reso_dist(&supported_modes[i], framefmt);
-		if (cur_best_fit_dist == -1 || dist < cur_best_fit_dist) {
-			cur_best_fit_dist = dist;
-			cur_best_fit = i;
-		}
-	}
+	vts = weewa_interval_to_vts(&mode->max_fps, mode->vts_def,
+				    mode->vts_def, IMX586_VTS_MAX, interval);
+	/* the vblank control updates the exposure range along with VTS */
+	ret = __v4l2_ctrl_s_ctrl(imx586->vblank, vts - mode->height);
+	weewa_vts_to_interval(&mode->max_fps, mode->vts_def,
+			      mode->height + imx586->vblank->val, interval);
 
-	return &supported_modes[cur_best_fit];
+	return ret;
 }
 
 static int imx586_set_fmt(struct v4l2_subdev *sd,
@@ -1002,13 +1416,14 @@ static int imx586_set_fmt(struct v4l2_subdev *sd,
 {
 	struct imx586 *imx586 = to_imx586(sd);
 	const struct imx586_mode *mode;
-	s64 h_blank, vblank_def;
-	u64 pixel_rate = 0;
+	struct v4l2_fract interval;
 
 	mutex_lock(&imx586->mutex);
 
-	mode = imx586_find_best_fit(imx586, fmt);
-	fmt->format.code = mode->bus_fmt;
+	mode = imx586_find_mode(imx586, fmt->format.width, fmt->format.height,
+				weewa_bayer_flip(fmt->format.code, imx586->flip),
+				&imx586->want_interval);
+	fmt->format.code = weewa_bayer_flip(mode->bus_fmt, imx586->flip);
 	fmt->format.width = mode->width;
 	fmt->format.height = mode->height;
 	fmt->format.field = V4L2_FIELD_NONE;
@@ -1020,20 +1435,10 @@ static int imx586_set_fmt(struct v4l2_subdev *sd,
 		return -ENOTTY;
 #endif
 	} else {
-		imx586->cur_mode = mode;
-		h_blank = mode->hts_def - mode->width;
-		__v4l2_ctrl_modify_range(imx586->hblank, h_blank,
-					 h_blank, 1, h_blank);
-		vblank_def = mode->vts_def - mode->height;
-		__v4l2_ctrl_modify_range(imx586->vblank, vblank_def,
-					 IMX586_VTS_MAX - mode->height,
-					 1, vblank_def);
-
-		__v4l2_ctrl_s_ctrl(imx586->vblank, vblank_def);
-		__v4l2_ctrl_s_ctrl(imx586->link_freq, mode->mipi_freq_idx);
-		pixel_rate = (u32)link_freq_items[mode->mipi_freq_idx] / 10 * 2 * IMX586_LANES;
-		__v4l2_ctrl_s_ctrl_int64(imx586->pixel_rate,
-					 pixel_rate);
+		interval = imx586->want_interval;
+		imx586_change_mode(imx586, mode);
+		if (interval.numerator)
+			imx586_set_interval(imx586, &interval);
 	}
 
 	dev_info(&imx586->client->dev, "%s: mode->mipi_freq_idx(%d)",
@@ -1062,15 +1467,7 @@ static int imx586_get_fmt(struct v4l2_subdev *sd,
 	} else {
 		fmt->format.width = mode->width;
 		fmt->format.height = mode->height;
-		if (imx586->flip & IMX586_MIRROR_BIT_MASK) {
-			fmt->format.code = MEDIA_BUS_FMT_SGRBG10_1X10;
-			if (imx586->flip & IMX586_FLIP_BIT_MASK)
-				fmt->format.code = MEDIA_BUS_FMT_SBGGR10_1X10;
-		} else if (imx586->flip & IMX586_FLIP_BIT_MASK) {
-			fmt->format.code = MEDIA_BUS_FMT_SGBRG10_1X10;
-		} else {
-			fmt->format.code = mode->bus_fmt;
-		}
+		fmt->format.code = weewa_bayer_flip(mode->bus_fmt, imx586->flip);
 		fmt->format.field = V4L2_FIELD_NONE;
 		/* format info: width/height/data type/virctual channel */
 		if (fmt->pad < PAD_MAX && mode->hdr_mode != NO_HDR)
@@ -1091,7 +1488,7 @@ static int imx586_enum_mbus_code(struct v4l2_subdev *sd,
 
 	if (code->index != 0)
 		return -EINVAL;
-	code->code = imx586->cur_mode->bus_fmt;
+	code->code = weewa_bayer_flip(imx586->cur_mode->bus_fmt, imx586->flip);
 
 	return 0;
 }
@@ -1105,13 +1502,14 @@ static int imx586_enum_frame_sizes(struct v4l2_subdev *sd,
 	if (fse->index >= imx586->cfg_num)
 		return -EINVAL;
 
-	if (fse->code != supported_modes[0].bus_fmt)
+	if (weewa_bayer_flip(fse->code, imx586->flip) !=
+	    imx586_supported_modes[0].bus_fmt)
 		return -EINVAL;
 
-	fse->min_width = supported_modes[fse->index].width;
-	fse->max_width = supported_modes[fse->index].width;
-	fse->max_height = supported_modes[fse->index].height;
-	fse->min_height = supported_modes[fse->index].height;
+	fse->min_width = imx586_supported_modes[fse->index].width;
+	fse->max_width = imx586_supported_modes[fse->index].width;
+	fse->max_height = imx586_supported_modes[fse->index].height;
+	fse->min_height = imx586_supported_modes[fse->index].height;
 
 	return 0;
 }
@@ -1137,11 +1535,40 @@ static int imx586_g_frame_interval(struct v4l2_subdev *sd,
 	struct imx586 *imx586 = to_imx586(sd);
 	const struct imx586_mode *mode = imx586->cur_mode;
 
-	fi->interval = mode->max_fps;
+	mutex_lock(&imx586->mutex);
+	weewa_vts_to_interval(&mode->max_fps, mode->vts_def,
+			      mode->height + imx586->vblank->val, &fi->interval);
+	mutex_unlock(&imx586->mutex);
 
 	return 0;
 }
 
+/*
+ * Before streaming the cheapest mode of the current size and format that
+ * reaches the interval is taken, faster ones cost link rate.
+ */
+static int imx586_s_frame_interval(struct v4l2_subdev *sd,
+				   struct v4l2_subdev_frame_interval *fi)
+{
+	struct imx586 *imx586 = to_imx586(sd);
+	const struct imx586_mode *cur = imx586->cur_mode;
+	const struct imx586_mode *mode;
+	int ret;
+
+	mutex_lock(&imx586->mutex);
+	imx586->want_interval = fi->interval;
+	if (!imx586->streaming) {
+		mode = imx586_find_mode(imx586, cur->width, cur->height,
+					cur->bus_fmt, &fi->interval);
+		if (mode != cur)
+			imx586_change_mode(imx586, mode);
+	}
+	ret = imx586_set_interval(imx586, &fi->interval);
+	mutex_unlock(&imx586->mutex);
+
+	return ret;
+}
+
 static int imx586_g_mbus_config(struct v4l2_subdev *sd, unsigned int pad_id,
 				struct v4l2_mbus_config *config)
 {
@@ -1278,11 +1705,137 @@ static int imx586_get_channel_info(struct imx586 *imx586, struct rkmodule_channe
 		ch_info->vc = imx586->cur_mode->vc[ch_info->index];
 		ch_info->width = imx586->cur_mode->width;
 		ch_info->height = imx586->cur_mode->height;
-		ch_info->bus_fmt = imx586->cur_mode->bus_fmt;
+		ch_info->bus_fmt = weewa_bayer_flip(imx586->cur_mode->bus_fmt,
+						    imx586->flip);
 	}
 	return 0;
 }
 
+static u64 imx586_frame_ns(struct imx586 *imx586)
+{
+	const struct imx586_mode *mode = imx586->cur_mode;
+
+	if (!mode->max_fps.denominator || !mode->vts_def)
+		return 0;
+
+	return div64_u64((u64)NSEC_PER_SEC * mode->max_fps.numerator * imx586->cur_vts,
+			 (u64)mode->max_fps.denominator * mode->vts_def);
+}
+
+static void imx586_get_frame_info(struct imx586 *imx586,
+				  struct weewa_frame_info *fi)
+{
+	u64 frame_ns = imx586_frame_ns(imx586);
+	u32 count;
+
+	if (imx586_read_reg(imx586->client, IMX586_REG_FRAME_COUNT,
+			    IMX586_REG_VALUE_08BIT, &count) || count == 0xff)
+		weewa_frame_get_timing(&imx586->frames, frame_ns, fi);
+	else
+		weewa_frame_get_counter(&imx586->frames, frame_ns, count, fi);
+}
+
+static void imx586_get_timing_model(struct imx586 *imx586,
+				    struct weewa_timing_model *tm)
+{
+	const struct imx586_mode *mode;
+
+	mutex_lock(&imx586->mutex);
+	mode = imx586->cur_mode;
+	weewa_timing_fill(tm, &mode->max_fps, mode->vts_def, imx586->cur_vts,
+			  mode->height, mode->hdr_mode);
+	tm->width = mode->width;
+	tm->vts_max = IMX586_VTS_MAX;
+	tm->exposure_min = IMX586_EXPOSURE_MIN;
+	tm->exposure_margin = 4;
+	tm->exposure_step = imx586->exposure->step;
+	tm->gain_min = imx586->anal_gain->minimum;
+	tm->gain_max = imx586->anal_gain->maximum;
+	tm->gain_step = imx586->anal_gain->step;
+	/* exposure, gain and frame length all latch at the next frame */
+	tm->exposure_delay = 1;
+	tm->gain_delay = 1;
+	tm->vts_delay = 1;
+	mutex_unlock(&imx586->mutex);
+}
+
+/* same link format and output PLL, the receiver sees no change */
+static bool imx586_can_switch(struct imx586 *imx586,
+			      const struct imx586_mode *mode)
+{
+	const struct imx586_mode *cur = imx586->cur_mode;
+
+	return imx586->loaded_mode == cur &&
+	       mode->bus_fmt == cur->bus_fmt &&
+	       mode->mipi_freq_idx == cur->mipi_freq_idx;
+}
+
+static int imx586_switch_mode(struct imx586 *imx586,
+			      struct weewa_mode_switch *ms)
+{
+	const struct imx586_mode *mode, *old, *found = NULL;
+	struct i2c_client *client = imx586->client;
+	u32 code = ms->code ? weewa_bayer_flip(ms->code, imx586->flip) :
+			      imx586->cur_mode->bus_fmt;
+	bool match = false;
+	u64 old_ns;
+	u32 i;
+	int ret = 0;
+
+	mutex_lock(&imx586->mutex);
+	for (i = 0; i < imx586->cfg_num; i++) {
+		mode = &imx586_supported_modes[i];
+		if (mode->width != ms->width || mode->height != ms->height ||
+		    mode->bus_fmt != code || mode->hdr_mode != ms->hdr_mode)
+			continue;
+		match = true;
+		if (mode == imx586->cur_mode) {
+			found = mode;
+			break;
+		}
+		if (!found && (!imx586->streaming ||
+			       imx586_can_switch(imx586, mode)))
+			found = mode;
+	}
+	if (!found) {
+		ret = match ? -EBUSY : -EINVAL;
+		goto unlock;
+	}
+
+	if (!imx586->streaming) {
+		ms->frame = 0;
+		imx586_change_mode(imx586, found);
+		goto unlock;
+	}
+
+	old_ns = imx586_frame_ns(imx586);
+	if (found == imx586->cur_mode) {
+		ms->frame = weewa_frame_estimate(&imx586->frames, old_ns);
+		goto unlock;
+	}
+
+	old = imx586->cur_mode;
+	ret = imx586_write_reg(client, IMX586_REG_HOLD, IMX586_REG_VALUE_08BIT, 1);
+	ret |= imx586_write_mode_diff(client, imx586->loaded_mode->reg_list,
+				      found->reg_list);
+	imx586->loaded_mode = ret ? NULL : found;
+	imx586_change_mode(imx586, found);
+	ret |= __v4l2_ctrl_handler_setup(&imx586->ctrl_handler);
+	ret |= imx586_write_reg(client, IMX586_REG_HOLD, IMX586_REG_VALUE_08BIT, 0);
+	ms->frame = weewa_frame_estimate(&imx586->frames, old_ns) + 1;
+	weewa_frame_rebase(&imx586->frames, ms->frame, old_ns,
+			   imx586_frame_ns(imx586));
+	/* the receiver's buffers no longer fit the output */
+	if (found->bus_fmt != old->bus_fmt || found->width != old->width ||
+	    found->height != old->height)
+		weewa_notify_src_change(&imx586->subdev);
+
+unlock:
+	mutex_unlock(&imx586->mutex);
+
+	return ret;
+}
+
 static long imx586_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
 {
 	struct imx586 *imx586 = to_imx586(sd);
@@ -1308,12 +1861,10 @@ static long imx586_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
 		w = imx586->cur_mode->width;
 		h = imx586->cur_mode->height;
 		for (i = 0; i < imx586->cfg_num; i++) {
-			if (w == supported_modes[i].width &&
-			    h == supported_modes[i].height &&
-			    supported_modes[i].hdr_mode == hdr->hdr_mode) {
-				imx586->cur_mode = &supported_modes[i];
+			if (w == imx586_supported_modes[i].width &&
+			    h == imx586_supported_modes[i].height &&
+			    imx586_supported_modes[i].hdr_mode == hdr->hdr_mode)
 				break;
-			}
 		}
 		if (i == imx586->cfg_num) {
 			dev_err(&imx586->client->dev,
@@ -1321,42 +1872,21 @@ static long imx586_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
 				hdr->hdr_mode, w, h);
 			ret = -EINVAL;
 		} else {
-			w = imx586->cur_mode->hts_def -
-			    imx586->cur_mode->width;
-			h = imx586->cur_mode->vts_def -
-			    imx586->cur_mode->height;
-			__v4l2_ctrl_modify_range(imx586->hblank, w, w, 1, w);
-			__v4l2_ctrl_modify_range(imx586->vblank, h,
-						 IMX586_VTS_MAX -
-						 imx586->cur_mode->height,
-						 1, h);
-
-			if (imx586->cur_mode->bus_fmt ==
-			    MEDIA_BUS_FMT_SRGGB10_1X10) {
-				imx586->cur_link_freq = 0;
-				imx586->cur_pixel_rate =
-				PIXEL_RATE_WITH_848M_10BIT;
-			} else if (imx586->cur_mode->bus_fmt ==
-				   MEDIA_BUS_FMT_SRGGB12_1X12) {
-				imx586->cur_link_freq = 0;
-				imx586->cur_pixel_rate =
-				PIXEL_RATE_WITH_848M_12BIT;
-			}
-
-			__v4l2_ctrl_s_ctrl_int64(imx586->pixel_rate,
-						 imx586->cur_pixel_rate);
-			__v4l2_ctrl_s_ctrl(imx586->link_freq,
-					   imx586->cur_link_freq);
+			mutex_lock(&imx586->mutex);
+			imx586_change_mode(imx586, &imx586_supported_modes[i]);
+			mutex_unlock(&imx586->mutex);
 		}
 		break;
 	case RKMODULE_SET_QUICK_STREAM:
 
 		stream = *((u32 *)arg);
 
-		if (stream)
+		if (stream) {
 			ret = imx586_write_reg(imx586->client, IMX586_REG_CTRL_MODE,
 				IMX586_REG_VALUE_08BIT, IMX586_MODE_STREAMING);
-		else
+			if (!ret)
+				weewa_frame_start(&imx586->frames);
+		} else
 			ret = imx586_write_reg(imx586->client, IMX586_REG_CTRL_MODE,
 				IMX586_REG_VALUE_08BIT, IMX586_MODE_SW_STANDBY);
 		break;
@@ -1364,6 +1894,19 @@ static long imx586_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
 		ch_info = (struct rkmodule_channel_info *)arg;
 		ret = imx586_get_channel_info(imx586, ch_info);
 		break;
+	case WEEWA_CMD_GET_FRAME_INFO:
+		if (!imx586->streaming) {
+			ret = -EAGAIN;
+			break;
+		}
+		imx586_get_frame_info(imx586, (struct weewa_frame_info *)arg);
+		break;
+	case WEEWA_CMD_GET_TIMING_MODEL:
+		imx586_get_timing_model(imx586, (struct weewa_timing_model *)arg);
+		break;
+	case WEEWA_CMD_SWITCH_MODE:
+		ret = imx586_switch_mode(imx586, (struct weewa_mode_switch *)arg);
+		break;
 	default:
 		ret = -ENOIOCTLCMD;
 		break;
@@ -1382,6 +1925,9 @@ static long imx586_compat_ioctl32(struct v4l2_subdev *sd,
 	struct rkmodule_hdr_cfg *hdr;
 	struct preisp_hdrae_exp_s *hdrae;
 	struct rkmodule_channel_info *ch_info;
+	struct weewa_frame_info frame_info;
+	struct weewa_timing_model timing;
+	struct weewa_mode_switch mode_switch;
 	long ret;
 	u32 stream = 0;
 
@@ -1477,6 +2023,32 @@ static long imx586_compat_ioctl32(struct v4l2_subdev *sd,
 		}
 		kfree(ch_info);
 		break;
+	case WEEWA_CMD_GET_FRAME_INFO:
+		ret = imx586_ioctl(sd, cmd, &frame_info);
+		if (!ret) {
+			ret = copy_to_user(up, &frame_info, sizeof(frame_info));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
+	case WEEWA_CMD_GET_TIMING_MODEL:
+		ret = imx586_ioctl(sd, cmd, &timing);
+		if (!ret) {
+			ret = copy_to_user(up, &timing, sizeof(timing));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
+	case WEEWA_CMD_SWITCH_MODE:
+		if (copy_from_user(&mode_switch, up, sizeof(mode_switch)))
+			return -EFAULT;
+		ret = imx586_ioctl(sd, cmd, &mode_switch);
+		if (!ret) {
+			ret = copy_to_user(up, &mode_switch, sizeof(mode_switch));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
 	default:
 		ret = -ENOIOCTLCMD;
 		break;
@@ -1486,12 +2058,16 @@ static long imx586_compat_ioctl32(struct v4l2_subdev *sd,
 }
 #endif
 
+/* mirror and flip, latched together at the next frame while streaming */
 static int imx586_set_flip(struct imx586 *imx586)
 {
 	int ret = 0;
 	u32 val = 0;
 
-	ret = imx586_read_reg(imx586->client, IMX586_FLIP_MIRROR_REG,
+	if (imx586->streaming)
+		ret = imx586_write_reg(imx586->client, IMX586_REG_HOLD,
+				       IMX586_REG_VALUE_08BIT, 1);
+	ret |= imx586_read_reg(imx586->client, IMX586_FLIP_MIRROR_REG,
 			      IMX586_REG_VALUE_08BIT, &val);
 	if (imx586->flip & IMX586_MIRROR_BIT_MASK)
 		val |= IMX586_MIRROR_BIT_MASK;
@@ -1503,6 +2079,9 @@ static int imx586_set_flip(struct imx586 *imx586)
 		val &= ~IMX586_FLIP_BIT_MASK;
 	ret |= imx586_write_reg(imx586->client, IMX586_FLIP_MIRROR_REG,
 				IMX586_REG_VALUE_08BIT, val);
+	if (imx586->streaming)
+		ret |= imx586_write_reg(imx586->client, IMX586_REG_HOLD,
+					IMX586_REG_VALUE_08BIT, 0);
 
 	return ret;
 }
@@ -1511,13 +2090,27 @@ static int __imx586_start_stream(struct imx586 *imx586)
 {
 	int ret;
 
-	ret = imx586_write_array(imx586->client, imx586->cur_mode->global_reg_list);
-	if (ret)
-		return ret;
+	/* registers survive the standby tier, only reload after a real power up */
+	if (!imx586->global_regs_ok) {
+		ret = imx586_write_array(imx586->client,
+					 imx586->cur_mode->global_reg_list);
+		if (ret)
+			return ret;
+		imx586->global_regs_ok = true;
+	}
 
-	ret = imx586_write_array(imx586->client, imx586->cur_mode->reg_list);
-	if (ret)
+	if (imx586->loaded_mode)
+		ret = imx586_write_mode_diff(imx586->client,
+					     imx586->loaded_mode->reg_list,
+					     imx586->cur_mode->reg_list);
+	else
+		ret = imx586_write_array(imx586->client,
+					 imx586->cur_mode->reg_list);
+	if (ret) {
+		imx586->loaded_mode = NULL;
 		return ret;
+	}
+	imx586->loaded_mode = imx586->cur_mode;
 	imx586->cur_vts = imx586->cur_mode->vts_def;
 	/* In case these controls are set before streaming */
 	ret = __v4l2_ctrl_handler_setup(&imx586->ctrl_handler);
@@ -1535,8 +2128,12 @@ static int __imx586_start_stream(struct imx586 *imx586)
 
 	imx586_set_flip(imx586);
 
-	return imx586_write_reg(imx586->client, IMX586_REG_CTRL_MODE,
-				IMX586_REG_VALUE_08BIT, IMX586_MODE_STREAMING);
+	ret = imx586_write_reg(imx586->client, IMX586_REG_CTRL_MODE,
+			       IMX586_REG_VALUE_08BIT, IMX586_MODE_STREAMING);
+	if (!ret)
+		weewa_frame_start(&imx586->frames);
+
+	return ret;
 }
 
 static int __imx586_stop_stream(struct imx586 *imx586)
@@ -1672,6 +2269,10 @@ static int __imx586_power_on(struct imx586 *imx586)
 	delay_us = imx586_cal_delay(8192);
 	usleep_range(delay_us, delay_us * 2);
 
+	imx586->pwr_state = IMX586_PWR_ON;
+	imx586->global_regs_ok = false;
+	imx586->loaded_mode = NULL;
+
 	return 0;
 
 disable_clk:
@@ -1682,14 +2283,69 @@ disable_clk:
 
 static void __imx586_power_off(struct imx586 *imx586)
 {
-	return;
+	struct device *dev = &imx586->client->dev;
+	int ret;
+
+	if (imx586->pwr_state == IMX586_PWR_OFF)
+		return;
 
 	if (!IS_ERR(imx586->pwdn_gpio))
 		gpiod_set_value_cansleep(imx586->pwdn_gpio, 0);
-	clk_disable_unprepare(imx586->xvclk);
+	if (imx586->pwr_state == IMX586_PWR_ON)
+		clk_disable_unprepare(imx586->xvclk);
 	if (!IS_ERR(imx586->reset_gpio))
 		gpiod_set_value_cansleep(imx586->reset_gpio, 0);
+	if (!IS_ERR_OR_NULL(imx586->pins_sleep)) {
+		ret = pinctrl_select_state(imx586->pinctrl,
+					   imx586->pins_sleep);
+		if (ret < 0)
+			dev_dbg(dev, "could not set pins\n");
+	}
 	regulator_bulk_disable(IMX586_NUM_SUPPLIES, imx586->supplies);
+
+	imx586->pwr_state = IMX586_PWR_OFF;
+	imx586->global_regs_ok = false;
+	imx586->loaded_mode = NULL;
+}
+
+static void __imx586_enter_standby(struct imx586 *imx586)
+{
+	/* normally already there after stop stream, make sure before gating */
+	imx586_write_reg(imx586->client, IMX586_REG_CTRL_MODE,
+			 IMX586_REG_VALUE_08BIT, IMX586_MODE_SW_STANDBY);
+	clk_disable_unprepare(imx586->xvclk);
+	imx586->pwr_state = IMX586_PWR_STANDBY;
+}
+
+static int __imx586_exit_standby(struct imx586 *imx586)
+{
+	u32 delay_us;
+	int ret;
+
+	ret = clk_prepare_enable(imx586->xvclk);
+	if (ret < 0) {
+		dev_err(&imx586->client->dev, "Failed to enable xvclk\n");
+		return ret;
+	}
+
+	delay_us = imx586_cal_delay(8192);
+	usleep_range(delay_us, delay_us * 2);
+	imx586->pwr_state = IMX586_PWR_ON;
+
+	return 0;
+}
+
+static void imx586_pwr_work(struct work_struct *work)
+{
+	struct imx586 *imx586 = container_of(to_delayed_work(work),
+					     struct imx586, pwr_work);
+
+	mutex_lock(&imx586->pwr_lock);
+	if (imx586->pwr_state == IMX586_PWR_STANDBY) {
+		__imx586_power_off(imx586);
+		dev_dbg(&imx586->client->dev, "standby timeout, powered off\n");
+	}
+	mutex_unlock(&imx586->pwr_lock);
 }
 
 static int imx586_runtime_resume(struct device *dev)
@@ -1697,8 +2353,28 @@ static int imx586_runtime_resume(struct device *dev)
 	struct i2c_client *client = to_i2c_client(dev);
 	struct v4l2_subdev *sd = i2c_get_clientdata(client);
 	struct imx586 *imx586 = to_imx586(sd);
+	enum imx586_pwr_state from;
+	ktime_t t;
+	int ret;
+
+	cancel_delayed_work_sync(&imx586->pwr_work);
+
+	mutex_lock(&imx586->pwr_lock);
+	from = imx586->pwr_state;
+	t = ktime_get();
+	if (from == IMX586_PWR_STANDBY)
+		ret = __imx586_exit_standby(imx586);
+	else
+		ret = __imx586_power_on(imx586);
+	if (!ret) {
+		imx586->resume_us[from] = ktime_us_delta(ktime_get(), t);
+		dev_dbg(dev, "resume from %s took %uus\n",
+			from == IMX586_PWR_STANDBY ? "standby" : "off",
+			imx586->resume_us[from]);
+	}
+	mutex_unlock(&imx586->pwr_lock);
 
-	return __imx586_power_on(imx586);
+	return ret;
 }
 
 static int imx586_runtime_suspend(struct device *dev)
@@ -1707,7 +2383,15 @@ static int imx586_runtime_suspend(struct device *dev)
 	struct v4l2_subdev *sd = i2c_get_clientdata(client);
 	struct imx586 *imx586 = to_imx586(sd);
 
-	__imx586_power_off(imx586);
+	mutex_lock(&imx586->pwr_lock);
+	if (poweroff_delay_ms) {
+		__imx586_enter_standby(imx586);
+		schedule_delayed_work(&imx586->pwr_work,
+				      msecs_to_jiffies(poweroff_delay_ms));
+	} else {
+		__imx586_power_off(imx586);
+	}
+	mutex_unlock(&imx586->pwr_lock);
 
 	return 0;
 }
@@ -1718,7 +2402,7 @@ static int imx586_open(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
 	struct imx586 *imx586 = to_imx586(sd);
 	struct v4l2_mbus_framefmt *try_fmt =
 				v4l2_subdev_get_try_format(sd, fh->pad, 0);
-	const struct imx586_mode *def_mode = &supported_modes[0];
+	const struct imx586_mode *def_mode = &imx586_supported_modes[0];
 
 	mutex_lock(&imx586->mutex);
 	/* Initialize try_fmt */
@@ -1739,19 +2423,77 @@ static int imx586_enum_frame_interval(struct v4l2_subdev *sd,
 				struct v4l2_subdev_frame_interval_enum *fie)
 {
 	struct imx586 *imx586 = to_imx586(sd);
+	const struct imx586_mode *mode;
+	u32 index = fie->index;
+	u32 i;
 
-	if (fie->index >= imx586->cfg_num)
-		return -EINVAL;
+	/* each mode's max_fps first, then the standard rates below it */
+	for (i = 0; i < imx586->cfg_num; i++) {
+		mode = &imx586_supported_modes[i];
+		if (weewa_mode_interval(&mode->max_fps, index, &fie->interval)) {
+			fie->code = weewa_bayer_flip(mode->bus_fmt,
+						     imx586->flip);
+			fie->width = mode->width;
+			fie->height = mode->height;
+			fie->reserved[0] = mode->hdr_mode;
+			return 0;
+		}
+		index -= weewa_mode_intervals(&mode->max_fps);
+	}
+
+	return -EINVAL;
+}
+
+/* stop and power down, resume restarts a running stream */
+static int __maybe_unused imx586_suspend(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct imx586 *imx586 = to_imx586(sd);
+	int ret;
+
+	mutex_lock(&imx586->mutex);
+	if (imx586->streaming)
+		__imx586_stop_stream(imx586);
+	mutex_unlock(&imx586->mutex);
+
+	ret = pm_runtime_force_suspend(dev);
+	if (ret)
+		return ret;
+
+	/* no standby parking across system sleep, drop to full off */
+	cancel_delayed_work_sync(&imx586->pwr_work);
+	mutex_lock(&imx586->pwr_lock);
+	__imx586_power_off(imx586);
+	mutex_unlock(&imx586->pwr_lock);
 
-	fie->code = supported_modes[fie->index].bus_fmt;
-	fie->width = supported_modes[fie->index].width;
-	fie->height = supported_modes[fie->index].height;
-	fie->interval = supported_modes[fie->index].max_fps;
-	fie->reserved[0] = supported_modes[fie->index].hdr_mode;
 	return 0;
 }
 
+static int __maybe_unused imx586_resume(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct imx586 *imx586 = to_imx586(sd);
+	int ret;
+
+	ret = pm_runtime_force_resume(dev);
+	if (ret)
+		return ret;
+
+	mutex_lock(&imx586->mutex);
+	if (imx586->streaming) {
+		ret = __imx586_start_stream(imx586);
+		if (ret)
+			dev_err(dev, "restart stream after resume failed\n");
+	}
+	mutex_unlock(&imx586->mutex);
+
+	return ret;
+}
+
 static const struct dev_pm_ops imx586_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(imx586_suspend, imx586_resume)
 	SET_RUNTIME_PM_OPS(imx586_runtime_suspend,
 			   imx586_runtime_resume, NULL)
 };
@@ -1768,11 +2510,14 @@ static const struct v4l2_subdev_core_ops imx586_core_ops = {
 #ifdef CONFIG_COMPAT
 	.compat_ioctl32 = imx586_compat_ioctl32,
 #endif
+	.subscribe_event = weewa_subscribe_event,
+	.unsubscribe_event = v4l2_event_subdev_unsubscribe,
 };
 
 static const struct v4l2_subdev_video_ops imx586_video_ops = {
 	.s_stream = imx586_s_stream,
 	.g_frame_interval = imx586_g_frame_interval,
+	.s_frame_interval = imx586_s_frame_interval,
 };
 
 static const struct v4l2_subdev_pad_ops imx586_pad_ops = {
@@ -1796,11 +2541,22 @@ static int imx586_set_ctrl(struct v4l2_ctrl *ctrl)
 					     struct imx586, ctrl_handler);
 	struct i2c_client *client = imx586->client;
 	s64 max;
+	u64 old_ns;
 	int ret = 0;
 	u32 again = 0;
+	u8 flip;
 
 	/* Propagate change of current control to all related controls */
 	switch (ctrl->id) {
+	case V4L2_CID_HFLIP:
+		/* the cluster brings VFLIP along, both values are the new ones */
+		flip = (imx586->h_flip->val ? IMX586_MIRROR_BIT_MASK : 0) |
+		       (imx586->v_flip->val ? IMX586_FLIP_BIT_MASK : 0);
+		if (flip != imx586->flip) {
+			imx586->flip = flip;
+			weewa_notify_src_change(&imx586->subdev);
+		}
+		break;
 	case V4L2_CID_VBLANK:
 		/* Update max exposure while meeting expected vblanking */
 		max = imx586->cur_mode->height + ctrl->val - 4;
@@ -1809,6 +2565,13 @@ static int imx586_set_ctrl(struct v4l2_ctrl *ctrl)
 					 imx586->exposure->step,
 					 imx586->exposure->default_value);
 		break;
+	case V4L2_CID_EXPOSURE:
+		weewa_exp_us_track(&imx586->exp_us, ctrl->val);
+		break;
+	case WEEWA_CID_EXPOSURE_US:
+		/* written to the sensor through V4L2_CID_EXPOSURE */
+		return weewa_exp_us_apply(&imx586->exp_us, imx586->exposure,
+					  ctrl);
 	}
 
 	if (!pm_runtime_get_if_in_use(&client->dev))
@@ -1825,6 +2588,11 @@ static int imx586_set_ctrl(struct v4l2_ctrl *ctrl)
 					IMX586_REG_EXPOSURE_L,
 					IMX586_REG_VALUE_08BIT,
 					IMX586_FETCH_EXP_L(ctrl->val));
+		if (!ret)
+			weewa_frame_set_ae(&imx586->frames, ctrl->val,
+					   imx586->anal_gain->val,
+					   imx586->streaming,
+					   imx586_frame_ns(imx586));
 		dev_dbg(&client->dev, "set exposure 0x%x\n",
 			ctrl->val);
 		break;
@@ -1846,11 +2614,17 @@ static int imx586_set_ctrl(struct v4l2_ctrl *ctrl)
 		ret |= imx586_write_reg(imx586->client, IMX586_REG_GAIN_L,
 					IMX586_REG_VALUE_08BIT,
 					IMX586_FETCH_AGAIN_L(again));
+		if (!ret)
+			weewa_frame_set_ae(&imx586->frames,
+					   imx586->exposure->val, ctrl->val,
+					   imx586->streaming,
+					   imx586_frame_ns(imx586));
 
 		dev_dbg(&client->dev, "set analog gain 0x%x\n",
 			ctrl->val);
 		break;
 	case V4L2_CID_VBLANK:
+		old_ns = imx586_frame_ns(imx586);
 		ret = imx586_write_reg(imx586->client,
 				       IMX586_REG_VTS_H,
 				       IMX586_REG_VALUE_08BIT,
@@ -1862,25 +2636,17 @@ static int imx586_set_ctrl(struct v4l2_ctrl *ctrl)
 					(ctrl->val + imx586->cur_mode->height)
 					& 0xff);
 		imx586->cur_vts = ctrl->val + imx586->cur_mode->height;
+		if (!ret)
+			weewa_frame_relength(&imx586->frames, imx586->streaming,
+					     old_ns, imx586_frame_ns(imx586));
 
 		dev_dbg(&client->dev, "set vblank 0x%x\n",
 			ctrl->val);
 		break;
 	case V4L2_CID_HFLIP:
-		if (ctrl->val)
-			imx586->flip |= IMX586_MIRROR_BIT_MASK;
-		else
-			imx586->flip &= ~IMX586_MIRROR_BIT_MASK;
-		dev_dbg(&client->dev, "set hflip 0x%x\n",
-			ctrl->val);
-		break;
-	case V4L2_CID_VFLIP:
-		if (ctrl->val)
-			imx586->flip |= IMX586_FLIP_BIT_MASK;
-		else
-			imx586->flip &= ~IMX586_FLIP_BIT_MASK;
-		dev_dbg(&client->dev, "set vflip 0x%x\n",
-			ctrl->val);
+		ret = imx586_set_flip(imx586);
+		dev_dbg(&client->dev, "set flip 0x%x\n",
+			imx586->flip);
 		break;
 	case V4L2_CID_TEST_PATTERN:
 		dev_dbg(&client->dev, "set testpattern 0x%x\n",
@@ -1912,27 +2678,21 @@ static int imx586_initialize_controls(struct imx586 *imx586)
 
 	handler = &imx586->ctrl_handler;
 	mode = imx586->cur_mode;
-	ret = v4l2_ctrl_handler_init(handler, 9);
+	ret = v4l2_ctrl_handler_init(handler, 12);
 	if (ret)
 		return ret;
 	handler->lock = &imx586->mutex;
 
 	imx586->link_freq = v4l2_ctrl_new_int_menu(handler, NULL,
 				V4L2_CID_LINK_FREQ,
-				ARRAY_SIZE(link_freq_items) - 1, 0,
-				link_freq_items);
-
-	if (imx586->cur_mode->bus_fmt == MEDIA_BUS_FMT_SRGGB10_1X10) {
-		imx586->cur_link_freq = 0;
-		imx586->cur_pixel_rate = PIXEL_RATE_WITH_848M_10BIT;
-	} else if (imx586->cur_mode->bus_fmt == MEDIA_BUS_FMT_SRGGB12_1X12) {
-		imx586->cur_link_freq = 0;
-		imx586->cur_pixel_rate = PIXEL_RATE_WITH_848M_12BIT;
-	}
+				ARRAY_SIZE(imx586_link_freq_items) - 1, 0,
+				imx586_link_freq_items);
+
+	imx586_update_link_freq(imx586, imx586->cur_mode);
 
 	imx586->pixel_rate = v4l2_ctrl_new_std(handler, NULL,
 					       V4L2_CID_PIXEL_RATE,
-					       0, PIXEL_RATE_WITH_848M_10BIT,
+					       0, PIXEL_RATE_WITH_625M_10BIT,
 					       1, imx586->cur_pixel_rate);
 	v4l2_ctrl_s_ctrl(imx586->link_freq,
 			   imx586->cur_link_freq);
@@ -1973,8 +2733,12 @@ static int imx586_initialize_controls(struct imx586 *imx586)
 
 	imx586->v_flip = v4l2_ctrl_new_std(handler, &imx586_ctrl_ops,
 				V4L2_CID_VFLIP, 0, 1, 1, 0);
+	v4l2_ctrl_cluster(2, &imx586->h_flip);
 	imx586->flip = 0;
 
+	weewa_skew_init(handler, &imx586->skew);
+	weewa_exp_us_init(handler, &imx586_ctrl_ops, &imx586->exp_us);
+
 	if (handler->error) {
 		ret = handler->error;
 		dev_err(&imx586->client->dev,
@@ -1982,6 +2746,13 @@ static int imx586_initialize_controls(struct imx586 *imx586)
 		goto err_free_handler;
 	}
 
+	mutex_lock(&imx586->mutex);
+	weewa_skew_update(&imx586->skew, &mode->max_fps, mode->vts_def,
+			  mode->height, mode->hdr_mode);
+	weewa_exp_us_update(&imx586->exp_us, &mode->max_fps, mode->vts_def,
+			    imx586->exposure->val);
+	mutex_unlock(&imx586->mutex);
+
 	imx586->subdev.ctrl_handler = handler;
 	imx586->has_init_exp = false;
 	return 0;
@@ -1992,6 +2763,30 @@ err_free_handler:
 	return ret;
 }
 
+/* (code, hdr_mode) bucketed keys of the mode table */
+static int imx586_build_mode_index(struct imx586 *imx586)
+{
+	const struct imx586_mode *mode;
+	u32 i, bpp;
+
+	imx586->mode_index = devm_kcalloc(&imx586->client->dev, imx586->cfg_num,
+					  sizeof(*imx586->mode_index),
+					  GFP_KERNEL);
+	if (!imx586->mode_index)
+		return -ENOMEM;
+
+	for (i = 0; i < imx586->cfg_num; i++) {
+		mode = &imx586_supported_modes[i];
+		bpp = mode->bus_fmt == MEDIA_BUS_FMT_SRGGB12_1X12 ? 12 : 10;
+		weewa_mode_key_fill(&imx586->mode_index[i], i, mode->width,
+				    mode->height, mode->bus_fmt, mode->hdr_mode,
+				    &mode->max_fps, bpp, mode->vts_def);
+	}
+	weewa_mode_index_sort(imx586->mode_index, imx586->cfg_num);
+
+	return 0;
+}
+
 static int imx586_check_sensor_id(struct imx586 *imx586,
 				  struct i2c_client *client)
 {
@@ -2006,7 +2801,7 @@ static int imx586_check_sensor_id(struct imx586 *imx586,
 	ret |= imx586_read_reg(client, IMX586_REG_CHIP_ID_L,
 			       IMX586_REG_VALUE_08BIT, &reg_L);
 	id = ((reg_H << 8) & 0xff00) | (reg_L & 0xff);
-	if (!(reg_H == (CHIP_ID >> 8) || reg_L == (CHIP_ID & 0xff))) {
+	if (!(reg_H == (IMX586_CHIP_ID >> 8) || reg_L == (IMX586_CHIP_ID & 0xff))) {
 		dev_err(dev, "Unexpected sensor id(%06x), ret(%d)\n", id, ret);
 		return -ENODEV;
 	}
@@ -2026,8 +2821,13 @@ static int imx586_configure_regulators(struct imx586 *imx586)
 				       imx586->supplies);
 }
 
-static int imx586_probe(struct i2c_client *client,
-			const struct i2c_device_id *id)
+/*
+ * When @detected is set the caller has already powered the sensor and read
+ * its chip id, so the power-on sequence and the id check are left to the
+ * first runtime resume instead of being repeated on the boot path.
+ */
+static int __imx586_probe(struct i2c_client *client,
+			  const struct i2c_device_id *id, bool detected)
 {
 	struct device *dev = &client->dev;
 	struct device_node *node = dev->of_node;
@@ -2040,11 +2840,14 @@ static int imx586_probe(struct i2c_client *client,
 	struct i2c_client *eeprom_ctrl_client;
 	struct v4l2_subdev *eeprom_ctrl;
 	struct otp_info *otp_ptr;
+	ktime_t t_start, t_ctrl, t_power, t_id, t_end;
 
 	dev_info(dev, "driver version: %02x.%02x.%02x",
-		 DRIVER_VERSION >> 16,
-		 (DRIVER_VERSION & 0xff00) >> 8,
-		 DRIVER_VERSION & 0x00ff);
+		 IMX586_DRIVER_VERSION >> 16,
+		 (IMX586_DRIVER_VERSION & 0xff00) >> 8,
+		 IMX586_DRIVER_VERSION & 0x00ff);
+
+	t_start = ktime_get();
 
 	imx586 = devm_kzalloc(dev, sizeof(*imx586), GFP_KERNEL);
 	if (!imx586)
@@ -2062,6 +2865,11 @@ static int imx586_probe(struct i2c_client *client,
 		dev_err(dev, "could not get module information!\n");
 		return -EINVAL;
 	}
+	/* a shared weewa camera node describes the 334/678 module */
+	of_property_read_string(node, "innosz,imx586-module-name",
+				&imx586->module_name);
+	of_property_read_string(node, "innosz,imx586-lens-name",
+				&imx586->len_name);
 
 	ret = of_property_read_u32(node, OF_CAMERA_HDR_MODE, &hdr_mode);
 	if (ret) {
@@ -2070,16 +2878,19 @@ static int imx586_probe(struct i2c_client *client,
 	}
 
 	imx586->client = client;
-	imx586->cfg_num = ARRAY_SIZE(supported_modes);
+	imx586->cfg_num = ARRAY_SIZE(imx586_supported_modes);
+	ret = imx586_build_mode_index(imx586);
+	if (ret)
+		return ret;
 	for (i = 0; i < imx586->cfg_num; i++) {
-		if (hdr_mode == supported_modes[i].hdr_mode) {
-			imx586->cur_mode = &supported_modes[i];
+		if (hdr_mode == imx586_supported_modes[i].hdr_mode) {
+			imx586->cur_mode = &imx586_supported_modes[i];
 			break;
 		}
 	}
 
 	if (i == imx586->cfg_num)
-		imx586->cur_mode = &supported_modes[0];
+		imx586->cur_mode = &imx586_supported_modes[0];
 
 	imx586->xvclk = devm_clk_get(dev, "xvclk");
 	if (IS_ERR(imx586->xvclk)) {
@@ -2128,6 +2939,8 @@ static int imx586_probe(struct i2c_client *client,
 	}
 
 	mutex_init(&imx586->mutex);
+	mutex_init(&imx586->pwr_lock);
+	INIT_DELAYED_WORK(&imx586->pwr_work, imx586_pwr_work);
 
 	sd = &imx586->subdev;
 	v4l2_i2c_subdev_init(sd, client, &imx586_subdev_ops);
@@ -2135,14 +2948,21 @@ static int imx586_probe(struct i2c_client *client,
 	ret = imx586_initialize_controls(imx586);
 	if (ret)
 		goto err_destroy_mutex;
+	t_ctrl = ktime_get();
 
-	ret = __imx586_power_on(imx586);
-	if (ret)
-		goto err_free_handler;
+	if (!detected) {
+		ret = __imx586_power_on(imx586);
+		if (ret)
+			goto err_free_handler;
+		t_power = ktime_get();
 
-	ret = imx586_check_sensor_id(imx586, client);
-	if (ret)
-		goto err_power_off;
+		ret = imx586_check_sensor_id(imx586, client);
+		if (ret)
+			goto err_power_off;
+	} else {
+		t_power = t_ctrl;
+	}
+	t_id = ktime_get();
 	eeprom_ctrl_node = of_parse_phandle(node, "eeprom-ctrl", 0);
 	if (eeprom_ctrl_node) {
 		eeprom_ctrl_client =
@@ -2173,7 +2993,7 @@ continue_probe:
 
 #ifdef CONFIG_VIDEO_V4L2_SUBDEV_API
 	sd->internal_ops = &imx586_internal_ops;
-	sd->flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
+	sd->flags |= V4L2_SUBDEV_FL_HAS_DEVNODE | V4L2_SUBDEV_FL_HAS_EVENTS;
 #endif
 #if defined(CONFIG_MEDIA_CONTROLLER)
 	imx586->pad.flags = MEDIA_PAD_FL_SOURCE;
@@ -2198,9 +3018,22 @@ continue_probe:
 		goto err_clean_entity;
 	}
 
-	pm_runtime_set_active(dev);
-	pm_runtime_enable(dev);
-	pm_runtime_idle(dev);
+	if (detected) {
+		pm_runtime_enable(dev);
+	} else {
+		pm_runtime_set_active(dev);
+		pm_runtime_enable(dev);
+		pm_runtime_idle(dev);
+	}
+
+	t_end = ktime_get();
+	if (boot_timing)
+		dev_info(dev, "probe timing(us): ctrls %lld, power %lld, id %lld, otp/register %lld, total %lld\n",
+			 ktime_us_delta(t_ctrl, t_start),
+			 ktime_us_delta(t_power, t_ctrl),
+			 ktime_us_delta(t_id, t_power),
+			 ktime_us_delta(t_end, t_id),
+			 ktime_us_delta(t_end, t_start));
 
 	return 0;
 
@@ -2213,6 +3046,7 @@ err_power_off:
 err_free_handler:
 	v4l2_ctrl_handler_free(&imx586->ctrl_handler);
 err_destroy_mutex:
+	mutex_destroy(&imx586->pwr_lock);
 	mutex_destroy(&imx586->mutex);
 
 	return ret;
@@ -2231,13 +3065,22 @@ static int imx586_remove(struct i2c_client *client)
 	mutex_destroy(&imx586->mutex);
 
 	pm_runtime_disable(&client->dev);
-	if (!pm_runtime_status_suspended(&client->dev))
-		__imx586_power_off(imx586);
+	cancel_delayed_work_sync(&imx586->pwr_work);
+	/* also covers a sensor parked in standby */
+	__imx586_power_off(imx586);
 	pm_runtime_set_suspended(&client->dev);
+	mutex_destroy(&imx586->pwr_lock);
 
 	return 0;
 }
 
+#ifndef INNOSZ_WEEWA_DRIVER
+static int imx586_probe(struct i2c_client *client,
+			const struct i2c_device_id *id)
+{
+	return __imx586_probe(client, id, false);
+}
+
 #if IS_ENABLED(CONFIG_OF)
 static const struct of_device_id imx586_of_match[] = {
 	{ .compatible = "sony,imx586" },
@@ -2256,6 +3099,7 @@ static struct i2c_driver imx586_i2c_driver = {
 		.name = IMX586_NAME,
 		.pm = &imx586_pm_ops,
 		.of_match_table = of_match_ptr(imx586_of_match),
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe		= &imx586_probe,
 	.remove		= &imx586_remove,
@@ -2277,3 +3121,4 @@ module_exit(sensor_mod_exit);
 
 MODULE_DESCRIPTION("Sony imx586 sensor driver");
 MODULE_LICENSE("GPL");
+#endif
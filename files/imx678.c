@@ -8,6 +8,18 @@
  *	1.add parse mclk pinctrl.
  *	2.add set flip ctrl.
  * V0.0X01.0X05 add quick stream on/off
+ * V0.0X01.0X06 asynchronous probe, skip re-detection when already identified
+ * V0.0X01.0X07 support 2-lane wiring
+ * V0.0X01.0X08 add s_frame_interval, frame rate set through VTS
+ * V0.0X01.0X09 add 1920x1080 2x2 binning modes at 60 and 120fps
+ * V0.0X01.0X0A add set_selection window cropping
+ * V0.0X01.0X0B add 12-bit linear modes, selected by bus format
+ * V0.0X01.0X0C add WEEWA_CMD_SWITCH_MODE, mode switch while streaming
+ * V0.0X01.0X0D pick modes by size, bus format, HDR and frame interval
+ * V0.0X01.0X0E add long exposure control, VMAX stretched past VBLANK
+ * V0.0X01.0X0F add exposure control in microseconds
+ * V0.0X01.0X10 enable flips, applied while streaming, bus code follows
+ *              the Bayer order
  */
 
 #include <linux/clk.h>
@@ -15,7 +27,9 @@
 #include <linux/delay.h>
 #include <linux/gpio/consumer.h>
 #include <linux/i2c.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/nvmem-consumer.h>
 #include <linux/pm_runtime.h>
 #include <linux/regulator/consumer.h>
 #include <linux/sysfs.h>
@@ -36,21 +50,30 @@
 #include <linux/of_gpio.h>
 #include <linux/mfd/syscon.h>
 #include <linux/rk-preisp.h>
+#include "weewa_sensor.h"
 
 #define INNOSZ_WEEWA_DRIVER
 
 
-#define IMX678_DRIVER_VERSION			KERNEL_VERSION(0, 0x01, 0x05)
+#define IMX678_DRIVER_VERSION			KERNEL_VERSION(0, 0x01, 0x10)
 
 #ifndef V4L2_CID_DIGITAL_GAIN
 #define V4L2_CID_DIGITAL_GAIN		V4L2_CID_GAIN
 #endif
 
-#define IMX678_LINK_FREQ_445		445500000 
+#define IMX678_LINK_FREQ_297		297000000// 594Mbps
+#define IMX678_LINK_FREQ_360		360000000// 720Mbps
+#define IMX678_LINK_FREQ_445		445500000// 891Mbps
+#define IMX678_LINK_FREQ_594		594000000// 1188Mbps
+#define IMX678_LINK_FREQ_720		720000000// 1440Mbps
+#define IMX678_LINK_FREQ_891		891000000// 1782Mbps
 
 #define IMX678_LANES			4
+#define IMX678_LANES_2			2
 
-#define PIXEL_RATE_WITH_445M_10BIT	(IMX678_LINK_FREQ_445 * 2 / 10 * 4)
+#define PIXEL_RATE_WITH_891M_10BIT	(IMX678_LINK_FREQ_891 * 2 / 10 * 4)
+/* HMAX counts the line in periods of this clock, whatever the link rate */
+#define IMX678_HMAX_CLK			74250000
 
 #define IMX678_XVCLK_FREQ_37		74250000 
 
@@ -58,8 +81,10 @@
 #define IMX678_REG_CHIP_ID		0x302c
 
 #define IMX678_REG_CTRL_MODE		0x3000
+#define IMX678_REG_DATARATE_SEL		0x3015
 #define IMX678_MODE_SW_STANDBY		0x1
 #define IMX678_MODE_STREAMING		0x0
+#define IMX678_REG_HOLD			0x3001
 
 #define imx678_REG_MARSTER_MODE		0x3002
 #define imx678_MODE_STOP		BIT(0)
@@ -71,6 +96,7 @@
 #define IMX678_SHR_EXPO_REG_L		0x3050
 
 #define	IMX678_EXPOSURE_MIN		5
+#define IMX678_EXPOSURE_MARGIN		4
 #define	IMX678_EXPOSURE_STEP		1
 #define IMX678_VTS_MAX			0xfffff
 #define IMX678_REG_GAIN			0x3070
@@ -102,8 +128,21 @@
 #define IMX678_VREVERSE_REG	0x3021
 #define IMX678_HREVERSE_REG	0x3020
 
+/* window cropping, positions in all-pixel coordinates also when binning */
+#define IMX678_REG_WINMODE		0x3018
+#define IMX678_WINMODE_ALL		0x00
+#define IMX678_WINMODE_CROP		0x04
+#define IMX678_REG_PIX_HST		0x303C
+#define IMX678_REG_PIX_HWIDTH		0x303E
+#define IMX678_REG_PIX_VST		0x3044
+#define IMX678_REG_PIX_VWIDTH		0x3046
+#define IMX678_FULL_WIDTH		3840
+#define IMX678_CROP_ALIGN		4
+#define IMX678_CROP_MIN		64
+
 #define IMX678_REG_DELAY			0xFFFE
 #define IMX678_REG_NULL			0xFFFF
+#define IMX678_BURST_LEN		32
 
 #define IMX678_REG_VALUE_08BIT		1
 #define IMX678_REG_VALUE_16BIT		2
@@ -125,6 +164,10 @@ static const char * const imx678_supply_names[] = {
 
 #define IMX678_NUM_SUPPLIES ARRAY_SIZE(imx678_supply_names)
 
+static bool boot_timing;
+module_param(boot_timing, bool, 0644);
+MODULE_PARM_DESC(boot_timing, "print per-phase probe timing");
+
 struct regval {
 	u16 addr;
 	u8 val;
@@ -135,7 +178,7 @@ struct imx678_mode {
 	u32 width;
 	u32 height;
 	struct v4l2_fract max_fps;
-	u32 hts_def;
+	u32 hmax;	/* HMAX, the line in IMX678_HMAX_CLK periods */
 	u32 vts_def;
 	u32 exp_def;
 	const struct regval *global_reg_list;
@@ -143,7 +186,6 @@ struct imx678_mode {
 	u32 hdr_mode;
 	u32 vclk_freq;
 	u32 bpp;
-	u32 mipi_freq_idx;
 	u32 vc[PAD_MAX];
 };
 
@@ -169,10 +211,21 @@ struct imx678 {
 	struct v4l2_ctrl	*test_pattern;
 	struct v4l2_ctrl	*pixel_rate;
 	struct v4l2_ctrl	*link_freq;
+	struct v4l2_ctrl	*long_exp;
+	/* clustered, h_flip is the master */
+	struct v4l2_ctrl	*h_flip;
+	struct v4l2_ctrl	*v_flip;
+	u8			flip;	/* WEEWA_FLIP_* */
 	struct mutex		mutex;
 	bool			streaming;
 	bool			power_on;
 	const struct imx678_mode *cur_mode;
+	const struct imx678_mode *supported_modes;
+	u32			cfg_num;
+	struct weewa_mode_key	*mode_index;
+	/* last s_frame_interval request, set_fmt keeps to it */
+	struct v4l2_fract	want_interval;
+	u32			lanes;
 	u32			module_index;
 	const char		*module_facing;
 	const char		*module_name;
@@ -181,10 +234,20 @@ struct imx678 {
 	
 	
 	u32			cur_vts;
+	/* VMAX last written, past cur_vts while a long exposure stretches it */
+	u32			frame_vts;
+	struct v4l2_rect	crop;
 	bool			has_init_exp;
 	struct preisp_hdrae_exp_s init_hdrae_exp;
 	u32			cur_vclk_freq;
 	u32			cur_mipi_freq_idx;
+	struct weewa_pwr_member	pwr;
+	struct weewa_sync_member	sync;
+	struct weewa_frame_track frames;
+	struct weewa_skew	skew;
+	struct weewa_exp_us	exp_us;
+	/* set_ctrl only stores exposure and gain, see imx678_sync_set_ae */
+	bool			group_ae;
 };
 
 #define to_imx678(sd) container_of(sd, struct imx678, subdev)
@@ -199,6 +262,8 @@ static const struct regval imx678_10_3840x2160_global_regs[] = {
 	{0x3023,0x00},
 	{0x302C,0x4c},// INCKSEL4[1:0]
 	{0x302D,0x04},// MDBIT
+	{0x30DC,0x32},// BLKLEVEL[11:0], 10-bit
+	{0x30DD,0x00},
 	{0x3050,0x03},// XVS_DRV[1:0]
 	{0x30A6,0x00},// -
 	{0x3460,0x22},// -
@@ -562,6 +627,114 @@ static const struct regval imx678_10_3840x2160_global_regs[] = {
 	{IMX678_REG_NULL, 0x00},
 };
 
+static const struct regval imx678_linear_10_3840x2160_regs[] = {
+	{0x301B,0x00},// ADDMODE[0]
+	{0x3040,0x03},// LANEMODE[2:0]
+	{IMX678_REG_NULL, 0x00},
+};
+
+/* 2 lanes at the same 891Mbps per lane, HMAX doubled for 15fps */
+static const struct regval imx678_linear_10_3840x2160_2lane_regs[] = {
+	{0x301B,0x00},// ADDMODE[0]
+	{0x302C,0x98},// HMAX[15:0]
+	{0x302D,0x08},
+	{0x3040,0x01},// LANEMODE[2:0]
+	{IMX678_REG_NULL, 0x00},
+};
+
+/*
+ * 2x2 binning reads half the rows, so VMAX 1125 at the 4K line time gives
+ * 60fps and halving HMAX on top of that gives 120fps.
+ */
+static const struct regval imx678_linear_10_1920x1080_60fps_regs[] = {
+	{0x301B,0x01},// ADDMODE[0]
+	{0x3028,0x65},// VMAX[19:0]
+	{0x3029,0x04},
+	{0x3040,0x03},// LANEMODE[2:0]
+	{IMX678_REG_NULL, 0x00},
+};
+
+static const struct regval imx678_linear_10_1920x1080_120fps_regs[] = {
+	{0x301B,0x01},// ADDMODE[0]
+	{0x3028,0x65},// VMAX[19:0]
+	{0x3029,0x04},
+	{0x302C,0x26},// HMAX[15:0]
+	{0x302D,0x02},
+	{0x3040,0x03},// LANEMODE[2:0]
+	{IMX678_REG_NULL, 0x00},
+};
+
+/* 2 lanes, HMAX doubled as for 4K: 30 and 60fps */
+static const struct regval imx678_linear_10_1920x1080_30fps_2lane_regs[] = {
+	{0x301B,0x01},// ADDMODE[0]
+	{0x3028,0x65},// VMAX[19:0]
+	{0x3029,0x04},
+	{0x302C,0x98},// HMAX[15:0]
+	{0x302D,0x08},
+	{0x3040,0x01},// LANEMODE[2:0]
+	{IMX678_REG_NULL, 0x00},
+};
+
+static const struct regval imx678_linear_10_1920x1080_60fps_2lane_regs[] = {
+	{0x301B,0x01},// ADDMODE[0]
+	{0x3028,0x65},// VMAX[19:0]
+	{0x3029,0x04},
+	{0x3040,0x01},// LANEMODE[2:0]
+	{IMX678_REG_NULL, 0x00},
+};
+
+/*
+ * 12-bit AD and output at the 10-bit line times, selected by bus format.
+ * BLKLEVEL scales with the extra two bits.
+ */
+static const struct regval imx678_linear_12_3840x2160_regs[] = {
+	{0x301B,0x00},// ADDMODE[0]
+	{0x3022,0x01},// ADBIT[1:0]
+	{0x3023,0x01},// MDBIT
+	{0x30DC,0xC8},// BLKLEVEL[11:0]
+	{0x30DD,0x00},
+	{0x3040,0x03},// LANEMODE[2:0]
+	{IMX678_REG_NULL, 0x00},
+};
+
+static const struct regval imx678_linear_12_1920x1080_60fps_regs[] = {
+	{0x301B,0x01},// ADDMODE[0]
+	{0x3022,0x01},// ADBIT[1:0]
+	{0x3023,0x01},// MDBIT
+	{0x3028,0x65},// VMAX[19:0]
+	{0x3029,0x04},
+	{0x30DC,0xC8},// BLKLEVEL[11:0]
+	{0x30DD,0x00},
+	{0x3040,0x03},// LANEMODE[2:0]
+	{IMX678_REG_NULL, 0x00},
+};
+
+static const struct regval imx678_linear_12_3840x2160_2lane_regs[] = {
+	{0x301B,0x00},// ADDMODE[0]
+	{0x3022,0x01},// ADBIT[1:0]
+	{0x3023,0x01},// MDBIT
+	{0x302C,0x98},// HMAX[15:0]
+	{0x302D,0x08},
+	{0x30DC,0xC8},// BLKLEVEL[11:0]
+	{0x30DD,0x00},
+	{0x3040,0x01},// LANEMODE[2:0]
+	{IMX678_REG_NULL, 0x00},
+};
+
+static const struct regval imx678_linear_12_1920x1080_30fps_2lane_regs[] = {
+	{0x301B,0x01},// ADDMODE[0]
+	{0x3022,0x01},// ADBIT[1:0]
+	{0x3023,0x01},// MDBIT
+	{0x3028,0x65},// VMAX[19:0]
+	{0x3029,0x04},
+	{0x302C,0x98},// HMAX[15:0]
+	{0x302D,0x08},
+	{0x30DC,0xC8},// BLKLEVEL[11:0]
+	{0x30DD,0x00},
+	{0x3040,0x01},// LANEMODE[2:0]
+	{IMX678_REG_NULL, 0x00},
+};
+
 static __maybe_unused const struct regval imx678_interal_sync_master_start_regs[] = {
 	{0x3010, 0x07},
 	{0x31a1, 0x00},
@@ -598,22 +771,194 @@ static const struct imx678_mode supported_modes[] = {
 			.denominator = 300000,
 		},
 		.exp_def = 0x0600,
-		.hts_def = 0x044C * 4,
+		.hmax = 0x044C,
+		.vts_def = 0x08CA,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
+		.global_reg_list = imx678_10_3840x2160_global_regs,
+		.reg_list = imx678_linear_10_3840x2160_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX678_XVCLK_FREQ_37,
+		.bpp = 10,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},
+	{
+		.width = 1920,
+		.height = 1080,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 600000,
+		},
+		.exp_def = 0x0300,
+		.hmax = 0x044C,
+		.vts_def = 0x0465,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
+		.global_reg_list = imx678_10_3840x2160_global_regs,
+		.reg_list = imx678_linear_10_1920x1080_60fps_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX678_XVCLK_FREQ_37,
+		.bpp = 10,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},
+	{
+		.width = 1920,
+		.height = 1080,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 1200000,
+		},
+		.exp_def = 0x0300,
+		.hmax = 0x0226,
+		.vts_def = 0x0465,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
+		.global_reg_list = imx678_10_3840x2160_global_regs,
+		.reg_list = imx678_linear_10_1920x1080_120fps_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX678_XVCLK_FREQ_37,
+		.bpp = 10,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},
+	{
+		.width = 3840,
+		.height = 2160,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 300000,
+		},
+		.exp_def = 0x0600,
+		.hmax = 0x044C,
+		.vts_def = 0x08CA,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB12_1X12,
+		.global_reg_list = imx678_10_3840x2160_global_regs,
+		.reg_list = imx678_linear_12_3840x2160_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX678_XVCLK_FREQ_37,
+		.bpp = 12,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},
+	{
+		.width = 1920,
+		.height = 1080,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 600000,
+		},
+		.exp_def = 0x0300,
+		.hmax = 0x044C,
+		.vts_def = 0x0465,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB12_1X12,
+		.global_reg_list = imx678_10_3840x2160_global_regs,
+		.reg_list = imx678_linear_12_1920x1080_60fps_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX678_XVCLK_FREQ_37,
+		.bpp = 12,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},
+};
+
+static const struct imx678_mode supported_modes_2lane[] = {
+	{
+		.width = 3840,
+		.height = 2160,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 150000,
+		},
+		.exp_def = 0x0600,
+		.hmax = 0x0898,
 		.vts_def = 0x08CA,
 		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
 		.global_reg_list = imx678_10_3840x2160_global_regs,
+		.reg_list = imx678_linear_10_3840x2160_2lane_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX678_XVCLK_FREQ_37,
+		.bpp = 10,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},	{
+		.width = 1920,
+		.height = 1080,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 300000,
+		},
+		.exp_def = 0x0300,
+		.hmax = 0x0898,
+		.vts_def = 0x0465,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
+		.global_reg_list = imx678_10_3840x2160_global_regs,
+		.reg_list = imx678_linear_10_1920x1080_30fps_2lane_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX678_XVCLK_FREQ_37,
+		.bpp = 10,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},
+	{
+		.width = 1920,
+		.height = 1080,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 600000,
+		},
+		.exp_def = 0x0300,
+		.hmax = 0x044C,
+		.vts_def = 0x0465,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB10_1X10,
+		.global_reg_list = imx678_10_3840x2160_global_regs,
+		.reg_list = imx678_linear_10_1920x1080_60fps_2lane_regs,
 		.hdr_mode = NO_HDR,
 		.vclk_freq = IMX678_XVCLK_FREQ_37,
 		.bpp = 10,
-		.mipi_freq_idx = 0,
 		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
-	}, 
+	},
+	{
+		.width = 3840,
+		.height = 2160,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 150000,
+		},
+		.exp_def = 0x0600,
+		.hmax = 0x0898,
+		.vts_def = 0x08CA,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB12_1X12,
+		.global_reg_list = imx678_10_3840x2160_global_regs,
+		.reg_list = imx678_linear_12_3840x2160_2lane_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX678_XVCLK_FREQ_37,
+		.bpp = 12,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},
+	{
+		.width = 1920,
+		.height = 1080,
+		.max_fps = {
+			.numerator = 10000,
+			.denominator = 300000,
+		},
+		.exp_def = 0x0300,
+		.hmax = 0x0898,
+		.vts_def = 0x0465,
+		.bus_fmt = MEDIA_BUS_FMT_SRGGB12_1X12,
+		.global_reg_list = imx678_10_3840x2160_global_regs,
+		.reg_list = imx678_linear_12_1920x1080_30fps_2lane_regs,
+		.hdr_mode = NO_HDR,
+		.vclk_freq = IMX678_XVCLK_FREQ_37,
+		.bpp = 12,
+		.vc[PAD0] = V4L2_MBUS_CSI2_CHANNEL_0,
+	},
 };
 
 static const s64 link_freq_menu_items[] = {
+	IMX678_LINK_FREQ_297,
+	IMX678_LINK_FREQ_360,
 	IMX678_LINK_FREQ_445,
-	IMX678_LINK_FREQ_445,
-	IMX678_LINK_FREQ_445
+	IMX678_LINK_FREQ_594,
+	IMX678_LINK_FREQ_720,
+	IMX678_LINK_FREQ_891,
+};
+
+/* DATARATE_SEL value for each link_freq_menu_items entry */
+static const u8 imx678_datarate_sel[] = {
+	0x07, 0x06, 0x05, 0x04, 0x03, 0x02,
 };
 
 static const char * const imx678_test_pattern_menu[] = {
@@ -653,21 +998,35 @@ static int imx678_write_reg(struct i2c_client *client, u16 reg,
 	return 0;
 }
 
+/*
+ * Runs of consecutive register addresses go out as one auto-increment
+ * write, which cuts the table upload to a fraction of the i2c transfers.
+ */
 static int imx678_write_array(struct i2c_client *client,
 			      const struct regval *regs)
 {
-	u32 i;
-	int ret = 0;
+	u8 buf[IMX678_BURST_LEN + 2];
+	u32 i = 0, n;
 
-	for (i = 0; ret == 0 && regs[i].addr != IMX678_REG_NULL; i++)
-		if (unlikely(regs[i].addr == IMX678_REG_DELAY))
+	while (regs[i].addr != IMX678_REG_NULL) {
+		if (unlikely(regs[i].addr == IMX678_REG_DELAY)) {
 			usleep_range(regs[i].val, regs[i].val * 2);
-		else
-			ret = imx678_write_reg(client, regs[i].addr,
-					       IMX678_REG_VALUE_08BIT,
-					       regs[i].val);
+			i++;
+			continue;
+		}
 
-	return ret;
+		buf[0] = regs[i].addr >> 8;
+		buf[1] = regs[i].addr & 0xff;
+		for (n = 0; n < IMX678_BURST_LEN &&
+		     regs[i + n].addr == regs[i].addr + n; n++)
+			buf[n + 2] = regs[i + n].val;
+
+		if (i2c_master_send(client, buf, n + 2) != n + 2)
+			return -EIO;
+		i += n;
+	}
+
+	return 0;
 }
 
 /* Read registers up to 4 at a time */
@@ -709,23 +1068,149 @@ static int imx678_read_reg(struct i2c_client *client, u16 reg, unsigned int len,
 	return 0;
 }
 
+/*
+ * Lowest data rate that carries the mode's active pixels within its frame
+ * time, plus 1/64 for packet headers and LP transitions.
+ */
+static u32 imx678_link_freq_idx(struct imx678 *imx678,
+				const struct imx678_mode *mode)
+{
+	u64 bps;
+	u32 i;
+
+	bps = div64_u64((u64)mode->width * mode->bpp * mode->vts_def *
+			mode->max_fps.denominator,
+			(u64)mode->max_fps.numerator * imx678->lanes);
+	bps += bps >> 6;
+
+	for (i = 0; i < ARRAY_SIZE(link_freq_menu_items); i++)
+		if (link_freq_menu_items[i] * 2 >= bps)
+			return i;
+
+	return ARRAY_SIZE(link_freq_menu_items) - 1;
+}
+
+static s64 imx678_pixel_rate(struct imx678 *imx678,
+			     const struct imx678_mode *mode, u32 freq_idx)
+{
+	return (u32)link_freq_menu_items[freq_idx] / mode->bpp * 2 *
+	       imx678->lanes;
+}
+
+/*
+ * Line length in pixels at @pixel_rate. rkaiq derives the line time from
+ * HBLANK and PIXEL_RATE, so HTS has to follow the link rate picked for
+ * the mode rather than a fixed value.
+ */
+static u32 imx678_hts(const struct imx678_mode *mode, s64 pixel_rate)
+{
+	return div64_u64((u64)mode->hmax * pixel_rate, IMX678_HMAX_CLK);
+}
+
+/* the crop window covers the whole mode again after a mode change */
+static void imx678_reset_crop(struct imx678 *imx678)
+{
+	imx678->crop.left = 0;
+	imx678->crop.top = 0;
+	imx678->crop.width = imx678->cur_mode->width;
+	imx678->crop.height = imx678->cur_mode->height;
+}
+
+/* a crop window keeps the mode's blanking, so shorter frames run faster */
+static u32 imx678_vts_min(struct imx678 *imx678)
+{
+	const struct imx678_mode *mode = imx678->cur_mode;
+
+	return mode->vts_def - mode->height + imx678->crop.height;
+}
+
+/* make @mode current and bring the controls in line, mutex held */
+static int imx678_change_mode(struct imx678 *imx678,
+			      const struct imx678_mode *mode)
+{
+	s64 h_blank, vblank_def;
+	s64 dst_pixel_rate = 0;
+	u32 freq_idx;
+	int ret = 0;
+
+	imx678->cur_mode = mode;
+	imx678->cur_vts = imx678->cur_mode->vts_def;
+	imx678->frame_vts = imx678->cur_vts;
+	imx678_reset_crop(imx678);
+	vblank_def = mode->vts_def - mode->height;
+	__v4l2_ctrl_modify_range(imx678->vblank, vblank_def,
+				 IMX678_VTS_MAX - mode->height,
+				 1, vblank_def);
+	__v4l2_ctrl_s_ctrl(imx678->vblank, vblank_def);
+	weewa_skew_update(&imx678->skew, &mode->max_fps, mode->vts_def,
+			  mode->height, mode->hdr_mode);
+	weewa_exp_us_update(&imx678->exp_us, &mode->max_fps, mode->vts_def,
+			    imx678->exposure->val);
+	if (imx678->cur_vclk_freq != mode->vclk_freq) {
+		clk_disable_unprepare(imx678->xvclk);
+		ret = clk_set_rate(imx678->xvclk, mode->vclk_freq);
+		ret |= clk_prepare_enable(imx678->xvclk);
+		if (ret < 0) {
+			dev_err(&imx678->client->dev, "Failed to enable xvclk\n");
+			return ret;
+		}
+		imx678->cur_vclk_freq = mode->vclk_freq;
+	}
+	freq_idx = imx678_link_freq_idx(imx678, mode);
+	/* a switch while streaming keeps the running data rate */
+	if (imx678->streaming && freq_idx < imx678->cur_mipi_freq_idx)
+		freq_idx = imx678->cur_mipi_freq_idx;
+	/* the pixel rate follows bpp too, even when the link stays */
+	dst_pixel_rate = imx678_pixel_rate(imx678, mode, freq_idx);
+	__v4l2_ctrl_s_ctrl_int64(imx678->pixel_rate, dst_pixel_rate);
+	h_blank = imx678_hts(mode, dst_pixel_rate) - mode->width;
+	__v4l2_ctrl_modify_range(imx678->hblank, h_blank,
+				 h_blank, 1, h_blank);
+	__v4l2_ctrl_s_ctrl(imx678->link_freq, freq_idx);
+	imx678->cur_mipi_freq_idx = freq_idx;
+
+	return 0;
+}
+
+/* VTS for @interval in the current mode, @interval becomes the rate set */
+static int imx678_set_interval(struct imx678 *imx678,
+			       struct v4l2_fract *interval)
+{
+	const struct imx678_mode *mode = imx678->cur_mode;
+	u32 vts;
+	int ret;
+
+	vts = weewa_interval_to_vts(&mode->max_fps, mode->vts_def,
+				    imx678_vts_min(imx678), IMX678_VTS_MAX,
+				    interval);
+	/* the vblank control updates the exposure range along with VTS */
+	ret = __v4l2_ctrl_s_ctrl(imx678->vblank, vts - imx678->crop.height);
+	weewa_vts_to_interval(&mode->max_fps, mode->vts_def,
+			      imx678->crop.height + imx678->vblank->val,
+			      interval);
+
+	return ret;
+}
+
 static int imx678_set_fmt(struct v4l2_subdev *sd,
 			  struct v4l2_subdev_pad_config *cfg,
 			  struct v4l2_subdev_format *fmt)
 {
 	struct imx678 *imx678 = to_imx678(sd);
 	const struct imx678_mode *mode;
-	s64 h_blank, vblank_def;
-	s64 dst_pixel_rate = 0;
+	struct v4l2_fract interval;
+	u32 idx;
 	int ret = 0;
 
 	mutex_lock(&imx678->mutex);
 
-	mode = v4l2_find_nearest_size(supported_modes,
-				      ARRAY_SIZE(supported_modes),
-				      width, height,
-				      fmt->format.width, fmt->format.height);
-	fmt->format.code = mode->bus_fmt;
+	idx = weewa_mode_index_find(imx678->mode_index, imx678->cfg_num,
+				    fmt->format.width, fmt->format.height,
+				    weewa_bayer_flip(fmt->format.code, imx678->flip),
+				    imx678->cur_mode->hdr_mode,
+				    &imx678->want_interval);
+	mode = &imx678->supported_modes[idx];
+	fmt->format.code = weewa_bayer_flip(mode->bus_fmt, imx678->flip);
 	fmt->format.width = mode->width;
 	fmt->format.height = mode->height;
 	fmt->format.field = V4L2_FIELD_NONE;
@@ -737,38 +1222,13 @@ static int imx678_set_fmt(struct v4l2_subdev *sd,
 		return -ENOTTY;
 #endif
 	} else {
-		imx678->cur_mode = mode;
-		imx678->cur_vts = imx678->cur_mode->vts_def;
-		h_blank = mode->hts_def - mode->width;
-		__v4l2_ctrl_modify_range(imx678->hblank, h_blank,
-					 h_blank, 1, h_blank);
-		vblank_def = mode->vts_def - mode->height;
-		__v4l2_ctrl_modify_range(imx678->vblank, vblank_def,
-					 IMX678_VTS_MAX - mode->height,
-					 1, vblank_def);
-		if (imx678->cur_vclk_freq != mode->vclk_freq) {
-			clk_disable_unprepare(imx678->xvclk);
-			ret = clk_set_rate(imx678->xvclk, mode->vclk_freq);
-			ret |= clk_prepare_enable(imx678->xvclk);
-			if (ret < 0) {
-				dev_err(&imx678->client->dev, "Failed to enable xvclk\n");
-				mutex_unlock(&imx678->mutex);
-				return ret;
-			}
-			imx678->cur_vclk_freq = mode->vclk_freq;
-		}
-		if (imx678->cur_mipi_freq_idx != mode->mipi_freq_idx) {
-			dst_pixel_rate = ((u32)link_freq_menu_items[mode->mipi_freq_idx]) /
-				mode->bpp * 2 * IMX678_LANES;
-			__v4l2_ctrl_s_ctrl_int64(imx678->pixel_rate,
-						 dst_pixel_rate);
-			__v4l2_ctrl_s_ctrl(imx678->link_freq,
-					   mode->mipi_freq_idx);
-			imx678->cur_mipi_freq_idx = mode->mipi_freq_idx;
-		}
+		interval = imx678->want_interval;
+		ret = imx678_change_mode(imx678, mode);
+		if (!ret && interval.numerator)
+			ret = imx678_set_interval(imx678, &interval);
 	}
 	mutex_unlock(&imx678->mutex);
-	return 0;
+	return ret;
 }
 
 static int imx678_get_fmt(struct v4l2_subdev *sd,
@@ -787,9 +1247,9 @@ static int imx678_get_fmt(struct v4l2_subdev *sd,
 		return -ENOTTY;
 #endif
 	} else {
-		fmt->format.width = mode->width;
-		fmt->format.height = mode->height;
-		fmt->format.code = mode->bus_fmt;
+		fmt->format.width = imx678->crop.width;
+		fmt->format.height = imx678->crop.height;
+		fmt->format.code = weewa_bayer_flip(mode->bus_fmt, imx678->flip);
 		fmt->format.field = V4L2_FIELD_NONE;
 		/* format info: width/height/data type/virctual channel */
 		if (fmt->pad < PAD_MAX && mode->hdr_mode != NO_HDR)
@@ -807,30 +1267,47 @@ static int imx678_enum_mbus_code(struct v4l2_subdev *sd,
 				 struct v4l2_subdev_mbus_code_enum *code)
 {
 	struct imx678 *imx678 = to_imx678(sd);
+	u32 i, j, n = 0;
+
+	/* each bus format once, in table order */
+	for (i = 0; i < imx678->cfg_num; i++) {
+		for (j = 0; j < i; j++)
+			if (imx678->supported_modes[j].bus_fmt ==
+			    imx678->supported_modes[i].bus_fmt)
+				break;
+		if (j < i)
+			continue;
+		if (n++ == code->index) {
+			code->code = weewa_bayer_flip(imx678->supported_modes[i].bus_fmt,
+						      imx678->flip);
+			return 0;
+		}
+	}
 
-	if (code->index != 0)
-		return -EINVAL;
-	code->code = imx678->cur_mode->bus_fmt;
-
-	return 0;
+	return -EINVAL;
 }
 
 static int imx678_enum_frame_sizes(struct v4l2_subdev *sd,
 				   struct v4l2_subdev_pad_config *cfg,
 				   struct v4l2_subdev_frame_size_enum *fse)
 {
-	if (fse->index >= ARRAY_SIZE(supported_modes))
-		return -EINVAL;
-
-	if (fse->code != supported_modes[0].bus_fmt)
-		return -EINVAL;
-
-	fse->min_width = supported_modes[fse->index].width;
-	fse->max_width = supported_modes[fse->index].width;
-	fse->max_height = supported_modes[fse->index].height;
-	fse->min_height = supported_modes[fse->index].height;
+	struct imx678 *imx678 = to_imx678(sd);
+	const struct imx678_mode *mode;
+	u32 code = weewa_bayer_flip(fse->code, imx678->flip);
+	u32 i, n = 0;
+
+	for (i = 0; i < imx678->cfg_num; i++) {
+		mode = &imx678->supported_modes[i];
+		if (mode->bus_fmt != code || n++ != fse->index)
+			continue;
+		fse->min_width = mode->width;
+		fse->max_width = mode->width;
+		fse->max_height = mode->height;
+		fse->min_height = mode->height;
+		return 0;
+	}
 
-	return 0;
+	return -EINVAL;
 }
 
 static int imx678_enable_test_pattern(struct imx678 *imx678, u32 pattern)
@@ -855,12 +1332,45 @@ static int imx678_g_frame_interval(struct v4l2_subdev *sd,
 	const struct imx678_mode *mode = imx678->cur_mode;
 
 	mutex_lock(&imx678->mutex);
-	fi->interval = mode->max_fps;
+	weewa_vts_to_interval(&mode->max_fps, mode->vts_def,
+			      imx678->crop.height + imx678->vblank->val,
+			      &fi->interval);
 	mutex_unlock(&imx678->mutex);
 
 	return 0;
 }
 
+/*
+ * Before streaming the cheapest mode of the current size, format and HDR
+ * setting that reaches the interval is taken, faster ones cost link rate.
+ */
+static int imx678_s_frame_interval(struct v4l2_subdev *sd,
+				   struct v4l2_subdev_frame_interval *fi)
+{
+	struct imx678 *imx678 = to_imx678(sd);
+	const struct imx678_mode *cur = imx678->cur_mode;
+	const struct imx678_mode *mode;
+	u32 idx;
+	int ret = 0;
+
+	mutex_lock(&imx678->mutex);
+	imx678->want_interval = fi->interval;
+	if (!imx678->streaming) {
+		idx = weewa_mode_index_find(imx678->mode_index,
+					    imx678->cfg_num, cur->width,
+					    cur->height, cur->bus_fmt,
+					    cur->hdr_mode, &fi->interval);
+		mode = &imx678->supported_modes[idx];
+		if (mode != cur)
+			ret = imx678_change_mode(imx678, mode);
+	}
+	if (!ret)
+		ret = imx678_set_interval(imx678, &fi->interval);
+	mutex_unlock(&imx678->mutex);
+
+	return ret;
+}
+
 static int imx678_g_mbus_config(struct v4l2_subdev *sd, unsigned int pad_id,
 				struct v4l2_mbus_config *config)
 {
@@ -868,7 +1378,7 @@ static int imx678_g_mbus_config(struct v4l2_subdev *sd, unsigned int pad_id,
 	const struct imx678_mode *mode = imx678->cur_mode;
 	u32 val = 0;
 
-	val = 1 << (IMX678_LANES - 1) |
+	val = 1 << (imx678->lanes - 1) |
 	      V4L2_MBUS_CSI2_CHANNEL_0 |
 	      V4L2_MBUS_CSI2_CONTINUOUS_CLOCK;
 
@@ -887,21 +1397,263 @@ static void imx678_get_module_inf(struct imx678 *imx678,
 	strlcpy(inf->base.lens, imx678->len_name, sizeof(inf->base.lens));
 }
 
-static long imx678_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
+static bool imx678_long_exp_on(struct imx678 *imx678)
 {
-	struct imx678 *imx678 = to_imx678(sd);
-	struct rkmodule_hdr_cfg *hdr;
-	long ret = 0;
-	u32 stream = 0;
-    u32 *sync_mode = NULL;
-	
-	
-	switch (cmd) {
-	case RKMODULE_GET_MODULE_INFO:
-		imx678_get_module_inf(imx678, (struct rkmodule_inf *)arg);
-		break;
-	case RKMODULE_GET_HDR_CFG:
-		hdr = (struct rkmodule_hdr_cfg *)arg;
+	return imx678->long_exp && imx678->long_exp->val &&
+	       imx678->cur_mode->hdr_mode == NO_HDR;
+}
+
+/*
+ * Frame length for @exposure: the VBLANK one, stretched to fit the
+ * exposure while long exposure is on.
+ */
+static u32 imx678_out_vts(struct imx678 *imx678, u32 exposure)
+{
+	if (imx678_long_exp_on(imx678))
+		return max(imx678->cur_vts, exposure + IMX678_EXPOSURE_MARGIN);
+
+	return imx678->cur_vts;
+}
+
+static s64 imx678_exposure_max(struct imx678 *imx678, u32 vts)
+{
+	if (imx678_long_exp_on(imx678))
+		return IMX678_VTS_MAX - IMX678_EXPOSURE_MARGIN;
+
+	return vts - IMX678_EXPOSURE_MARGIN;
+}
+
+static u64 imx678_frame_ns(struct imx678 *imx678)
+{
+	const struct imx678_mode *mode = imx678->cur_mode;
+
+	if (!mode->max_fps.denominator || !mode->vts_def)
+		return 0;
+
+	return div64_u64((u64)NSEC_PER_SEC * mode->max_fps.numerator *
+			 imx678->frame_vts,
+			 (u64)mode->max_fps.denominator * mode->vts_def);
+}
+
+/*
+ * VMAX becomes @vts at the next frame start. The frame tracker counts the
+ * frames so far at the old length, so AE steps that stretch the frame do
+ * not rescale the frame history.
+ */
+static void imx678_set_frame_vts(struct imx678 *imx678, u32 vts)
+{
+	u64 old_ns = imx678_frame_ns(imx678);
+
+	imx678->frame_vts = vts;
+	weewa_frame_relength(&imx678->frames, imx678->streaming, old_ns,
+			     imx678_frame_ns(imx678));
+}
+
+static void imx678_get_timing_model(struct imx678 *imx678,
+				    struct weewa_timing_model *tm)
+{
+	const struct imx678_mode *mode;
+
+	mutex_lock(&imx678->mutex);
+	mode = imx678->cur_mode;
+	weewa_timing_fill(tm, &mode->max_fps, mode->vts_def, imx678->cur_vts,
+			  imx678->crop.height, mode->hdr_mode);
+	tm->width = imx678->crop.width;
+	tm->vts_min = imx678_vts_min(imx678);
+	tm->vts_max = IMX678_VTS_MAX;
+	tm->exposure_min = IMX678_EXPOSURE_MIN;
+	tm->exposure_margin = 4;
+	tm->exposure_step = imx678->exposure->step;
+	tm->gain_min = imx678->anal_gain->minimum;
+	tm->gain_max = imx678->anal_gain->maximum;
+	tm->gain_step = imx678->anal_gain->step;
+	/* exposure, gain and frame length all latch at the next frame */
+	tm->exposure_delay = 1;
+	tm->gain_delay = 1;
+	tm->vts_delay = 1;
+	mutex_unlock(&imx678->mutex);
+}
+
+/* window registers are little endian, low byte first */
+static int imx678_write_crop(struct imx678 *imx678)
+{
+	const struct imx678_mode *mode = imx678->cur_mode;
+	const struct v4l2_rect *c = &imx678->crop;
+	u32 scale = IMX678_FULL_WIDTH / mode->width;
+	const struct {
+		u16 reg;
+		u32 val;
+	} win[] = {
+		{ IMX678_REG_PIX_HST, c->left * scale },
+		{ IMX678_REG_PIX_HWIDTH, c->width * scale },
+		{ IMX678_REG_PIX_VST, c->top * scale },
+		{ IMX678_REG_PIX_VWIDTH, c->height * scale },
+	};
+	u32 i;
+	int ret;
+
+	if (c->width == mode->width && c->height == mode->height)
+		return imx678_write_reg(imx678->client, IMX678_REG_WINMODE,
+					IMX678_REG_VALUE_08BIT, IMX678_WINMODE_ALL);
+
+	ret = imx678_write_reg(imx678->client, IMX678_REG_WINMODE,
+			       IMX678_REG_VALUE_08BIT, IMX678_WINMODE_CROP);
+	for (i = 0; i < ARRAY_SIZE(win); i++) {
+		ret |= imx678_write_reg(imx678->client, win[i].reg,
+					IMX678_REG_VALUE_08BIT, win[i].val & 0xff);
+		ret |= imx678_write_reg(imx678->client, win[i].reg + 1,
+					IMX678_REG_VALUE_08BIT, win[i].val >> 8);
+	}
+
+	return ret;
+}
+
+/* value @mode leaves in @addr, its reg_list over the global table */
+static bool imx678_mode_reg(const struct imx678_mode *mode, u16 addr, u8 *val)
+{
+	const struct regval *r;
+
+	for (r = mode->reg_list; r->addr != IMX678_REG_NULL; r++) {
+		if (r->addr == addr) {
+			*val = r->val;
+			return true;
+		}
+	}
+	for (r = mode->global_reg_list; r->addr != IMX678_REG_NULL; r++) {
+		if (r->addr == addr) {
+			*val = r->val;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Registers whose value differs between the two modes: @from's reg_list
+ * entries fall back to @to's value, then @to's own reg_list is applied.
+ */
+static int imx678_write_mode_diff(struct imx678 *imx678,
+				  const struct imx678_mode *from,
+				  const struct imx678_mode *to)
+{
+	const struct regval *r;
+	u8 val;
+	int ret = 0;
+
+	for (r = from->reg_list; r->addr != IMX678_REG_NULL; r++) {
+		if (r->addr == IMX678_REG_DELAY ||
+		    !imx678_mode_reg(to, r->addr, &val) || val == r->val)
+			continue;
+		ret |= imx678_write_reg(imx678->client, r->addr,
+					IMX678_REG_VALUE_08BIT, val);
+	}
+	for (r = to->reg_list; r->addr != IMX678_REG_NULL; r++) {
+		if (r->addr == IMX678_REG_DELAY ||
+		    (imx678_mode_reg(from, r->addr, &val) && val == r->val))
+			continue;
+		ret |= imx678_write_reg(imx678->client, r->addr,
+					IMX678_REG_VALUE_08BIT, r->val);
+	}
+
+	return ret;
+}
+
+/* same link format and clock, and the running data rate carries it */
+static bool imx678_can_switch(struct imx678 *imx678,
+			      const struct imx678_mode *mode)
+{
+	const struct imx678_mode *cur = imx678->cur_mode;
+
+	return mode->bus_fmt == cur->bus_fmt &&
+	       mode->vclk_freq == cur->vclk_freq &&
+	       mode->global_reg_list == cur->global_reg_list &&
+	       imx678_link_freq_idx(imx678, mode) <= imx678->cur_mipi_freq_idx;
+}
+
+static int imx678_switch_mode(struct imx678 *imx678,
+			      struct weewa_mode_switch *ms)
+{
+	const struct imx678_mode *mode, *found = NULL;
+	struct i2c_client *client = imx678->client;
+	struct v4l2_rect old_crop;
+	u32 old_code;
+	u32 code = ms->code ? weewa_bayer_flip(ms->code, imx678->flip) :
+			      imx678->cur_mode->bus_fmt;
+	bool match = false;
+	u64 old_ns;
+	u32 i;
+	int ret = 0;
+
+	mutex_lock(&imx678->mutex);
+	for (i = 0; i < imx678->cfg_num; i++) {
+		mode = &imx678->supported_modes[i];
+		if (mode->width != ms->width || mode->height != ms->height ||
+		    mode->bus_fmt != code || mode->hdr_mode != ms->hdr_mode)
+			continue;
+		match = true;
+		if (mode == imx678->cur_mode) {
+			found = mode;
+			break;
+		}
+		if (!found && (!imx678->streaming ||
+			       imx678_can_switch(imx678, mode)))
+			found = mode;
+	}
+	if (!found) {
+		ret = match ? -EBUSY : -EINVAL;
+		goto unlock;
+	}
+
+	if (!imx678->streaming) {
+		ms->frame = 0;
+		ret = imx678_change_mode(imx678, found);
+		goto unlock;
+	}
+
+	old_ns = imx678_frame_ns(imx678);
+	if (found == imx678->cur_mode) {
+		ms->frame = weewa_frame_estimate(&imx678->frames, old_ns);
+		goto unlock;
+	}
+
+	old_code = imx678->cur_mode->bus_fmt;
+	old_crop = imx678->crop;
+	ret = imx678_write_reg(client, IMX678_REG_HOLD, IMX678_REG_VALUE_08BIT, 1);
+	ret |= imx678_write_mode_diff(imx678, imx678->cur_mode, found);
+	ret |= imx678_change_mode(imx678, found);
+	ret |= imx678_write_crop(imx678);
+	ret |= __v4l2_ctrl_handler_setup(&imx678->ctrl_handler);
+	ret |= imx678_write_reg(client, IMX678_REG_HOLD, IMX678_REG_VALUE_08BIT, 0);
+	ms->frame = weewa_frame_estimate(&imx678->frames, old_ns) + 1;
+	weewa_frame_rebase(&imx678->frames, ms->frame, old_ns,
+			   imx678_frame_ns(imx678));
+	/* the receiver's buffers no longer fit the output */
+	if (found->bus_fmt != old_code || imx678->crop.width != old_crop.width ||
+	    imx678->crop.height != old_crop.height)
+		weewa_notify_src_change(&imx678->subdev);
+
+unlock:
+	mutex_unlock(&imx678->mutex);
+
+	return ret;
+}
+
+static long imx678_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
+{
+	struct imx678 *imx678 = to_imx678(sd);
+	struct rkmodule_hdr_cfg *hdr;
+	long ret = 0;
+	u32 stream = 0;
+    u32 *sync_mode = NULL;
+	
+	
+	switch (cmd) {
+	case RKMODULE_GET_MODULE_INFO:
+		imx678_get_module_inf(imx678, (struct rkmodule_inf *)arg);
+		break;
+	case RKMODULE_GET_HDR_CFG:
+		hdr = (struct rkmodule_hdr_cfg *)arg;
 		hdr->esp.mode = HDR_NORMAL_VC;
 		hdr->hdr_mode = imx678->cur_mode->hdr_mode;
 		break;
@@ -909,10 +1661,12 @@ static long imx678_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
 
 		stream = *((u32 *)arg);
 
-		if (stream)
+		if (stream) {
 			ret = imx678_write_reg(imx678->client, IMX678_REG_CTRL_MODE,
 				IMX678_REG_VALUE_08BIT, 0);
-		else
+			if (!ret)
+				weewa_frame_start(&imx678->frames);
+		} else
 			ret = imx678_write_reg(imx678->client, IMX678_REG_CTRL_MODE,
 				IMX678_REG_VALUE_08BIT, 1);
 		break;
@@ -926,6 +1680,26 @@ static long imx678_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
 		imx678->sync_mode = *sync_mode;	
 		v4l2_err(&imx678->subdev, "set sync mode %d\n",*sync_mode);
 		break;
+	case WEEWA_CMD_GET_SYNC_INFO:
+		weewa_sync_get_info(&imx678->sync, (struct weewa_sync_info *)arg);
+		break;
+	case WEEWA_CMD_SET_GROUP_AE:
+		ret = weewa_sync_set_ae(&imx678->sync, (struct weewa_group_ae *)arg);
+		break;
+	case WEEWA_CMD_GET_FRAME_INFO:
+		if (!imx678->streaming) {
+			ret = -EAGAIN;
+			break;
+		}
+		weewa_frame_get_timing(&imx678->frames, imx678_frame_ns(imx678),
+				       (struct weewa_frame_info *)arg);
+		break;
+	case WEEWA_CMD_GET_TIMING_MODEL:
+		imx678_get_timing_model(imx678, (struct weewa_timing_model *)arg);
+		break;
+	case WEEWA_CMD_SWITCH_MODE:
+		ret = imx678_switch_mode(imx678, (struct weewa_mode_switch *)arg);
+		break;
 	default:
 		ret = -ENOIOCTLCMD;
 		break;
@@ -941,6 +1715,11 @@ static long imx678_compat_ioctl32(struct v4l2_subdev *sd,
 	void __user *up = compat_ptr(arg);
 	struct rkmodule_inf *inf;
 	struct rkmodule_awb_cfg *cfg;
+	struct weewa_sync_info sync_info;
+	struct weewa_group_ae *group_ae;
+	struct weewa_frame_info frame_info;
+	struct weewa_timing_model timing;
+	struct weewa_mode_switch mode_switch;
 	long ret;
 	u32 stream = 0;
 	u32 sync_mode;
@@ -990,6 +1769,57 @@ static long imx678_compat_ioctl32(struct v4l2_subdev *sd,
 		else
 			ret = -EFAULT;	
 		break;
+	case WEEWA_CMD_GET_SYNC_INFO:
+		ret = imx678_ioctl(sd, cmd, &sync_info);
+		if (!ret) {
+			ret = copy_to_user(up, &sync_info, sizeof(sync_info));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
+	case WEEWA_CMD_SET_GROUP_AE:
+		group_ae = kzalloc(sizeof(*group_ae), GFP_KERNEL);
+		if (!group_ae) {
+			ret = -ENOMEM;
+			return ret;
+		}
+
+		ret = copy_from_user(group_ae, up, sizeof(*group_ae));
+		if (!ret) {
+			ret = imx678_ioctl(sd, cmd, group_ae);
+			if (!ret && copy_to_user(up, group_ae, sizeof(*group_ae)))
+				ret = -EFAULT;
+		} else {
+			ret = -EFAULT;
+		}
+		kfree(group_ae);
+		break;
+	case WEEWA_CMD_GET_FRAME_INFO:
+		ret = imx678_ioctl(sd, cmd, &frame_info);
+		if (!ret) {
+			ret = copy_to_user(up, &frame_info, sizeof(frame_info));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
+	case WEEWA_CMD_GET_TIMING_MODEL:
+		ret = imx678_ioctl(sd, cmd, &timing);
+		if (!ret) {
+			ret = copy_to_user(up, &timing, sizeof(timing));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
+	case WEEWA_CMD_SWITCH_MODE:
+		if (copy_from_user(&mode_switch, up, sizeof(mode_switch)))
+			return -EFAULT;
+		ret = imx678_ioctl(sd, cmd, &mode_switch);
+		if (!ret) {
+			ret = copy_to_user(up, &mode_switch, sizeof(mode_switch));
+			if (ret)
+				ret = -EFAULT;
+		}
+		break;
 	default:
 		ret = -ENOIOCTLCMD;
 		break;
@@ -1006,6 +1836,17 @@ static int __imx678_start_stream(struct imx678 *imx678)
 	ret = imx678_write_array(imx678->client, imx678->cur_mode->global_reg_list);
 	if (ret)
 		return ret;
+	ret = imx678_write_array(imx678->client, imx678->cur_mode->reg_list);
+	if (ret)
+		return ret;
+	ret = imx678_write_crop(imx678);
+	if (ret)
+		return ret;
+	ret = imx678_write_reg(imx678->client, IMX678_REG_DATARATE_SEL,
+			       IMX678_REG_VALUE_08BIT,
+			       imx678_datarate_sel[imx678->cur_mipi_freq_idx]);
+	if (ret)
+		return ret;
 
 	/* In case these controls are set before streaming */
 	mutex_unlock(&imx678->mutex);
@@ -1035,6 +1876,8 @@ static int __imx678_start_stream(struct imx678 *imx678)
 	    printk("------- standby Sony IMX678 Sensor 4K@30 10bit Initial ret = %d-------\n",ret);
         ret = imx678_write_reg(imx678->client, imx678_REG_MARSTER_MODE,
 				IMX678_REG_VALUE_08BIT, 0);		
+		if (!ret)
+			weewa_frame_start(&imx678->frames);
 	    printk("------- master Sony IMX678 Sensor 4K@30 10bit Initial ret = %d-------\n",ret);
 	}
      else {
@@ -1045,20 +1888,25 @@ static int __imx678_start_stream(struct imx678 *imx678)
 //	imx678_write_reg(imx678->client, IMX678_HREVERSE_REG,IMX678_REG_VALUE_08BIT, 0x01);
 //	imx678_write_reg(imx678->client, IMX678_VREVERSE_REG,IMX678_REG_VALUE_08BIT, 0x01);
 //	usleep_range(24000, 30000);
+	if (!ret && imx678->sync_mode != NO_SYNC_MODE)
+		weewa_sync_start(&imx678->sync);
+
 	return ret;
 }
 
 static int __imx678_stop_stream(struct imx678 *imx678)
 {
 	int ret = 0;
-	
+
+	weewa_sync_stop(&imx678->sync);
+
 	ret = imx678_write_reg(imx678->client, IMX678_REG_CTRL_MODE,
 				IMX678_REG_VALUE_08BIT, 1);
 		if (imx678->sync_mode == EXTERNAL_MASTER_MODE)
 		ret |= imx678_write_array(imx678->client, imx678_external_sync_master_stop_regs);
 	else if (imx678->sync_mode == INTERNAL_MASTER_MODE)
 		ret |= imx678_write_array(imx678->client, imx678_interal_sync_master_stop_regs);
-	
+
 	return ret;
 }
 
@@ -1132,78 +1980,16 @@ unlock_and_return:
 	return ret;
 }
 
-/* Calculate the delay in us by clock rate and clock cycles */
-static inline u32 imx678_cal_delay(u32 cycles, struct imx678 *imx678)
-{
-	return DIV_ROUND_UP(cycles, IMX678_XVCLK_FREQ_37 / 1000 / 1000);
-}
-
 static int __imx678_power_on(struct imx678 *imx678)
 {
-	int ret;
-	u32 delay_us;
-	s64 vclk_freq;
-	struct device *dev = &imx678->client->dev;
-
-	if (!IS_ERR_OR_NULL(imx678->pins_default)) {
-		ret = pinctrl_select_state(imx678->pinctrl,
-					   imx678->pins_default);
-		if (ret < 0)
-			dev_err(dev, "could not set pins\n");
-	}
-
-	vclk_freq = IMX678_XVCLK_FREQ_37;
+	imx678->pwr.xvclk_rate = IMX678_XVCLK_FREQ_37;
 
-	ret = clk_set_rate(imx678->xvclk, vclk_freq);
-	if (ret < 0) {
-		dev_err(dev, "Failed to set xvclk rate (24MHz)\n");
-		return ret;
-	}
-	if (clk_get_rate(imx678->xvclk) != vclk_freq)
-		dev_warn(dev, "xvclk mismatched, modes are based on 37.125MHz\n");
-	ret = clk_prepare_enable(imx678->xvclk);
-	if (ret < 0) {
-		dev_err(dev, "Failed to enable xvclk\n");
-		return ret;
-	}
-
-	if (!IS_ERR(imx678->reset_gpio))
-		gpiod_set_value_cansleep(imx678->reset_gpio, 0);
-
-	ret = regulator_bulk_enable(IMX678_NUM_SUPPLIES, imx678->supplies);
-	if (ret < 0) {
-		dev_err(dev, "Failed to enable regulators\n");
-		goto disable_clk;
-	}
-
-	if (!IS_ERR(imx678->reset_gpio))
-		gpiod_set_value_cansleep(imx678->reset_gpio, 1);
-
-	usleep_range(500, 1000);
-	if (!IS_ERR(imx678->pwdn_gpio))
-		gpiod_set_value_cansleep(imx678->pwdn_gpio, 1);
-
-	/* 8192 cycles prior to first SCCB transaction */
-	delay_us = imx678_cal_delay(8192, imx678);
-	usleep_range(delay_us, delay_us * 2);
-
-	return 0;
-
-disable_clk:
-	clk_disable_unprepare(imx678->xvclk);
-
-	return ret;
+	return weewa_pwr_get(&imx678->pwr);
 }
 
 static void __imx678_power_off(struct imx678 *imx678)
 {
-	//return;
-	if (!IS_ERR(imx678->pwdn_gpio))
-		gpiod_set_value_cansleep(imx678->pwdn_gpio, 0);
-	clk_disable_unprepare(imx678->xvclk);
-	if (!IS_ERR(imx678->reset_gpio))
-		gpiod_set_value_cansleep(imx678->reset_gpio, 0);
-	regulator_bulk_disable(IMX678_NUM_SUPPLIES, imx678->supplies);
+	weewa_pwr_put(&imx678->pwr);
 }
 
 static int imx678_runtime_resume(struct device *dev)
@@ -1232,7 +2018,7 @@ static int imx678_open(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
 	struct imx678 *imx678 = to_imx678(sd);
 	struct v4l2_mbus_framefmt *try_fmt =
 				v4l2_subdev_get_try_format(sd, fh->pad, 0);
-	const struct imx678_mode *def_mode = &supported_modes[0];
+	const struct imx678_mode *def_mode = &imx678->supported_modes[0];
 
 	mutex_lock(&imx678->mutex);
 	/* Initialize try_fmt */
@@ -1252,39 +2038,174 @@ static int imx678_enum_frame_interval(struct v4l2_subdev *sd,
 				      struct v4l2_subdev_pad_config *cfg,
 				struct v4l2_subdev_frame_interval_enum *fie)
 {
-	if (fie->index >= ARRAY_SIZE(supported_modes))
-		return -EINVAL;
+	struct imx678 *imx678 = to_imx678(sd);
+	const struct imx678_mode *mode;
+	u32 index = fie->index;
+	u32 i;
 
-	fie->code = supported_modes[fie->index].bus_fmt;
+	/* each mode's max_fps first, then the standard rates below it */
+	for (i = 0; i < imx678->cfg_num; i++) {
+		mode = &imx678->supported_modes[i];
+		if (weewa_mode_interval(&mode->max_fps, index, &fie->interval)) {
+			fie->code = weewa_bayer_flip(mode->bus_fmt,
+						     imx678->flip);
+			fie->width = mode->width;
+			fie->height = mode->height;
+			fie->reserved[0] = mode->hdr_mode;
+			return 0;
+		}
+		index -= weewa_mode_intervals(&mode->max_fps);
+	}
 
-	fie->width = supported_modes[fie->index].width;
-	fie->height = supported_modes[fie->index].height;
-	fie->interval = supported_modes[fie->index].max_fps;
-	fie->reserved[0] = supported_modes[fie->index].hdr_mode;
-	return 0;
+	return -EINVAL;
 }
 
-#define CROP_START(SRC, DST) (((SRC) - (DST)) / 2 / 4 * 4)
-#define DST_WIDTH 3840
-#define DST_HEIGHT 2160
-
+/*
+ * CROP_BOUNDS is what the receiver keeps of the output, which is all of it;
+ * CROP is the sensor window within the mode, DEFAULT the whole mode.
+ */
 static int imx678_get_selection(struct v4l2_subdev *sd,
 				struct v4l2_subdev_pad_config *cfg,
 				struct v4l2_subdev_selection *sel)
 {
 	struct imx678 *imx678 = to_imx678(sd);
+	int ret = 0;
 
-	if (sel->target == V4L2_SEL_TGT_CROP_BOUNDS) {
-		sel->r.left = CROP_START(imx678->cur_mode->width, DST_WIDTH);
-		sel->r.width = DST_WIDTH;
-		sel->r.top = CROP_START(imx678->cur_mode->height, DST_HEIGHT);
-		sel->r.height = DST_HEIGHT;
-		return 0;
+	mutex_lock(&imx678->mutex);
+	switch (sel->target) {
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+		sel->r.left = 0;
+		sel->r.top = 0;
+		sel->r.width = imx678->crop.width;
+		sel->r.height = imx678->crop.height;
+		break;
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+		sel->r.left = 0;
+		sel->r.top = 0;
+		sel->r.width = imx678->cur_mode->width;
+		sel->r.height = imx678->cur_mode->height;
+		break;
+	case V4L2_SEL_TGT_CROP:
+		sel->r = imx678->crop;
+		break;
+	default:
+		ret = -EINVAL;
+		break;
 	}
-	return -EINVAL;
+	mutex_unlock(&imx678->mutex);
+
+	return ret;
+}
+
+/*
+ * Program a readout window within the current linear mode. The blanking is
+ * kept, so VTS shrinks with the window height and the frame rate goes up.
+ */
+static int imx678_set_selection(struct v4l2_subdev *sd,
+				struct v4l2_subdev_pad_config *cfg,
+				struct v4l2_subdev_selection *sel)
+{
+	struct imx678 *imx678 = to_imx678(sd);
+	const struct imx678_mode *mode;
+	struct v4l2_rect r;
+	u32 vblank_def;
+	int ret = 0;
+
+	if (sel->target != V4L2_SEL_TGT_CROP)
+		return -EINVAL;
+
+	mutex_lock(&imx678->mutex);
+	mode = imx678->cur_mode;
+	if (mode->hdr_mode != NO_HDR) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	r.width = clamp_t(u32, ALIGN_DOWN(sel->r.width, IMX678_CROP_ALIGN),
+			  IMX678_CROP_MIN, mode->width);
+	r.height = clamp_t(u32, ALIGN_DOWN(sel->r.height, IMX678_CROP_ALIGN),
+			   IMX678_CROP_MIN, mode->height);
+	r.left = min_t(u32, ALIGN_DOWN(max(sel->r.left, 0), IMX678_CROP_ALIGN),
+		       mode->width - r.width);
+	r.top = min_t(u32, ALIGN_DOWN(max(sel->r.top, 0), IMX678_CROP_ALIGN),
+		      mode->height - r.height);
+	sel->r = r;
+	if (sel->which == V4L2_SUBDEV_FORMAT_TRY)
+		goto unlock;
+
+	if (imx678->streaming) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	imx678->crop = r;
+	vblank_def = mode->vts_def - mode->height;
+	imx678->cur_vts = imx678_vts_min(imx678);
+	imx678->frame_vts = imx678->cur_vts;
+	__v4l2_ctrl_modify_range(imx678->vblank, vblank_def,
+				 IMX678_VTS_MAX - r.height, 1, vblank_def);
+	__v4l2_ctrl_s_ctrl(imx678->vblank, vblank_def);
+	__v4l2_ctrl_modify_range(imx678->exposure, imx678->exposure->minimum,
+				 imx678_exposure_max(imx678, imx678->cur_vts),
+				 imx678->exposure->step,
+				 imx678->exposure->default_value);
+	weewa_skew_update(&imx678->skew, &mode->max_fps, mode->vts_def,
+			  r.height, mode->hdr_mode);
+
+unlock:
+	mutex_unlock(&imx678->mutex);
+	return ret;
+}
+
+/*
+ * System sleep keeps mode, controls and the streaming flag in memory: the
+ * sensor is stopped and powered down here and, if it was streaming, the
+ * full register state is uploaded again on resume so capture continues
+ * without userspace reconfiguring the pipeline.
+ */
+static int __maybe_unused imx678_suspend(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct imx678 *imx678 = to_imx678(sd);
+	int ret;
+
+	mutex_lock(&imx678->mutex);
+	if (imx678->streaming)
+		__imx678_stop_stream(imx678);
+	mutex_unlock(&imx678->mutex);
+
+	ret = pm_runtime_force_suspend(dev);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+static int __maybe_unused imx678_resume(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct imx678 *imx678 = to_imx678(sd);
+	int ret;
+
+	ret = pm_runtime_force_resume(dev);
+	if (ret)
+		return ret;
+
+	mutex_lock(&imx678->mutex);
+	if (imx678->streaming) {
+		ret = __imx678_start_stream(imx678);
+		if (ret)
+			dev_err(dev, "restart stream after resume failed\n");
+	}
+	mutex_unlock(&imx678->mutex);
+
+	return ret;
 }
 
 static const struct dev_pm_ops imx678_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(imx678_suspend, imx678_resume)
 	SET_RUNTIME_PM_OPS(imx678_runtime_suspend,
 			   imx678_runtime_resume, NULL)
 };
@@ -1301,28 +2222,97 @@ static const struct v4l2_subdev_core_ops imx678_core_ops = {
 #ifdef CONFIG_COMPAT
 	.compat_ioctl32 = imx678_compat_ioctl32,
 #endif
+	.subscribe_event = weewa_subscribe_event,
+	.unsubscribe_event = v4l2_event_subdev_unsubscribe,
 };
 
 static const struct v4l2_subdev_video_ops imx678_video_ops = {
 	.s_stream = imx678_s_stream,
 	.g_frame_interval = imx678_g_frame_interval,
+	.s_frame_interval = imx678_s_frame_interval,
+};
+
+static const struct v4l2_subdev_pad_ops imx678_pad_ops = {
+	.enum_mbus_code = imx678_enum_mbus_code,
+	.enum_frame_size = imx678_enum_frame_sizes,
+	.enum_frame_interval = imx678_enum_frame_interval,
+	.get_fmt = imx678_get_fmt,
+	.set_fmt = imx678_set_fmt,
+	.get_selection = imx678_get_selection,
+	.set_selection = imx678_set_selection,
+	.get_mbus_config = imx678_g_mbus_config,
 };
 
-static const struct v4l2_subdev_pad_ops imx678_pad_ops = {
-	.enum_mbus_code = imx678_enum_mbus_code,
-	.enum_frame_size = imx678_enum_frame_sizes,
-	.enum_frame_interval = imx678_enum_frame_interval,
-	.get_fmt = imx678_get_fmt,
-	.set_fmt = imx678_set_fmt,
-	.get_selection = imx678_get_selection,
-	.get_mbus_config = imx678_g_mbus_config,
-};
+static const struct v4l2_subdev_ops imx678_subdev_ops = {
+	.core	= &imx678_core_ops,
+	.video	= &imx678_video_ops,
+	.pad	= &imx678_pad_ops,
+};
+
+static int imx678_write_vts(struct imx678 *imx678, u32 vts)
+{
+	int ret;
+
+	ret = imx678_write_reg(imx678->client, IMX678_REG_VTS_H,
+			       IMX678_REG_VALUE_08BIT, IMX678_FETCH_VTS_H(vts));
+	ret |= imx678_write_reg(imx678->client, IMX678_REG_VTS_M,
+				IMX678_REG_VALUE_08BIT, IMX678_FETCH_VTS_M(vts));
+	ret |= imx678_write_reg(imx678->client, IMX678_REG_VTS_L,
+				IMX678_REG_VALUE_08BIT, IMX678_FETCH_VTS_L(vts));
+
+	return ret;
+}
+
+/*
+ * The sensor has no multi-frame exposure, so a long exposure stretches
+ * VMAX, up to 20 bits of lines, for the frames that need it and the
+ * VBLANK length returns with the first shorter exposure. VMAX and SHR0
+ * go under register hold so every frame gets a matching pair and none
+ * has to be skipped.
+ */
+static int imx678_write_long_exposure(struct imx678 *imx678, u32 exposure)
+{
+	struct i2c_client *client = imx678->client;
+	u32 vts = imx678_out_vts(imx678, exposure);
+	u32 shr0 = vts - exposure;
+	int ret;
+
+	ret = imx678_write_reg(client, IMX678_REG_HOLD, IMX678_REG_VALUE_08BIT, 1);
+	ret |= imx678_write_vts(imx678, vts);
+	ret |= imx678_write_reg(client, IMX678_SHR_EXPO_REG_H,
+				IMX678_REG_VALUE_08BIT, IMX678_FETCH_EXP_H(shr0));
+	ret |= imx678_write_reg(client, IMX678_SHR_EXPO_REG_M,
+				IMX678_REG_VALUE_08BIT, IMX678_FETCH_EXP_M(shr0));
+	ret |= imx678_write_reg(client, IMX678_SHR_EXPO_REG_L,
+				IMX678_REG_VALUE_08BIT, IMX678_FETCH_EXP_L(shr0));
+	ret |= imx678_write_reg(client, IMX678_REG_HOLD, IMX678_REG_VALUE_08BIT, 0);
+	if (!ret)
+		imx678_set_frame_vts(imx678, vts);
+
+	return ret;
+}
+
+/* mirror and flip, latched together at the next frame while streaming */
+static int imx678_set_flip(struct imx678 *imx678)
+{
+	struct i2c_client *client = imx678->client;
+	int ret = 0;
+
+	if (imx678->streaming)
+		ret = imx678_write_reg(client, IMX678_REG_HOLD,
+				       IMX678_REG_VALUE_08BIT, 1);
+	ret |= imx678_write_reg(client, IMX678_HREVERSE_REG,
+				IMX678_REG_VALUE_08BIT,
+				!!(imx678->flip & WEEWA_FLIP_H));
+	ret |= imx678_write_reg(client, IMX678_VREVERSE_REG,
+				IMX678_REG_VALUE_08BIT,
+				!!(imx678->flip & WEEWA_FLIP_V));
+	if (imx678->streaming)
+		ret |= imx678_write_reg(client, IMX678_REG_HOLD,
+					IMX678_REG_VALUE_08BIT, 0);
 
-static const struct v4l2_subdev_ops imx678_subdev_ops = {
-	.core	= &imx678_core_ops,
-	.video	= &imx678_video_ops,
-	.pad	= &imx678_pad_ops,
-};
+	return ret;
+}
 
 static int imx678_set_ctrl(struct v4l2_ctrl *ctrl)
 {
@@ -1333,26 +2323,59 @@ static int imx678_set_ctrl(struct v4l2_ctrl *ctrl)
 	int ret = 0;
 	u32 shr0 = 0;
 	u32 vts = 0;
-#if 0	
-	u32 flip = 0;
-#endif
+	u8 flip;
+
 	/* Propagate change of current control to all related controls */
 	switch (ctrl->id) {
+	case V4L2_CID_HFLIP:
+		/* the cluster brings VFLIP along, both values are the new ones */
+		flip = (imx678->h_flip->val ? WEEWA_FLIP_H : 0) |
+		       (imx678->v_flip->val ? WEEWA_FLIP_V : 0);
+		if (flip != imx678->flip) {
+			imx678->flip = flip;
+			weewa_notify_src_change(&imx678->subdev);
+		}
+		break;
 	case V4L2_CID_VBLANK:
 		/* Update max exposure while meeting expected vblanking */
-		max = imx678->cur_mode->height + ctrl->val - 4;
+		max = imx678_exposure_max(imx678, imx678->crop.height + ctrl->val);
+		__v4l2_ctrl_modify_range(imx678->exposure,
+					 imx678->exposure->minimum, max,
+					 imx678->exposure->step,
+					 imx678->exposure->default_value);
+		break;
+	case WEEWA_CID_LONG_EXPOSURE:
+		/* ctrl->val is already the new setting for imx678_exposure_max */
+		max = imx678_exposure_max(imx678, imx678->crop.height +
+					  imx678->vblank->val);
 		__v4l2_ctrl_modify_range(imx678->exposure,
 					 imx678->exposure->minimum, max,
 					 imx678->exposure->step,
 					 imx678->exposure->default_value);
 		break;
+	case V4L2_CID_EXPOSURE:
+		weewa_exp_us_track(&imx678->exp_us, ctrl->val);
+		break;
+	case WEEWA_CID_EXPOSURE_US:
+		/* written to the sensor through V4L2_CID_EXPOSURE */
+		return weewa_exp_us_apply(&imx678->exp_us, imx678->exposure,
+					  ctrl);
 	}
 
+	/* written by imx678_sync_set_ae under its own register hold */
+	if (imx678->group_ae && (ctrl->id == V4L2_CID_EXPOSURE ||
+				 ctrl->id == V4L2_CID_ANALOGUE_GAIN))
+		return 0;
+
 	if (!pm_runtime_get_if_in_use(&client->dev))
 		return 0;
 
 	switch (ctrl->id) {
 	case V4L2_CID_EXPOSURE:
+		if (imx678_long_exp_on(imx678)) {
+			ret = imx678_write_long_exposure(imx678, ctrl->val);
+			goto exposure_done;
+		}
 		shr0 = imx678->cur_vts - ctrl->val;
 		/* 4 least significant bits of expsoure are fractional part */
 		ret = imx678_write_reg(imx678->client,
@@ -1367,14 +2390,23 @@ static int imx678_set_ctrl(struct v4l2_ctrl *ctrl)
 					IMX678_SHR_EXPO_REG_L,
 					IMX678_REG_VALUE_08BIT,
 					IMX678_FETCH_EXP_L(shr0));
+exposure_done:
+		if (!ret)
+			weewa_frame_set_ae(&imx678->frames, ctrl->val,
+					   imx678->anal_gain->val, imx678->streaming,
+					   imx678_frame_ns(imx678));
 		break;
 	case V4L2_CID_ANALOGUE_GAIN:
 		ret = imx678_write_reg(imx678->client,
 				       IMX678_REG_GAIN,
 				       IMX678_REG_VALUE_08BIT, ctrl->val);
+		if (!ret)
+			weewa_frame_set_ae(&imx678->frames, imx678->exposure->val,
+					   ctrl->val, imx678->streaming,
+					   imx678_frame_ns(imx678));
 		break;
 	case V4L2_CID_VBLANK:
-		vts = ctrl->val + imx678->cur_mode->height;
+		vts = ctrl->val + imx678->crop.height;
 		/*
 		 * vts of hdr mode is double to correct T-line calculation.
 		 * Restore before write to reg.
@@ -1386,39 +2418,24 @@ static int imx678_set_ctrl(struct v4l2_ctrl *ctrl)
 		} else {
 			imx678->cur_vts = vts;
 		}
-		ret = imx678_write_reg(imx678->client,
-				       IMX678_REG_VTS_H,
-				       IMX678_REG_VALUE_08BIT,
-				       IMX678_FETCH_VTS_H(vts));
-		ret |= imx678_write_reg(imx678->client,
-					IMX678_REG_VTS_M,
-					IMX678_REG_VALUE_08BIT,
-					IMX678_FETCH_VTS_M(vts));
-		ret |= imx678_write_reg(imx678->client,
-					IMX678_REG_VTS_L,
-					IMX678_REG_VALUE_08BIT,
-					IMX678_FETCH_VTS_L(vts));
+		if (imx678_long_exp_on(imx678)) {
+			ret = imx678_write_long_exposure(imx678,
+							 imx678->exposure->val);
+			break;
+		}
+		ret = imx678_write_vts(imx678, vts);
+		if (!ret)
+			imx678_set_frame_vts(imx678, imx678->cur_vts);
+		break;
+	case WEEWA_CID_LONG_EXPOSURE:
+		/* also brings VMAX back to the VBLANK length when turned off */
+		ret = imx678_write_long_exposure(imx678, imx678->exposure->val);
 		break;
 	case V4L2_CID_TEST_PATTERN:
 		ret = imx678_enable_test_pattern(imx678, ctrl->val);
 		break;
 	case V4L2_CID_HFLIP:
-#if 0	
-		ret = imx678_write_reg(imx678->client, IMX678_HREVERSE_REG,
-				       IMX678_REG_VALUE_08BIT, !!ctrl->val);
-#endif					   
-		break;
-	case V4L2_CID_VFLIP:
-#if 0	
-		flip = ctrl->val;
-		if (flip) {
-			ret = imx678_write_reg(imx678->client, IMX678_VREVERSE_REG,
-				IMX678_REG_VALUE_08BIT, !!flip);
-		} else {
-			ret = imx678_write_reg(imx678->client, IMX678_VREVERSE_REG,
-				IMX678_REG_VALUE_08BIT, !!flip);
-				}
-#endif		
+		ret = imx678_set_flip(imx678);
 		break;
 	default:
 		dev_warn(&client->dev, "%s Unhandled id:0x%x, val:0x%x\n",
@@ -1435,6 +2452,15 @@ static const struct v4l2_ctrl_ops imx678_ctrl_ops = {
 	.s_ctrl = imx678_set_ctrl,
 };
 
+static const struct v4l2_ctrl_config imx678_long_exp_ctrl = {
+	.ops	= &imx678_ctrl_ops,
+	.id	= WEEWA_CID_LONG_EXPOSURE,
+	.name	= "Long Exposure",
+	.type	= V4L2_CTRL_TYPE_BOOLEAN,
+	.max	= 1,
+	.step	= 1,
+};
+
 static int imx678_initialize_controls(struct imx678 *imx678)
 {
 	const struct imx678_mode *mode;
@@ -1443,42 +2469,45 @@ static int imx678_initialize_controls(struct imx678 *imx678)
 	u32 h_blank;
 	int ret;
 	s64 dst_pixel_rate = 0;
+	u32 freq_idx;
 
 	handler = &imx678->ctrl_handler;
 	mode = imx678->cur_mode;
-	ret = v4l2_ctrl_handler_init(handler, 9);
+	ret = v4l2_ctrl_handler_init(handler, 13);
 	if (ret)
 		return ret;
 	handler->lock = &imx678->mutex;
 
 	imx678->link_freq = v4l2_ctrl_new_int_menu(handler, NULL,
 						   V4L2_CID_LINK_FREQ,
-						   2, 0, link_freq_menu_items);
+						   ARRAY_SIZE(link_freq_menu_items) - 1,
+						   0, link_freq_menu_items);
 
-	dst_pixel_rate = ((u32)link_freq_menu_items[mode->mipi_freq_idx]) /
-		mode->bpp * 2 * IMX678_LANES;
+	freq_idx = imx678_link_freq_idx(imx678, mode);
+	dst_pixel_rate = imx678_pixel_rate(imx678, mode, freq_idx);
 
 	imx678->pixel_rate = v4l2_ctrl_new_std(handler, NULL,
 					       V4L2_CID_PIXEL_RATE,
-					       0, PIXEL_RATE_WITH_445M_10BIT,
+					       0, PIXEL_RATE_WITH_891M_10BIT,
 					       1, dst_pixel_rate);
-	v4l2_ctrl_s_ctrl(imx678->link_freq,
-			 mode->mipi_freq_idx);
-	imx678->cur_mipi_freq_idx = mode->mipi_freq_idx;
+	v4l2_ctrl_s_ctrl(imx678->link_freq, freq_idx);
+	imx678->cur_mipi_freq_idx = freq_idx;
 	imx678->cur_vclk_freq = mode->vclk_freq;
 
-	h_blank = mode->hts_def - mode->width;
+	h_blank = imx678_hts(mode, dst_pixel_rate) - mode->width;
 	imx678->hblank = v4l2_ctrl_new_std(handler, NULL, V4L2_CID_HBLANK,
 					   h_blank, h_blank, 1, h_blank);
 	if (imx678->hblank)
 		imx678->hblank->flags |= V4L2_CTRL_FLAG_READ_ONLY;
 
+	imx678_reset_crop(imx678);
 	vblank_def = mode->vts_def - mode->height;
 	imx678->vblank = v4l2_ctrl_new_std(handler, &imx678_ctrl_ops,
 					   V4L2_CID_VBLANK, vblank_def,
 					   IMX678_VTS_MAX - mode->height,
 					   1, vblank_def);
 	imx678->cur_vts = mode->vts_def;
+	imx678->frame_vts = mode->vts_def;
 	exposure_max = mode->vts_def - 4;
 	imx678->exposure = v4l2_ctrl_new_std(handler, &imx678_ctrl_ops,
 					     V4L2_CID_EXPOSURE,
@@ -1500,8 +2529,17 @@ static int imx678_initialize_controls(struct imx678 *imx678)
 				ARRAY_SIZE(imx678_test_pattern_menu) - 1,
 				0, 0, imx678_test_pattern_menu);
 
-	v4l2_ctrl_new_std(handler, &imx678_ctrl_ops, V4L2_CID_HFLIP, 0, 1, 1, 0);
-	v4l2_ctrl_new_std(handler, &imx678_ctrl_ops, V4L2_CID_VFLIP, 0, 1, 1, 0);
+	imx678->h_flip = v4l2_ctrl_new_std(handler, &imx678_ctrl_ops,
+					   V4L2_CID_HFLIP, 0, 1, 1, 0);
+	imx678->v_flip = v4l2_ctrl_new_std(handler, &imx678_ctrl_ops,
+					   V4L2_CID_VFLIP, 0, 1, 1, 0);
+	v4l2_ctrl_cluster(2, &imx678->h_flip);
+	imx678->flip = 0;
+
+	weewa_skew_init(handler, &imx678->skew);
+	imx678->long_exp = v4l2_ctrl_new_custom(handler, &imx678_long_exp_ctrl,
+						NULL);
+	weewa_exp_us_init(handler, &imx678_ctrl_ops, &imx678->exp_us);
 
 	if (handler->error) {
 		ret = handler->error;
@@ -1510,6 +2548,13 @@ static int imx678_initialize_controls(struct imx678 *imx678)
 		goto err_free_handler;
 	}
 
+	mutex_lock(&imx678->mutex);
+	weewa_skew_update(&imx678->skew, &mode->max_fps, mode->vts_def,
+			  mode->height, mode->hdr_mode);
+	weewa_exp_us_update(&imx678->exp_us, &mode->max_fps, mode->vts_def,
+			    imx678->exposure->val);
+	mutex_unlock(&imx678->mutex);
+
 	imx678->subdev.ctrl_handler = handler;
 	imx678->has_init_exp = false;
 	return 0;
@@ -1545,6 +2590,182 @@ static int imx678_check_sensor_id(struct imx678 *imx678,
 	return 0;
 }
 
+static int imx678_parse_lanes(struct imx678 *imx678)
+{
+	struct device *dev = &imx678->client->dev;
+	int ret;
+
+	ret = weewa_parse_lanes(dev, &imx678->lanes);
+	if (ret)
+		return ret;
+
+	switch (imx678->lanes) {
+	case IMX678_LANES:
+		imx678->supported_modes = supported_modes;
+		imx678->cfg_num = ARRAY_SIZE(supported_modes);
+		break;
+	case IMX678_LANES_2:
+		imx678->supported_modes = supported_modes_2lane;
+		imx678->cfg_num = ARRAY_SIZE(supported_modes_2lane);
+		break;
+	default:
+		dev_err(dev, "unsupported data-lanes %u\n", imx678->lanes);
+		return -EINVAL;
+	}
+	dev_info(dev, "%u data lanes\n", imx678->lanes);
+
+	return 0;
+}
+
+/* (code, hdr_mode) bucketed keys of the lane count's mode table */
+static int imx678_build_mode_index(struct imx678 *imx678)
+{
+	const struct imx678_mode *mode;
+	u32 i;
+
+	imx678->mode_index = devm_kcalloc(&imx678->client->dev, imx678->cfg_num,
+					  sizeof(*imx678->mode_index),
+					  GFP_KERNEL);
+	if (!imx678->mode_index)
+		return -ENOMEM;
+
+	for (i = 0; i < imx678->cfg_num; i++) {
+		mode = &imx678->supported_modes[i];
+		weewa_mode_key_fill(&imx678->mode_index[i], i, mode->width,
+				    mode->height, mode->bus_fmt, mode->hdr_mode,
+				    &mode->max_fps, mode->bpp, mode->vts_def);
+	}
+	weewa_mode_index_sort(imx678->mode_index, imx678->cfg_num);
+
+	return 0;
+}
+
+static int imx678_join_power_group(struct imx678 *imx678)
+{
+	struct weewa_pwr_member *pwr = &imx678->pwr;
+
+	pwr->dev = &imx678->client->dev;
+	pwr->xvclk = imx678->xvclk;
+	pwr->reset_gpio = imx678->reset_gpio;
+	pwr->pwdn_gpio = imx678->pwdn_gpio;
+	pwr->supplies = imx678->supplies;
+	pwr->num_supplies = IMX678_NUM_SUPPLIES;
+	pwr->pinctrl = imx678->pinctrl;
+	pwr->pins_default = imx678->pins_default;
+	pwr->reset_delay_us = 500;
+	/* a sibling may power the group before this sensor first does */
+	pwr->xvclk_rate = IMX678_XVCLK_FREQ_37;
+
+	return weewa_pwr_join(pwr);
+}
+
+static int imx678_sync_release(void *priv)
+{
+	struct imx678 *imx678 = priv;
+	int ret;
+
+	ret = imx678_write_reg(imx678->client, IMX678_REG_CTRL_MODE,
+			       IMX678_REG_VALUE_08BIT, IMX678_MODE_STREAMING);
+	if (!ret)
+		weewa_frame_start(&imx678->frames);
+
+	return ret;
+}
+
+static bool imx678_sync_running(void *priv)
+{
+	struct imx678 *imx678 = priv;
+	u32 val = 0;
+
+	if (imx678_read_reg(imx678->client, IMX678_REG_CTRL_MODE,
+			    IMX678_REG_VALUE_08BIT, &val))
+		return false;
+
+	return val == IMX678_MODE_STREAMING;
+}
+
+static int imx678_sync_set_ae(void *priv, u32 exposure, u32 gain)
+{
+	struct imx678 *imx678 = priv;
+	struct i2c_client *client = imx678->client;
+	u32 shr0, vts;
+	int ret;
+
+	if (!mutex_trylock(&imx678->mutex))
+		return -EBUSY;
+
+	if (imx678->cur_mode->hdr_mode != NO_HDR) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	exposure = clamp_t(u32, exposure, imx678->exposure->minimum,
+			   imx678->exposure->maximum);
+	gain = clamp_t(u32, gain, IMX678_GAIN_MIN, IMX678_GAIN_MAX);
+	vts = imx678_out_vts(imx678, exposure);
+	shr0 = vts - exposure;
+
+	ret = imx678_write_reg(client, IMX678_REG_HOLD, IMX678_REG_VALUE_08BIT, 1);
+	if (imx678_long_exp_on(imx678))
+		ret |= imx678_write_vts(imx678, vts);
+	ret |= imx678_write_reg(client, IMX678_SHR_EXPO_REG_L, IMX678_REG_VALUE_08BIT,
+				IMX678_FETCH_EXP_L(shr0));
+	ret |= imx678_write_reg(client, IMX678_SHR_EXPO_REG_M, IMX678_REG_VALUE_08BIT,
+				IMX678_FETCH_EXP_M(shr0));
+	ret |= imx678_write_reg(client, IMX678_SHR_EXPO_REG_H, IMX678_REG_VALUE_08BIT,
+				IMX678_FETCH_EXP_H(shr0));
+	ret |= imx678_write_reg(client, IMX678_REG_GAIN, IMX678_REG_VALUE_08BIT, gain);
+	ret |= imx678_write_reg(client, IMX678_REG_HOLD, IMX678_REG_VALUE_08BIT, 0);
+	if (!ret) {
+		/* already in the registers, only bring the controls in line */
+		imx678->group_ae = true;
+		__v4l2_ctrl_s_ctrl(imx678->exposure, exposure);
+		__v4l2_ctrl_s_ctrl(imx678->anal_gain, gain);
+		imx678->group_ae = false;
+		imx678_set_frame_vts(imx678, vts);
+		weewa_frame_set_ae(&imx678->frames, exposure, gain, true,
+				   imx678_frame_ns(imx678));
+	}
+unlock:
+	mutex_unlock(&imx678->mutex);
+
+	return ret;
+}
+
+static int imx678_sync_frame_pos(void *priv, u32 *frame, u64 *pos_ns,
+				 u64 *frame_ns)
+{
+	struct imx678 *imx678 = priv;
+
+	if (!mutex_trylock(&imx678->mutex))
+		return -EBUSY;
+	*frame_ns = imx678_frame_ns(imx678);
+	*frame = weewa_frame_position(&imx678->frames, *frame_ns, pos_ns);
+	mutex_unlock(&imx678->mutex);
+
+	return 0;
+}
+
+static const struct weewa_sync_ops imx678_sync_ops = {
+	.release = imx678_sync_release,
+	.running = imx678_sync_running,
+	.set_ae = imx678_sync_set_ae,
+	.frame_pos = imx678_sync_frame_pos,
+};
+
+static int imx678_join_sync_group(struct imx678 *imx678)
+{
+	struct weewa_sync_member *sync = &imx678->sync;
+
+	sync->dev = &imx678->client->dev;
+	sync->ops = &imx678_sync_ops;
+	sync->priv = imx678;
+	sync->mode = &imx678->sync_mode;
+	sync->index = imx678->module_index;
+
+	return weewa_sync_join(sync);
+}
+
 static int imx678_configure_regulators(struct imx678 *imx678)
 {
 	unsigned int i;
@@ -1558,8 +2779,13 @@ static int imx678_configure_regulators(struct imx678 *imx678)
 }
 
 
-static int imx678_probe(struct i2c_client *client,
-			const struct i2c_device_id *id)
+/*
+ * When @detected is set the caller has already powered the sensor and read
+ * its chip id, so the power-on sequence and the id check are left to the
+ * first runtime resume instead of being repeated on the boot path.
+ */
+static int __imx678_probe(struct i2c_client *client,
+			  const struct i2c_device_id *id, bool detected)
 {
 	struct device *dev = &client->dev;
 	struct device_node *node = dev->of_node;
@@ -1569,12 +2795,14 @@ static int imx678_probe(struct i2c_client *client,
 	int ret;
 	
 	const char *sync_mode_name = NULL;
+	ktime_t t_start, t_ctrl, t_power, t_id, t_end;
 
 	dev_info(dev, "driver version: %02x.%02x.%02x",
 		 IMX678_DRIVER_VERSION >> 16,
 		 (IMX678_DRIVER_VERSION & 0xff00) >> 8,
 		 IMX678_DRIVER_VERSION & 0x00ff);
 
+	t_start = ktime_get();
 	imx678 = devm_kzalloc(dev, sizeof(*imx678), GFP_KERNEL);
 	if (!imx678)
 		return -ENOMEM;
@@ -1607,8 +2835,14 @@ static int imx678_probe(struct i2c_client *client,
 			imx678->sync_mode = SLAVE_MODE;
 	}
 	imx678->client = client;
-	
-	imx678->cur_mode = &supported_modes[0];
+	ret = imx678_parse_lanes(imx678);
+	if (ret)
+		return ret;
+	ret = imx678_build_mode_index(imx678);
+	if (ret)
+		return ret;
+
+	imx678->cur_mode = &imx678->supported_modes[0];
 
 	imx678->xvclk = devm_clk_get(dev, "xvclk");
 	if (IS_ERR(imx678->xvclk)) {
@@ -1647,6 +2881,16 @@ static int imx678_probe(struct i2c_client *client,
 		return ret;
 	}
 
+	ret = imx678_join_power_group(imx678);
+	if (ret)
+		return ret;
+
+	ret = imx678_join_sync_group(imx678);
+	if (ret) {
+		weewa_pwr_leave(&imx678->pwr);
+		return ret;
+	}
+
 	mutex_init(&imx678->mutex);
 
 	sd = &imx678->subdev;
@@ -1655,18 +2899,25 @@ static int imx678_probe(struct i2c_client *client,
 	ret = imx678_initialize_controls(imx678);
 	if (ret)
 		goto err_destroy_mutex;
+	t_ctrl = ktime_get();
 
-	ret = __imx678_power_on(imx678);
-	if (ret)
-		goto err_free_handler;
+	if (!detected) {
+		ret = __imx678_power_on(imx678);
+		if (ret)
+			goto err_free_handler;
+		t_power = ktime_get();
 
-	ret = imx678_check_sensor_id(imx678, client);
-	if (ret)
-		goto err_power_off;
+		ret = imx678_check_sensor_id(imx678, client);
+		if (ret)
+			goto err_power_off;
+	} else {
+		t_power = t_ctrl;
+	}
+	t_id = ktime_get();
 
 #ifdef CONFIG_VIDEO_V4L2_SUBDEV_API
 	sd->internal_ops = &imx678_internal_ops;
-	sd->flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
+	sd->flags |= V4L2_SUBDEV_FL_HAS_DEVNODE | V4L2_SUBDEV_FL_HAS_EVENTS;
 #endif
 #if defined(CONFIG_MEDIA_CONTROLLER)
 	imx678->pad.flags = MEDIA_PAD_FL_SOURCE;
@@ -1691,9 +2942,22 @@ static int imx678_probe(struct i2c_client *client,
 		goto err_clean_entity;
 	}
 
-	pm_runtime_set_active(dev);
-	pm_runtime_enable(dev);
-	pm_runtime_idle(dev);
+	if (detected) {
+		pm_runtime_enable(dev);
+	} else {
+		pm_runtime_set_active(dev);
+		pm_runtime_enable(dev);
+		pm_runtime_idle(dev);
+	}
+
+	t_end = ktime_get();
+	if (boot_timing)
+		dev_info(dev, "probe timing(us): ctrls %lld, power %lld, id %lld, register %lld, total %lld\n",
+			 ktime_us_delta(t_ctrl, t_start),
+			 ktime_us_delta(t_power, t_ctrl),
+			 ktime_us_delta(t_id, t_power),
+			 ktime_us_delta(t_end, t_id),
+			 ktime_us_delta(t_end, t_start));
 
 	return 0;
 
@@ -1702,11 +2966,14 @@ err_clean_entity:
 	media_entity_cleanup(&sd->entity);
 #endif
 err_power_off:
-	__imx678_power_off(imx678);
+	if (!detected)
+		__imx678_power_off(imx678);
 err_free_handler:
 	v4l2_ctrl_handler_free(&imx678->ctrl_handler);
 err_destroy_mutex:
 	mutex_destroy(&imx678->mutex);
+	weewa_sync_leave(&imx678->sync);
+	weewa_pwr_leave(&imx678->pwr);
 
 	return ret;
 }
@@ -1727,12 +2994,20 @@ static int imx678_remove(struct i2c_client *client)
 	if (!pm_runtime_status_suspended(&client->dev))
 		__imx678_power_off(imx678);
 	pm_runtime_set_suspended(&client->dev);
+	weewa_sync_leave(&imx678->sync);
+	weewa_pwr_leave(&imx678->pwr);
 
 	return 0;
 }
 
 #ifndef INNOSZ_WEEWA_DRIVER
 
+static int imx678_probe(struct i2c_client *client,
+			const struct i2c_device_id *id)
+{
+	return __imx678_probe(client, id, false);
+}
+
 #if IS_ENABLED(CONFIG_OF)
 static const struct of_device_id imx678_of_match[] = {
 	{ .compatible = "sony,imx678" },
@@ -1751,6 +3026,7 @@ static struct i2c_driver imx678_i2c_driver = {
 		.name = IMX678_NAME,
 		.pm = &imx678_pm_ops,
 		.of_match_table = of_match_ptr(imx678_of_match),
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe		= &imx678_probe,
 	.remove		= &imx678_remove,
@@ -1774,43 +3050,221 @@ MODULE_DESCRIPTION("Sony imx678 sensor driver");
 MODULE_LICENSE("GPL v2");
 #else
 #include "imx334.c"
+#include "imx586.c"
 #define WEEWA_NAME "weewacam"
-int sensor_type = 0;
+/*
+ * Sensors the weewa wrapper can front. The subdev ops pointer doubles as the
+ * per-client tag: once probed, a client's subdev tells which entry owns it,
+ * so each camera dispatches on its own sensor rather than on a global.
+ * Detection powers the camera with the clock and reset timing of an entry
+ * and reads its 16 bit id register.
+ */
+struct weewa_sensor {
+	int type;
+	u16 id_reg;
+	u32 chip_id;
+	unsigned long xvclk_rate;
+	u32 reset_delay_us;
+	const struct v4l2_subdev_ops *subdev_ops;
+	int (*probe)(struct i2c_client *client,
+		     const struct i2c_device_id *id, bool detected);
+	int (*remove)(struct i2c_client *client);
+	int (*runtime_suspend)(struct device *dev);
+	int (*runtime_resume)(struct device *dev);
+	int (*suspend)(struct device *dev);
+	int (*resume)(struct device *dev);
+};
+
+static const struct weewa_sensor weewa_sensors[] = {
+	{
+		.type = 0x678,
+		.id_reg = IMX678_REG_CHIP_ID,
+		.chip_id = IMX678_CHIP_ID,
+		.xvclk_rate = IMX678_XVCLK_FREQ_37,
+		.reset_delay_us = 500,
+		.subdev_ops = &imx678_subdev_ops,
+		.probe = __imx678_probe,
+		.remove = imx678_remove,
+		.runtime_suspend = imx678_runtime_suspend,
+		.runtime_resume = imx678_runtime_resume,
+		.suspend = imx678_suspend,
+		.resume = imx678_resume,
+	},
+	{
+		.type = 0x334,
+		.id_reg = IMX334_REG_IMX334_CHIP_ID,
+		.chip_id = IMX334_CHIP_ID,
+		.xvclk_rate = IMX678_XVCLK_FREQ_37,
+		.reset_delay_us = 500,
+		.subdev_ops = &imx334_subdev_ops,
+		.probe = __imx334_probe,
+		.remove = imx334_remove,
+		.runtime_suspend = imx334_runtime_suspend,
+		.runtime_resume = imx334_runtime_resume,
+		.suspend = imx334_suspend,
+		.resume = imx334_resume,
+	},
+	{
+		.type = 0x586,
+		.id_reg = IMX586_REG_CHIP_ID_H,
+		.chip_id = IMX586_CHIP_ID,
+		.xvclk_rate = IMX586_XVCLK_FREQ,
+		.reset_delay_us = 8000,
+		.subdev_ops = &imx586_subdev_ops,
+		.probe = __imx586_probe,
+		.remove = imx586_remove,
+		.runtime_suspend = imx586_runtime_suspend,
+		.runtime_resume = imx586_runtime_resume,
+		.suspend = imx586_suspend,
+		.resume = imx586_resume,
+	},
+};
+
+static const struct weewa_sensor *weewa_find_sensor(int type)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(weewa_sensors); i++)
+		if (weewa_sensors[i].type == type)
+			return &weewa_sensors[i];
+
+	return NULL;
+}
+
+static const struct weewa_sensor *weewa_find_sensor_by_id(u16 reg, u32 id)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(weewa_sensors); i++)
+		if (weewa_sensors[i].id_reg == reg &&
+		    weewa_sensors[i].chip_id == id)
+			return &weewa_sensors[i];
+
+	return NULL;
+}
+
+/* power the probe-time instance with the clock and timing @sensor needs */
+static int weewa_power_for(struct imx678 *imx678,
+			   const struct weewa_sensor *sensor)
+{
+	imx678->pwr.xvclk_rate = sensor->xvclk_rate;
+	imx678->pwr.reset_delay_us = sensor->reset_delay_us;
+
+	return weewa_pwr_get(&imx678->pwr);
+}
+
+static const struct weewa_sensor *weewa_client_sensor(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	int i;
+
+	if (!sd)
+		return NULL;
+	for (i = 0; i < ARRAY_SIZE(weewa_sensors); i++)
+		if (sd->ops == weewa_sensors[i].subdev_ops)
+			return &weewa_sensors[i];
+
+	return NULL;
+}
+
+/*
+ * Try each distinct power-up/id register combination in table order, the
+ * sensor is left powered on success. Entries that share both (334 and 678)
+ * are told apart by the same read.
+ */
 static int weewa_check_sensor_id(struct imx678 *imx678,
-				  struct i2c_client *client)
+				  struct i2c_client *client,
+				  const struct weewa_sensor **sensor)
 {
 	struct device *dev = &imx678->client->dev;
+	const struct weewa_sensor *cfg, *prev = NULL;
 	u32 id = 0;
-	int ret, i;
+	int ret = 0, i, j;
+
+	for (j = 0; j < ARRAY_SIZE(weewa_sensors); j++) {
+		cfg = &weewa_sensors[j];
+		if (prev && prev->id_reg == cfg->id_reg &&
+		    prev->xvclk_rate == cfg->xvclk_rate &&
+		    prev->reset_delay_us == cfg->reset_delay_us)
+			continue;
+		prev = cfg;
+
+		ret = weewa_power_for(imx678, cfg);
+		if (ret)
+			return ret;
 
-	for (i = 0; i < 10; i++) {
-		ret = imx678_read_reg(client, IMX678_REG_CHIP_ID,
-				      IMX678_REG_VALUE_16BIT, &id);
-		if (id == IMX678_CHIP_ID){
-			sensor_type = 0x678;
-		    break;
-		}
-		else if (id == IMX334_CHIP_ID){
-			sensor_type = 0x334;
-			break;
+		for (i = 0; i < 10; i++) {
+			ret = imx678_read_reg(client, cfg->id_reg,
+					      IMX678_REG_VALUE_16BIT, &id);
+			*sensor = weewa_find_sensor_by_id(cfg->id_reg, id);
+			if (*sensor) {
+				dev_info(dev, "Detected camera id:%06x\n", id);
+				return 0;
+			}
 		}
+		weewa_pwr_put(&imx678->pwr);
 	}
 
-	if (id == IMX678_CHIP_ID||id == IMX334_CHIP_ID) {
-        dev_info(dev, "Detected camera id:%06x\n", id);
-	    return 0;
-	}
 	dev_err(dev, "weewacam Unexpected sensor id(%06x), ret(%d)\n", id, ret);
 	usleep_range(2000, 4000);
 	return -ENODEV;
 }
 
+/*
+ * Optional "sensor-type" nvmem cell on the camera node, 16 bit, holding the
+ * type found on a previous boot (0x334 or 0x678). Absent cell means no cache.
+ */
+static const struct weewa_sensor *weewa_get_cached_sensor(struct device *dev)
+{
+	u16 type;
+
+	if (nvmem_cell_read_u16(dev, "sensor-type", &type))
+		return NULL;
+
+	return weewa_find_sensor(type);
+}
+
+static void weewa_set_cached_type(struct device *dev, int type)
+{
+	struct nvmem_cell *cell;
+	u16 val = type;
+	int ret;
+
+	cell = nvmem_cell_get(dev, "sensor-type");
+	if (IS_ERR(cell))
+		return;
+
+	ret = nvmem_cell_write(cell, &val, sizeof(val));
+	if (ret < 0)
+		dev_warn(dev, "failed to cache sensor type, ret(%d)\n", ret);
+	nvmem_cell_put(cell);
+}
+
+/* single read to confirm the cached type, no retries */
+static int weewa_confirm_sensor_id(struct i2c_client *client,
+				   const struct weewa_sensor *sensor)
+{
+	u32 id = 0;
+	int ret;
+
+	ret = imx678_read_reg(client, sensor->id_reg,
+			      IMX678_REG_VALUE_16BIT, &id);
+	if (ret)
+		return ret;
+
+	return id == sensor->chip_id ? 0 : -ENODEV;
+}
+
 static int weewa_probe(struct i2c_client *client,
 			const struct i2c_device_id *id){
 	struct device *dev = &client->dev;
 	struct imx678 * imx678;
+	const struct weewa_sensor *sensor = NULL, *cached;
+	ktime_t t_start;
     int ret;
 
+	t_start = ktime_get();
+
 	imx678 = devm_kzalloc(dev, sizeof(*imx678), GFP_KERNEL);
 	if (!imx678)
 		return -ENOMEM;
@@ -1847,69 +3301,91 @@ static int weewa_probe(struct i2c_client *client,
 		dev_err(dev, "Failed to get power regulators\n");
 		return ret;
 	}
-	ret = __imx678_power_on(imx678);
-	if (ret){
-		dev_err(dev, "__imx678_power_on failed\n");
-		goto err_power_off;
+	ret = imx678_join_power_group(imx678);
+	if (ret)
+		goto err_free;
+
+	cached = weewa_get_cached_sensor(dev);
+	if (cached) {
+		ret = weewa_power_for(imx678, cached);
+		if (ret){
+			dev_err(dev, "weewa power on failed\n");
+			goto err_leave;
+		}
+		if (!weewa_confirm_sensor_id(client, cached))
+			sensor = cached;
+		else
+			weewa_pwr_put(&imx678->pwr);
 	}
-
-	ret = weewa_check_sensor_id(imx678, client);
-	if (ret){
-        dev_err(dev, "weewa_check_sensor_id failed\n");
-		goto err_power_off;
+	if (!sensor) {
+		ret = weewa_check_sensor_id(imx678, client, &sensor);
+		if (ret){
+			dev_err(dev, "weewa_check_sensor_id failed\n");
+			goto err_leave;
+		}
+		if (sensor != cached)
+			weewa_set_cached_type(dev, sensor->type);
 	}
+	/* the real driver powers up again on first use */
+	weewa_pwr_put(&imx678->pwr);
+	weewa_pwr_leave(&imx678->pwr);
     devm_gpiod_put(dev, imx678->reset_gpio );
 	devm_gpiod_put(dev, imx678->pwdn_gpio );
 	//devm_pinctrl_put(imx678->pinctrl);
     devm_kfree(dev,imx678);
     imx678 = NULL;
-	dev_info(dev,"sensor_type=0x%x",sensor_type);
-    if (sensor_type==0x678)
-	    return imx678_probe(client,id);
-    else if (sensor_type==0x334)
-        return imx334_probe(client,id);
-    else 
-        return -ENODEV;
-
-err_power_off:
-	__imx678_power_off(imx678);	
+	if (boot_timing)
+		dev_info(dev, "detect timing(us): %lld\n",
+			 ktime_us_delta(ktime_get(), t_start));
+	dev_info(dev,"sensor_type=0x%x",sensor->type);
+	return sensor->probe(client, id, true);
+
+err_leave:
+	weewa_pwr_leave(&imx678->pwr);
+err_free:
     devm_kfree(dev,imx678);
     imx678 = NULL;
     return ret;
 
 }
 
-static int weewa_remove(struct i2c_client *client){
-	printk("weewa_remove sensor_type=%d\n",sensor_type);
-    if (sensor_type==0x678)
-	    return imx678_remove(client);
-    else if (sensor_type==0x334)
-        return imx334_remove(client);
-	else
-		return 0;
+static int weewa_remove(struct i2c_client *client)
+{
+	const struct weewa_sensor *sensor = weewa_client_sensor(&client->dev);
+
+	return sensor ? sensor->remove(client) : 0;
 }
 
-static int weewa_runtime_suspend(struct device *dev){
-	printk("weewa_runtime_suspend sensor_type=%d\n",sensor_type);
-    if (sensor_type==0x678)
-	    return imx678_runtime_suspend(dev);
-    else if (sensor_type==0x334)
-        return imx334_runtime_suspend(dev);
-	else
-		return 0;
+static int weewa_runtime_suspend(struct device *dev)
+{
+	const struct weewa_sensor *sensor = weewa_client_sensor(dev);
+
+	return sensor ? sensor->runtime_suspend(dev) : 0;
 }
 
-static int weewa_runtime_resume(struct device *dev){
-	printk("weewa_runtime_resume sensor_type=%d\n",sensor_type);
-    if (sensor_type==0x678)
-	    return imx678_runtime_resume(dev);
-    else if (sensor_type==0x334)
-        return imx334_runtime_resume(dev);
-	else
-		return 0;
+static int weewa_runtime_resume(struct device *dev)
+{
+	const struct weewa_sensor *sensor = weewa_client_sensor(dev);
+
+	return sensor ? sensor->runtime_resume(dev) : 0;
+}
+
+static int __maybe_unused weewa_suspend(struct device *dev)
+{
+	const struct weewa_sensor *sensor = weewa_client_sensor(dev);
+
+	return sensor ? sensor->suspend(dev) : 0;
+}
+
+static int __maybe_unused weewa_resume(struct device *dev)
+{
+	const struct weewa_sensor *sensor = weewa_client_sensor(dev);
+
+	return sensor ? sensor->resume(dev) : 0;
 }
 
 static const struct dev_pm_ops weewa_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(weewa_suspend, weewa_resume)
 	SET_RUNTIME_PM_OPS(weewa_runtime_suspend,
 			   weewa_runtime_resume, NULL)
 };
@@ -1932,6 +3408,7 @@ static struct i2c_driver weewa_i2c_driver = {
 		.name = WEEWA_NAME,
 		.pm = &weewa_pm_ops,
 		.of_match_table = of_match_ptr(weewa_of_match),
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe		= &weewa_probe,
 	.remove		= &weewa_remove,
@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * weewa frame tracking shared by the sensor drivers
+ *
+ * WEEWA_CMD_GET_FRAME_INFO reports which frame the sensor is outputting,
+ * when it started and the exposure and gain it was taken with. Frames are
+ * counted from the last standby release. Sensors with a frame counter
+ * register have it read back, the others derive the count from the release
+ * time and the frame length, rebased whenever that length changes.
+ */
+
+#ifndef __WEEWA_FRAME_H__
+#define __WEEWA_FRAME_H__
+
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/rk-camera-module.h>
+#include <linux/videodev2.h>
+
+#define WEEWA_FRAME_SRC_TIMING	0
+#define WEEWA_FRAME_SRC_SENSOR	1
+
+struct weewa_frame_info {
+	__u32 frame;
+	__u32 source;		/* WEEWA_FRAME_SRC_* */
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC start of @frame */
+	__u32 exposure;		/* lines */
+	__u32 gain;		/* V4L2_CID_ANALOGUE_GAIN value */
+} __attribute__ ((packed));
+
+#define WEEWA_CMD_GET_FRAME_INFO	\
+	_IOR('V', BASE_VIDIOC_PRIVATE + 102, struct weewa_frame_info)
+
+struct weewa_frame_ae {
+	u32	exposure;
+	u32	gain;
+	u32	frame;		/* first frame taken with these values */
+};
+
+struct weewa_frame_track {
+	ktime_t			started;
+	/* [0] is the latest setting, [1] the one before */
+	struct weewa_frame_ae	ae[2];
+};
+
+static inline void weewa_frame_start(struct weewa_frame_track *t)
+{
+	t->started = ktime_get();
+	t->ae[0].frame = 0;
+	t->ae[1] = t->ae[0];
+}
+
+/* frame being output and the time into it, 0 for an unknown length */
+static inline u32 weewa_frame_position(struct weewa_frame_track *t,
+				       u64 frame_ns, u64 *pos_ns)
+{
+	*pos_ns = 0;
+	if (!frame_ns)
+		return 0;
+
+	return div64_u64_rem(ktime_to_ns(ktime_sub(ktime_get(), t->started)),
+			     frame_ns, pos_ns);
+}
+
+static inline u32 weewa_frame_estimate(struct weewa_frame_track *t,
+				       u64 frame_ns)
+{
+	u64 pos_ns;
+
+	return weewa_frame_position(t, frame_ns, &pos_ns);
+}
+
+/* record exposure and gain written now, they latch at the next frame */
+static inline void weewa_frame_set_ae(struct weewa_frame_track *t,
+				      u32 exposure, u32 gain,
+				      bool streaming, u64 frame_ns)
+{
+	u32 frame = streaming ? weewa_frame_estimate(t, frame_ns) + 1 : 0;
+
+	if (t->ae[0].frame != frame)
+		t->ae[1] = t->ae[0];
+	t->ae[0].exposure = exposure;
+	t->ae[0].gain = gain;
+	t->ae[0].frame = frame;
+}
+
+/*
+ * After a switch at @frame the old frame length still dates the frames
+ * before it: move the start so the new length counts on from there.
+ */
+static inline void weewa_frame_rebase(struct weewa_frame_track *t, u32 frame,
+				      u64 old_ns, u64 new_ns)
+{
+	t->started = ktime_add_ns(t->started, frame * old_ns);
+	t->started = ktime_sub_ns(t->started, frame * new_ns);
+}
+
+/*
+ * The frame length goes from @old_ns to @new_ns at the next frame start,
+ * on a VTS write: frames up to there keep the old length.
+ */
+static inline void weewa_frame_relength(struct weewa_frame_track *t,
+					bool streaming, u64 old_ns, u64 new_ns)
+{
+	if (!streaming || !old_ns || !new_ns || old_ns == new_ns)
+		return;
+
+	weewa_frame_rebase(t, weewa_frame_estimate(t, old_ns) + 1, old_ns,
+			   new_ns);
+}
+
+static inline void weewa_frame_fill(struct weewa_frame_track *t, u32 frame,
+				    u64 frame_ns, struct weewa_frame_info *fi)
+{
+	const struct weewa_frame_ae *ae;
+
+	ae = frame >= t->ae[0].frame ? &t->ae[0] : &t->ae[1];
+	fi->frame = frame;
+	fi->timestamp_ns = ktime_to_ns(t->started) + frame * frame_ns;
+	fi->exposure = ae->exposure;
+	fi->gain = ae->gain;
+}
+
+static inline void weewa_frame_get_timing(struct weewa_frame_track *t,
+					  u64 frame_ns,
+					  struct weewa_frame_info *fi)
+{
+	weewa_frame_fill(t, weewa_frame_estimate(t, frame_ns), frame_ns, fi);
+	fi->source = WEEWA_FRAME_SRC_TIMING;
+}
+
+/*
+ * The CCS 8-bit frame counter runs 0x00..0xfe and wraps there, 0xff
+ * marks it invalid, so it gives the frame modulo 255. The timing estimate
+ * picks the nearest frame with that remainder.
+ */
+#define WEEWA_FRAME_COUNT_PERIOD	255
+
+static inline void weewa_frame_get_counter(struct weewa_frame_track *t,
+					   u64 frame_ns, u8 count,
+					   struct weewa_frame_info *fi)
+{
+	u32 est = weewa_frame_estimate(t, frame_ns);
+	u32 d = (est % WEEWA_FRAME_COUNT_PERIOD + WEEWA_FRAME_COUNT_PERIOD -
+		 count) % WEEWA_FRAME_COUNT_PERIOD;
+	u32 frame;
+
+	if (d <= WEEWA_FRAME_COUNT_PERIOD / 2)
+		frame = est >= d ? est - d : count;
+	else
+		frame = est + (WEEWA_FRAME_COUNT_PERIOD - d);
+
+	weewa_frame_fill(t, frame, frame_ns, fi);
+	fi->source = WEEWA_FRAME_SRC_SENSOR;
+}
+
+#endif /* __WEEWA_FRAME_H__ */
@@ -0,0 +1,260 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * weewa mode selection shared by the sensor drivers
+ *
+ * WEEWA_CMD_SWITCH_MODE changes mode without a stream off. While streaming
+ * only modes the receiver cannot tell apart on the link qualify: same bus
+ * format and input clock, and a data rate the running link carries. The
+ * differing registers are written under register hold so they latch
+ * together at the next frame start, reported as the first frame of the new
+ * mode; the one before it may be cut short. Frame numbers keep counting
+ * across the switch, and a V4L2_EVENT_SOURCE_CHANGE is queued when the
+ * output size or bus code changes: the bridge has to stop and reallocate
+ * its buffers before the new frames arrive. When not streaming it is a
+ * plain mode change.
+ *
+ * set_fmt and s_frame_interval pick modes from an index built at probe:
+ * one key per mode table entry with its size, bus code, HDR mode, fastest
+ * interval and bandwidth, bucketed by bus code and HDR mode.
+ *
+ * HFLIP and VFLIP are clustered and apply while streaming under register
+ * hold. The reported bus code follows the Bayer order the flips read out,
+ * and a V4L2_EVENT_SOURCE_CHANGE is queued when it changes so the ISP
+ * reloads the format without a stream restart.
+ */
+
+#ifndef __WEEWA_MODE_H__
+#define __WEEWA_MODE_H__
+
+#include <linux/media-bus-format.h>
+#include <linux/sort.h>
+#include <media/v4l2-event.h>
+#include <media/v4l2-subdev.h>
+
+#include "weewa_timing.h"
+
+struct weewa_mode_switch {
+	__u32 width;
+	__u32 height;
+	__u32 code;		/* media bus code, 0 keeps the current one */
+	__u32 hdr_mode;
+	__u32 frame;		/* out: first frame in the new mode */
+} __attribute__ ((packed));
+
+#define WEEWA_CMD_SWITCH_MODE	\
+	_IOWR('V', BASE_VIDIOC_PRIVATE + 104, struct weewa_mode_switch)
+
+#define WEEWA_FLIP_H		BIT(0)
+#define WEEWA_FLIP_V		BIT(1)
+
+/*
+ * Bayer order of @code read out with @flip (WEEWA_FLIP_*): a mirror swaps
+ * the columns of the 2x2 tile, a flip its rows. Applying it twice gives
+ * @code back, so it also maps a reported code to the mode's own. Other
+ * codes pass through.
+ */
+static inline u32 weewa_bayer_flip(u32 code, u8 flip)
+{
+	/* indexed by the WEEWA_FLIP_* bits that turn RGGB into each order */
+	static const u32 orders[][4] = {
+		{ MEDIA_BUS_FMT_SRGGB10_1X10, MEDIA_BUS_FMT_SGRBG10_1X10,
+		  MEDIA_BUS_FMT_SGBRG10_1X10, MEDIA_BUS_FMT_SBGGR10_1X10 },
+		{ MEDIA_BUS_FMT_SRGGB12_1X12, MEDIA_BUS_FMT_SGRBG12_1X12,
+		  MEDIA_BUS_FMT_SGBRG12_1X12, MEDIA_BUS_FMT_SBGGR12_1X12 },
+	};
+	u32 i, j;
+
+	for (i = 0; i < ARRAY_SIZE(orders); i++)
+		for (j = 0; j < 4; j++)
+			if (orders[i][j] == code)
+				return orders[i][j ^ (flip & 3)];
+
+	return code;
+}
+
+/* the reported bus code changed, the ISP should read the format again */
+static inline void weewa_notify_src_change(struct v4l2_subdev *sd)
+{
+	static const struct v4l2_event ev = {
+		.type = V4L2_EVENT_SOURCE_CHANGE,
+		.u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION,
+	};
+
+	v4l2_subdev_notify_event(sd, &ev);
+}
+
+static inline int weewa_subscribe_event(struct v4l2_subdev *sd,
+					struct v4l2_fh *fh,
+					struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case V4L2_EVENT_SOURCE_CHANGE:
+		return v4l2_src_change_event_subdev_subscribe(sd, fh, sub);
+	case V4L2_EVENT_CTRL:
+		return v4l2_ctrl_subdev_subscribe_event(sd, fh, sub);
+	default:
+		return -EINVAL;
+	}
+}
+
+struct weewa_mode_key {
+	u32			width;
+	u32			height;
+	u32			code;
+	u32			hdr_mode;
+	struct v4l2_fract	max_fps;
+	u64			bps;	/* output bits per second at max_fps */
+	u32			idx;	/* into the driver's mode table */
+};
+
+static inline void weewa_mode_key_fill(struct weewa_mode_key *k, u32 idx,
+				       u32 width, u32 height, u32 code,
+				       u32 hdr_mode,
+				       const struct v4l2_fract *max_fps,
+				       u32 bpp, u32 vts_def)
+{
+	k->width = width;
+	k->height = height;
+	k->code = code;
+	k->hdr_mode = hdr_mode;
+	k->max_fps = *max_fps;
+	k->bps = div64_u64((u64)width * bpp * vts_def * max_fps->denominator,
+			   max_fps->numerator);
+	k->idx = idx;
+}
+
+/* (code, hdr_mode) of @k against the wanted one, hdr ignored if @any_hdr */
+static inline int weewa_mode_key_order(const struct weewa_mode_key *k,
+				       u32 code, u32 hdr_mode, bool any_hdr)
+{
+	if (k->code != code)
+		return k->code < code ? -1 : 1;
+	if (any_hdr || k->hdr_mode == hdr_mode)
+		return 0;
+
+	return k->hdr_mode < hdr_mode ? -1 : 1;
+}
+
+static int weewa_mode_key_cmp(const void *a, const void *b)
+{
+	const struct weewa_mode_key *ka = a, *kb = b;
+	int order = weewa_mode_key_order(ka, kb->code, kb->hdr_mode, false);
+
+	if (order)
+		return order;
+	if (ka->bps != kb->bps)
+		return ka->bps < kb->bps ? -1 : 1;
+
+	return (int)ka->idx - (int)kb->idx;
+}
+
+/*
+ * Sorts the keys into (code, hdr_mode) buckets, each by bandwidth, so a
+ * lookup only walks the bucket it binary searched for.
+ */
+static inline void weewa_mode_index_sort(struct weewa_mode_key *keys, u32 num)
+{
+	sort(keys, num, sizeof(*keys), weewa_mode_key_cmp, NULL);
+}
+
+/* first key ordered after (@upper) or not before the wanted bucket */
+static inline u32 weewa_mode_index_bound(const struct weewa_mode_key *keys,
+					 u32 num, u32 code, u32 hdr_mode,
+					 bool any_hdr, bool upper)
+{
+	u32 lo = 0, hi = num, mid;
+	int order;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		order = weewa_mode_key_order(&keys[mid], code, hdr_mode,
+					     any_hdr);
+		if (order < 0 || (upper && !order))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static inline u32 weewa_mode_key_dist(const struct weewa_mode_key *k,
+				      u32 width, u32 height)
+{
+	return abs((s32)k->width - (s32)width) +
+	       abs((s32)k->height - (s32)height);
+}
+
+/*
+ * One pass over @keys[first, last), @hdr_mode filtered unless @any_hdr:
+ * the nearest size, of its keys the cheapest that reaches @interval or
+ * else the fastest. NULL if nothing matched.
+ */
+static inline const struct weewa_mode_key *
+weewa_mode_index_pick(const struct weewa_mode_key *keys, u32 first, u32 last,
+		      u32 width, u32 height, u32 hdr_mode, bool any_hdr,
+		      const struct v4l2_fract *interval)
+{
+	const struct weewa_mode_key *k, *fit = NULL, *fast = NULL;
+	bool any_fps = !interval->numerator || !interval->denominator;
+	u32 dist = U32_MAX, d;
+
+	for (k = keys + first; k < keys + last; k++) {
+		if (!any_hdr && k->hdr_mode != hdr_mode)
+			continue;
+		d = weewa_mode_key_dist(k, width, height);
+		if (d > dist)
+			continue;
+		if (d < dist) {
+			dist = d;
+			fit = NULL;
+			fast = NULL;
+		}
+		if (any_fps || !weewa_interval_slower(&k->max_fps, interval)) {
+			if (!fit || k->bps < fit->bps ||
+			    (k->bps == fit->bps && k->idx < fit->idx))
+				fit = k;
+		} else if (!fast ||
+			   weewa_interval_slower(&fast->max_fps, &k->max_fps)) {
+			fast = k;
+		}
+	}
+
+	return fit ? fit : fast;
+}
+
+/*
+ * Mode table index for @width x @height in @code and @hdr_mode, any HDR
+ * mode and then any code when the sensor has none in them. The nearest
+ * size wins, of its modes the cheapest that reaches @interval, or the
+ * fastest if none does. An empty @interval takes the cheapest.
+ */
+static inline u32 weewa_mode_index_find(const struct weewa_mode_key *keys,
+					u32 num, u32 width, u32 height,
+					u32 code, u32 hdr_mode,
+					const struct v4l2_fract *interval)
+{
+	const struct weewa_mode_key *k;
+	u32 first, last;
+
+	first = weewa_mode_index_bound(keys, num, code, hdr_mode, false, false);
+	last = weewa_mode_index_bound(keys, num, code, hdr_mode, false, true);
+	if (first == last) {
+		/* no such bucket, widen to every HDR mode of the code */
+		first = weewa_mode_index_bound(keys, num, code, 0, true, false);
+		last = weewa_mode_index_bound(keys, num, code, 0, true, true);
+	}
+	if (first < last)
+		k = weewa_mode_index_pick(keys, first, last, width, height,
+					  hdr_mode, true, interval);
+	else
+		/* code not supported, any code of the HDR mode, then any */
+		k = weewa_mode_index_pick(keys, 0, num, width, height,
+					  hdr_mode, false, interval) ?:
+		    weewa_mode_index_pick(keys, 0, num, width, height,
+					  hdr_mode, true, interval);
+
+	return k ? k->idx : 0;
+}
+
+#endif /* __WEEWA_MODE_H__ */
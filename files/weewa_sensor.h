@@ -0,0 +1,701 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * weewa camera helpers shared by the sensor drivers
+ *
+ * Power groups: sensors whose avdd/dovdd/dvdd supplies resolve to the same
+ * regulators are powered as one group. The first user of an idle group
+ * brings every member up in a single sequence, so reset release, the
+ * post-reset wait and the 8192-cycle SCCB wait are paid once for all
+ * cameras. The group drops power when its last user is gone.
+ */
+
+#ifndef __WEEWA_SENSOR_H__
+#define __WEEWA_SENSOR_H__
+
+#include <linux/clk.h>
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/gpio/consumer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/of.h>
+#include <linux/pinctrl/consumer.h>
+#include <linux/regulator/consumer.h>
+#include <linux/rk-camera-module.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <media/v4l2-fwnode.h>
+
+#include "weewa_frame.h"
+#include "weewa_mode.h"
+#include "weewa_timing.h"
+
+/* data lanes wired to the sensor, from its first endpoint */
+static int weewa_parse_lanes(struct device *dev, u32 *lanes)
+{
+	struct v4l2_fwnode_endpoint vep = { .bus_type = V4L2_MBUS_CSI2_DPHY };
+	struct fwnode_handle *ep;
+	int ret;
+
+	ep = fwnode_graph_get_next_endpoint(dev_fwnode(dev), NULL);
+	if (!ep) {
+		dev_err(dev, "Failed to get endpoint\n");
+		return -EINVAL;
+	}
+
+	ret = v4l2_fwnode_endpoint_parse(ep, &vep);
+	fwnode_handle_put(ep);
+	if (ret) {
+		dev_err(dev, "Failed to parse endpoint\n");
+		return ret;
+	}
+
+	*lanes = vep.bus.mipi_csi2.num_data_lanes;
+
+	return 0;
+}
+
+#define WEEWA_PWR_KEYS		3
+
+struct weewa_pwr_group;
+
+struct weewa_pwr_member {
+	struct list_head	list;
+	struct weewa_pwr_group	*grp;
+	struct device		*dev;
+	struct clk		*xvclk;
+	unsigned long		xvclk_rate;
+	unsigned long		powered_rate;
+	struct gpio_desc	*reset_gpio;
+	struct gpio_desc	*pwdn_gpio;
+	struct regulator_bulk_data *supplies;
+	int			num_supplies;
+	struct pinctrl		*pinctrl;
+	struct pinctrl_state	*pins_default;
+	u32			reset_delay_us;
+	bool			active;
+	bool			powered;
+	bool			pending;
+};
+
+struct weewa_pwr_group {
+	struct list_head	list;
+	struct device_node	*key[WEEWA_PWR_KEYS];
+	struct mutex		lock;
+	struct list_head	members;
+	int			active;
+};
+
+static const char * const weewa_pwr_keys[WEEWA_PWR_KEYS] = {
+	"avdd-supply",
+	"dovdd-supply",
+	"dvdd-supply",
+};
+
+static LIST_HEAD(weewa_pwr_groups);
+static DEFINE_MUTEX(weewa_pwr_groups_lock);
+
+static void weewa_pwr_put_keys(struct device_node **key)
+{
+	int i;
+
+	for (i = 0; i < WEEWA_PWR_KEYS; i++) {
+		of_node_put(key[i]);
+		key[i] = NULL;
+	}
+}
+
+/*
+ * Add @m to the group of sensors on the same supplies, creating it if
+ * needed. A member with any supply missing from DT gets a private group.
+ */
+static int weewa_pwr_join(struct weewa_pwr_member *m)
+{
+	struct device_node *key[WEEWA_PWR_KEYS];
+	struct weewa_pwr_group *grp;
+	bool shared = true;
+	int i;
+
+	for (i = 0; i < WEEWA_PWR_KEYS; i++) {
+		key[i] = of_parse_phandle(m->dev->of_node, weewa_pwr_keys[i], 0);
+		if (!key[i])
+			shared = false;
+	}
+
+	mutex_lock(&weewa_pwr_groups_lock);
+	if (shared) {
+		list_for_each_entry(grp, &weewa_pwr_groups, list) {
+			if (!memcmp(grp->key, key, sizeof(key))) {
+				weewa_pwr_put_keys(key);
+				goto found;
+			}
+		}
+	}
+
+	grp = kzalloc(sizeof(*grp), GFP_KERNEL);
+	if (!grp) {
+		mutex_unlock(&weewa_pwr_groups_lock);
+		weewa_pwr_put_keys(key);
+		return -ENOMEM;
+	}
+	if (shared)
+		memcpy(grp->key, key, sizeof(key));
+	else
+		weewa_pwr_put_keys(key);
+	mutex_init(&grp->lock);
+	INIT_LIST_HEAD(&grp->members);
+	list_add_tail(&grp->list, &weewa_pwr_groups);
+
+found:
+	mutex_lock(&grp->lock);
+	list_add_tail(&m->list, &grp->members);
+	m->grp = grp;
+	mutex_unlock(&grp->lock);
+	mutex_unlock(&weewa_pwr_groups_lock);
+
+	return 0;
+}
+
+static void __weewa_pwr_down(struct weewa_pwr_member *m)
+{
+	if (!IS_ERR(m->pwdn_gpio))
+		gpiod_set_value_cansleep(m->pwdn_gpio, 0);
+	clk_disable_unprepare(m->xvclk);
+	if (!IS_ERR(m->reset_gpio))
+		gpiod_set_value_cansleep(m->reset_gpio, 0);
+	regulator_bulk_disable(m->num_supplies, m->supplies);
+	m->powered = false;
+}
+
+static void __weewa_pwr_down_all(struct weewa_pwr_group *grp)
+{
+	struct weewa_pwr_member *m;
+
+	list_for_each_entry(m, &grp->members, list)
+		if (m->powered)
+			__weewa_pwr_down(m);
+}
+
+/*
+ * Power up @target, or with @all every unpowered member of the group, in
+ * one pass: clocks and supplies first, then all resets released together,
+ * one shared post-reset wait, pwdn and a single SCCB wait.
+ */
+static int __weewa_pwr_up(struct weewa_pwr_group *grp,
+			  struct weewa_pwr_member *target, bool all)
+{
+	struct weewa_pwr_member *m;
+	u32 reset_us = 0, sccb_us = 0, us;
+	int ret, target_ret = 0;
+	bool any = false;
+
+	list_for_each_entry(m, &grp->members, list) {
+		m->pending = false;
+		if (m->powered || (!all && m != target))
+			continue;
+		/* no clock rate yet, it powers up on its own first get */
+		if (!m->xvclk_rate) {
+			if (m == target)
+				target_ret = -EINVAL;
+			continue;
+		}
+
+		if (!IS_ERR_OR_NULL(m->pins_default)) {
+			ret = pinctrl_select_state(m->pinctrl, m->pins_default);
+			if (ret < 0)
+				dev_err(m->dev, "could not set pins\n");
+		}
+
+		ret = clk_set_rate(m->xvclk, m->xvclk_rate);
+		if (ret < 0) {
+			dev_err(m->dev, "Failed to set xvclk rate (%lu)\n",
+				m->xvclk_rate);
+			goto next;
+		}
+		if (clk_get_rate(m->xvclk) != m->xvclk_rate)
+			dev_warn(m->dev, "xvclk mismatched, expect %lu\n",
+				 m->xvclk_rate);
+		ret = clk_prepare_enable(m->xvclk);
+		if (ret < 0) {
+			dev_err(m->dev, "Failed to enable xvclk\n");
+			goto next;
+		}
+
+		if (!IS_ERR(m->reset_gpio))
+			gpiod_set_value_cansleep(m->reset_gpio, 0);
+
+		ret = regulator_bulk_enable(m->num_supplies, m->supplies);
+		if (ret < 0) {
+			dev_err(m->dev, "Failed to enable regulators\n");
+			clk_disable_unprepare(m->xvclk);
+			goto next;
+		}
+
+		m->pending = true;
+		any = true;
+next:
+		if (m == target)
+			target_ret = ret;
+	}
+
+	if (!any)
+		return target_ret;
+
+	list_for_each_entry(m, &grp->members, list) {
+		if (!m->pending)
+			continue;
+		if (!IS_ERR(m->reset_gpio))
+			gpiod_set_value_cansleep(m->reset_gpio, 1);
+		reset_us = max(reset_us, m->reset_delay_us);
+	}
+	if (reset_us)
+		usleep_range(reset_us, reset_us * 2);
+
+	list_for_each_entry(m, &grp->members, list) {
+		if (!m->pending)
+			continue;
+		if (!IS_ERR(m->pwdn_gpio))
+			gpiod_set_value_cansleep(m->pwdn_gpio, 1);
+		/* 8192 cycles prior to first SCCB transaction */
+		us = DIV_ROUND_UP(8192, m->xvclk_rate / 1000 / 1000);
+		sccb_us = max(sccb_us, us);
+	}
+	usleep_range(sccb_us, sccb_us * 2);
+
+	list_for_each_entry(m, &grp->members, list) {
+		if (!m->pending)
+			continue;
+		m->pending = false;
+		m->powered = true;
+		m->powered_rate = m->xvclk_rate;
+	}
+
+	return target_ret;
+}
+
+/* take a power reference for @m, the first one in the group powers all */
+static int weewa_pwr_get(struct weewa_pwr_member *m)
+{
+	struct weewa_pwr_group *grp = m->grp;
+	int ret = 0;
+
+	mutex_lock(&grp->lock);
+	if (m->active)
+		goto unlock;
+
+	/* brought up by a sibling at another rate, redo it on its own */
+	if (m->powered && m->powered_rate != m->xvclk_rate)
+		__weewa_pwr_down(m);
+
+	if (!m->powered) {
+		ret = __weewa_pwr_up(grp, m, grp->active == 0);
+		if (ret)
+			goto unlock;
+	}
+
+	m->active = true;
+	grp->active++;
+unlock:
+	mutex_unlock(&grp->lock);
+
+	return ret;
+}
+
+/* drop the reference for @m, the last one powers the whole group down */
+static void weewa_pwr_put(struct weewa_pwr_member *m)
+{
+	struct weewa_pwr_group *grp = m->grp;
+
+	mutex_lock(&grp->lock);
+	if (m->active) {
+		m->active = false;
+		if (--grp->active == 0)
+			__weewa_pwr_down_all(grp);
+	}
+	mutex_unlock(&grp->lock);
+}
+
+static void weewa_pwr_leave(struct weewa_pwr_member *m)
+{
+	struct weewa_pwr_group *grp = m->grp;
+	bool empty;
+
+	if (!grp)
+		return;
+
+	mutex_lock(&weewa_pwr_groups_lock);
+	mutex_lock(&grp->lock);
+	list_del(&m->list);
+	if (m->active) {
+		m->active = false;
+		if (--grp->active == 0)
+			__weewa_pwr_down_all(grp);
+	}
+	if (m->powered)
+		__weewa_pwr_down(m);
+	empty = list_empty(&grp->members);
+	mutex_unlock(&grp->lock);
+
+	if (empty) {
+		list_del(&grp->list);
+		weewa_pwr_put_keys(grp->key);
+		mutex_destroy(&grp->lock);
+		kfree(grp);
+	}
+	mutex_unlock(&weewa_pwr_groups_lock);
+	m->grp = NULL;
+}
+
+
+/*
+ * Sync groups: sensors in hardware frame sync (sync_mode other than
+ * NO_SYNC_MODE) with the same "innosz,sync-group" id, 0 by default, are
+ * started together. Each member arms itself on s_stream, i.e. writes its
+ * whole configuration but stays in standby; once every synced member is
+ * armed, standby is released on the slaves first and on the master last,
+ * so the slaves are already waiting for the first XVS. If some member does
+ * not arm within WEEWA_SYNC_TIMEOUT_MS the armed ones are released anyway.
+ *
+ * Once released, WEEWA_CMD_SET_GROUP_AE applies exposure and gain to every
+ * listed member back to back, each inside its own register hold, in one
+ * frame. The values are stored in the members' exposure and gain controls
+ * as well, an entry is left unapplied when its sensor is busy. The frame
+ * timing is that of the calling member's frame tracking, rebased on every
+ * frame length change, there is no frame start interrupt to go by.
+ */
+
+#define WEEWA_SYNC_TIMEOUT_MS	1000
+
+enum weewa_sync_state {
+	WEEWA_SYNC_IDLE = 0,
+	WEEWA_SYNC_ARMING,
+	WEEWA_SYNC_LOCKED,
+	WEEWA_SYNC_UNLOCKED,
+};
+
+struct weewa_sync_info {
+	__u32 group;
+	__u32 state;
+	__u32 members;
+	__u32 armed;
+	__u32 released;
+} __attribute__ ((packed));
+
+#define WEEWA_CMD_GET_SYNC_INFO	\
+	_IOR('V', BASE_VIDIOC_PRIVATE + 100, struct weewa_sync_info)
+
+#define WEEWA_GROUP_AE_MAX	4
+/* don't start a group update this close to the next frame start */
+#define WEEWA_GROUP_AE_GUARD_US	3000
+
+struct weewa_group_ae_entry {
+	__u32 index;		/* rockchip,camera-module-index */
+	__u32 exposure;		/* lines */
+	__u32 gain;		/* analogue gain register value */
+	__u32 applied;		/* out */
+} __attribute__ ((packed));
+
+struct weewa_group_ae {
+	__u32 count;
+	struct weewa_group_ae_entry entry[WEEWA_GROUP_AE_MAX];
+	__u32 frame;		/* out: first frame exposed with the new values */
+	__u32 split;		/* out: the writes crossed a frame start */
+} __attribute__ ((packed));
+
+#define WEEWA_CMD_SET_GROUP_AE	\
+	_IOWR('V', BASE_VIDIOC_PRIVATE + 101, struct weewa_group_ae)
+
+struct weewa_sync_group;
+
+struct weewa_sync_ops {
+	/* leave standby, i2c access only, called with the group lock held */
+	int (*release)(void *priv);
+	/* read back whether the sensor left standby */
+	bool (*running)(void *priv);
+	/*
+	 * write exposure and gain inside one register hold and store them in
+	 * the controls. Called with the group lock held, so it may only
+	 * trylock the sensor mutex, which is taken before the group lock
+	 * elsewhere, and return -EBUSY when that fails.
+	 */
+	int (*set_ae)(void *priv, u32 exposure, u32 gain);
+	/*
+	 * frame being output as WEEWA_CMD_GET_FRAME_INFO counts it, the time
+	 * into it and the frame length. Same locking as set_ae.
+	 */
+	int (*frame_pos)(void *priv, u32 *frame, u64 *pos_ns, u64 *frame_ns);
+};
+
+struct weewa_sync_member {
+	struct list_head	list;
+	struct weewa_sync_group	*grp;
+	struct device		*dev;
+	const struct weewa_sync_ops *ops;
+	void			*priv;
+	const enum rkmodule_sync_mode *mode;
+	u32			index;
+	bool			armed;
+	bool			released;
+};
+
+struct weewa_sync_group {
+	struct list_head	list;
+	u32			id;
+	struct mutex		lock;
+	struct list_head	members;
+	struct delayed_work	timeout;
+	enum weewa_sync_state	state;
+};
+
+static LIST_HEAD(weewa_sync_groups);
+static DEFINE_MUTEX(weewa_sync_groups_lock);
+
+static inline bool weewa_sync_synced(struct weewa_sync_member *m)
+{
+	return *m->mode != NO_SYNC_MODE;
+}
+
+static inline bool weewa_sync_is_master(struct weewa_sync_member *m)
+{
+	return *m->mode == EXTERNAL_MASTER_MODE ||
+	       *m->mode == INTERNAL_MASTER_MODE;
+}
+
+/* release every armed member still in standby, slaves before the master */
+static void __weewa_sync_release(struct weewa_sync_group *grp)
+{
+	struct weewa_sync_member *m;
+	bool locked = true;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		list_for_each_entry(m, &grp->members, list) {
+			if (!m->armed || m->released ||
+			    weewa_sync_is_master(m) != (pass == 1))
+				continue;
+			if (m->ops->release(m->priv))
+				dev_err(m->dev, "sync release failed\n");
+			else
+				m->released = true;
+		}
+	}
+
+	list_for_each_entry(m, &grp->members, list) {
+		if (!weewa_sync_synced(m))
+			continue;
+		if (!m->released || !m->ops->running(m->priv))
+			locked = false;
+	}
+	grp->state = locked ? WEEWA_SYNC_LOCKED : WEEWA_SYNC_UNLOCKED;
+}
+
+static void weewa_sync_timeout(struct work_struct *work)
+{
+	struct weewa_sync_group *grp = container_of(to_delayed_work(work),
+						    struct weewa_sync_group,
+						    timeout);
+
+	mutex_lock(&grp->lock);
+	if (grp->state == WEEWA_SYNC_ARMING) {
+		pr_warn("weewa sync group %u: not all members armed, starting anyway\n",
+			grp->id);
+		__weewa_sync_release(grp);
+	}
+	mutex_unlock(&grp->lock);
+}
+
+static int weewa_sync_join(struct weewa_sync_member *m)
+{
+	struct weewa_sync_group *grp;
+	u32 id = 0;
+
+	of_property_read_u32(m->dev->of_node, "innosz,sync-group", &id);
+
+	mutex_lock(&weewa_sync_groups_lock);
+	list_for_each_entry(grp, &weewa_sync_groups, list)
+		if (grp->id == id)
+			goto found;
+
+	grp = kzalloc(sizeof(*grp), GFP_KERNEL);
+	if (!grp) {
+		mutex_unlock(&weewa_sync_groups_lock);
+		return -ENOMEM;
+	}
+	grp->id = id;
+	mutex_init(&grp->lock);
+	INIT_LIST_HEAD(&grp->members);
+	INIT_DELAYED_WORK(&grp->timeout, weewa_sync_timeout);
+	list_add_tail(&grp->list, &weewa_sync_groups);
+
+found:
+	mutex_lock(&grp->lock);
+	list_add_tail(&m->list, &grp->members);
+	m->grp = grp;
+	mutex_unlock(&grp->lock);
+	mutex_unlock(&weewa_sync_groups_lock);
+
+	return 0;
+}
+
+static void weewa_sync_leave(struct weewa_sync_member *m)
+{
+	struct weewa_sync_group *grp = m->grp;
+	bool empty;
+
+	if (!grp)
+		return;
+
+	mutex_lock(&weewa_sync_groups_lock);
+	mutex_lock(&grp->lock);
+	list_del(&m->list);
+	empty = list_empty(&grp->members);
+	mutex_unlock(&grp->lock);
+
+	if (empty) {
+		list_del(&grp->list);
+		cancel_delayed_work_sync(&grp->timeout);
+		mutex_destroy(&grp->lock);
+		kfree(grp);
+	}
+	mutex_unlock(&weewa_sync_groups_lock);
+	m->grp = NULL;
+}
+
+/*
+ * Called at the end of stream on, after the member wrote its configuration.
+ * Releases the group once every synced member is armed; a member arming
+ * after the group was released is let go at once.
+ */
+static void weewa_sync_start(struct weewa_sync_member *m)
+{
+	struct weewa_sync_group *grp = m->grp;
+	struct weewa_sync_member *pos;
+	bool all = true;
+
+	mutex_lock(&grp->lock);
+	m->armed = true;
+	m->released = false;
+
+	list_for_each_entry(pos, &grp->members, list)
+		if (weewa_sync_synced(pos) && !pos->armed)
+			all = false;
+
+	if (all || grp->state == WEEWA_SYNC_LOCKED ||
+	    grp->state == WEEWA_SYNC_UNLOCKED) {
+		cancel_delayed_work(&grp->timeout);
+		__weewa_sync_release(grp);
+	} else if (grp->state == WEEWA_SYNC_IDLE) {
+		grp->state = WEEWA_SYNC_ARMING;
+		schedule_delayed_work(&grp->timeout,
+				      msecs_to_jiffies(WEEWA_SYNC_TIMEOUT_MS));
+	}
+	mutex_unlock(&grp->lock);
+}
+
+/*
+ * Called at the start of stream off, before the standby write, so neither
+ * a member starting nor the timeout can release this one once it stopped.
+ */
+static void weewa_sync_stop(struct weewa_sync_member *m)
+{
+	struct weewa_sync_group *grp = m->grp;
+	struct weewa_sync_member *pos;
+	bool any = false;
+
+	mutex_lock(&grp->lock);
+	m->armed = false;
+	m->released = false;
+	list_for_each_entry(pos, &grp->members, list)
+		if (pos->armed)
+			any = true;
+	if (!any) {
+		cancel_delayed_work(&grp->timeout);
+		grp->state = WEEWA_SYNC_IDLE;
+	}
+	mutex_unlock(&grp->lock);
+}
+
+static void weewa_sync_get_info(struct weewa_sync_member *m,
+				struct weewa_sync_info *info)
+{
+	struct weewa_sync_group *grp = m->grp;
+	struct weewa_sync_member *pos;
+
+	memset(info, 0, sizeof(*info));
+	mutex_lock(&grp->lock);
+	info->group = grp->id;
+	info->state = grp->state;
+	list_for_each_entry(pos, &grp->members, list) {
+		if (!weewa_sync_synced(pos))
+			continue;
+		info->members++;
+		info->armed += pos->armed;
+		info->released += pos->released;
+	}
+	mutex_unlock(&grp->lock);
+}
+
+static int weewa_sync_set_ae(struct weewa_sync_member *m,
+			     struct weewa_group_ae *ae)
+{
+	struct weewa_sync_group *grp = m->grp;
+	struct weewa_sync_member *pos;
+	u64 frame_ns, pos_ns;
+	u32 first, last, i;
+	int ret = 0;
+
+	if (ae->count == 0 || ae->count > WEEWA_GROUP_AE_MAX)
+		return -EINVAL;
+
+	mutex_lock(&grp->lock);
+	/* the frame timing is the caller's, it has to be running */
+	if ((grp->state != WEEWA_SYNC_LOCKED &&
+	     grp->state != WEEWA_SYNC_UNLOCKED) || !m->released) {
+		ret = -EAGAIN;
+		goto unlock;
+	}
+
+	ret = m->ops->frame_pos(m->priv, &first, &pos_ns, &frame_ns);
+	if (!ret && !frame_ns)
+		ret = -EINVAL;
+	if (ret)
+		goto unlock;
+
+	if (frame_ns - pos_ns < WEEWA_GROUP_AE_GUARD_US * NSEC_PER_USEC) {
+		/* too late for this frame, go right after the next start */
+		usleep_range(div_u64(frame_ns - pos_ns, NSEC_PER_USEC) + 200,
+			     div_u64(frame_ns - pos_ns, NSEC_PER_USEC) + 400);
+		ret = m->ops->frame_pos(m->priv, &first, &pos_ns, &frame_ns);
+		if (ret)
+			goto unlock;
+	}
+
+	for (i = 0; i < ae->count; i++) {
+		ae->entry[i].applied = 0;
+		list_for_each_entry(pos, &grp->members, list) {
+			if (pos->index != ae->entry[i].index || !pos->released)
+				continue;
+			if (!pos->ops->set_ae(pos->priv, ae->entry[i].exposure,
+					      ae->entry[i].gain))
+				ae->entry[i].applied = 1;
+			break;
+		}
+	}
+
+	/* a busy caller keeps the frame the writes started in */
+	if (m->ops->frame_pos(m->priv, &last, &pos_ns, &frame_ns))
+		last = first;
+	/* held values latch at the next frame start */
+	ae->frame = last + 1;
+	ae->split = first != last;
+	if (ae->split)
+		dev_warn(m->dev, "group ae crossed frame %u\n", last);
+unlock:
+	mutex_unlock(&grp->lock);
+
+	return ret;
+}
+
+#endif /* __WEEWA_SENSOR_H__ */
@@ -0,0 +1,337 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * weewa mode timing and timing controls shared by the sensor drivers
+ *
+ * WEEWA_CMD_GET_TIMING_MODEL describes the current mode's line period,
+ * exposure and gain limits and register delays, so AE can compute settings
+ * up front instead of learning the driver's clamping.
+ *
+ * The rolling shutter skew, the time between the starts of two rows and
+ * from the first row to the last, is also kept in two read-only controls
+ * updated on every mode change. VTS only adds blanking after the last row
+ * and does not change either.
+ *
+ * WEEWA_CID_EXPOSURE_US sets the exposure in microseconds. It converts
+ * through a Q32 line time rebuilt on every mode change and writes
+ * V4L2_CID_EXPOSURE, whose range and step give the legal value; each
+ * control reads back the setting made through the other.
+ *
+ * The frame interval helpers stretch a mode's frame by VTS: the mode's
+ * max_fps is reached at vts_def, so any slower rate, fractional ones
+ * included, is vts_def scaled by the ratio of the two intervals.
+ */
+
+#ifndef __WEEWA_TIMING_H__
+#define __WEEWA_TIMING_H__
+
+#include <linux/math64.h>
+#include <linux/rk-camera-module.h>
+#include <linux/videodev2.h>
+#include <media/v4l2-ctrls.h>
+
+#define WEEWA_TIMING_MODEL_VERSION	1
+
+/*
+ * Timing of the current mode. Exposure is in lines and ranges from
+ * exposure_min to vts - exposure_margin. In HDR_X2 the short frame is read
+ * out at RHS1 (4n+1, at most hdr_rhs1_max and below 2 * hdr_brl), the short
+ * exposure is at most RHS1 - hdr_shr1_min and the long one at most
+ * vts - RHS1 - hdr_shr1_min. The hdr fields are 0 in linear modes. Delays
+ * count frames from the write to the first frame using the new value.
+ */
+struct weewa_timing_model {
+	__u32 version;		/* WEEWA_TIMING_MODEL_VERSION */
+	__u32 width;
+	__u32 height;
+	__u32 hdr_mode;
+	__u32 line_ps;		/* line period */
+	__u64 frame_ns;		/* at the current vts */
+	__u64 readout_ns;	/* first to last line */
+	__u32 vts;
+	__u32 vts_min;
+	__u32 vts_max;
+	__u32 exposure_min;
+	__u32 exposure_margin;
+	__u32 exposure_step;
+	__u32 gain_min;
+	__u32 gain_max;
+	__u32 gain_step;
+	__u32 exposure_delay;
+	__u32 gain_delay;
+	__u32 vts_delay;
+	__u32 hdr_brl;
+	__u32 hdr_rhs1_max;
+	__u32 hdr_shr1_min;
+} __attribute__ ((packed));
+
+#define WEEWA_CMD_GET_TIMING_MODEL	\
+	_IOR('V', BASE_VIDIOC_PRIVATE + 103, struct weewa_timing_model)
+
+#define WEEWA_CID_ROW_PERIOD		(V4L2_CID_USER_BASE | 0x1f00)
+#define WEEWA_CID_READOUT_TIME		(V4L2_CID_USER_BASE | 0x1f01)
+/* sensors that stretch the frame to expose past their VBLANK length */
+#define WEEWA_CID_LONG_EXPOSURE		(V4L2_CID_USER_BASE | 0x1f02)
+#define WEEWA_CID_EXPOSURE_US		(V4L2_CID_USER_BASE | 0x1f03)
+
+struct weewa_skew {
+	struct v4l2_ctrl	*row_period;	/* ps */
+	struct v4l2_ctrl	*readout;	/* ns */
+};
+
+struct weewa_exp_us {
+	struct v4l2_ctrl	*ctrl;
+	u64			us_per_line;	/* Q32 */
+	u64			lines_per_us;	/* Q32 */
+	bool			syncing;
+};
+
+/* line period, the unit of exposure and VTS, in ps */
+static inline u64 weewa_line_ps(const struct v4l2_fract *max_fps, u32 vts_def)
+{
+	if (!max_fps->denominator || !vts_def)
+		return 0;
+
+	return div64_u64(1000ULL * NSEC_PER_SEC * max_fps->numerator,
+			 (u64)max_fps->denominator * vts_def);
+}
+
+/*
+ * Row period of one output frame. HDR_X2 modes count VTS in half lines,
+ * the long and short rows share each sensor line.
+ */
+static inline u64 weewa_row_ps(const struct v4l2_fract *max_fps, u32 vts_def,
+			       u32 hdr_mode)
+{
+	u64 line_ps = weewa_line_ps(max_fps, vts_def);
+
+	return hdr_mode == HDR_X2 ? line_ps * 2 : line_ps;
+}
+
+/*
+ * Line period and frame times from the mode's max_fps at vts_def, the
+ * driver fills in its limits and delays.
+ */
+static inline void weewa_timing_fill(struct weewa_timing_model *tm,
+				     const struct v4l2_fract *max_fps,
+				     u32 vts_def, u32 vts, u32 height,
+				     u32 hdr_mode)
+{
+	u64 line_ps = weewa_line_ps(max_fps, vts_def);
+	u64 row_ps = weewa_row_ps(max_fps, vts_def, hdr_mode);
+
+	memset(tm, 0, sizeof(*tm));
+	tm->version = WEEWA_TIMING_MODEL_VERSION;
+	tm->height = height;
+	tm->hdr_mode = hdr_mode;
+	tm->line_ps = line_ps;
+	tm->frame_ns = div_u64(line_ps * vts, 1000);
+	tm->readout_ns = div_u64(row_ps * (height - 1), 1000);
+	tm->vts = vts;
+	tm->vts_min = vts_def;
+}
+
+static inline void weewa_skew_init(struct v4l2_ctrl_handler *handler,
+				   struct weewa_skew *skew)
+{
+	static const struct v4l2_ctrl_config row_period = {
+		.id	= WEEWA_CID_ROW_PERIOD,
+		.name	= "Row Period ps",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.flags	= V4L2_CTRL_FLAG_READ_ONLY,
+		.max	= S32_MAX,
+		.step	= 1,
+	};
+	static const struct v4l2_ctrl_config readout = {
+		.id	= WEEWA_CID_READOUT_TIME,
+		.name	= "Readout Time ns",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.flags	= V4L2_CTRL_FLAG_READ_ONLY,
+		.max	= S32_MAX,
+		.step	= 1,
+	};
+
+	skew->row_period = v4l2_ctrl_new_custom(handler, &row_period, NULL);
+	skew->readout = v4l2_ctrl_new_custom(handler, &readout, NULL);
+}
+
+/* called with the control handler lock held */
+static inline void weewa_skew_update(struct weewa_skew *skew,
+				     const struct v4l2_fract *max_fps,
+				     u32 vts_def, u32 height, u32 hdr_mode)
+{
+	u64 row_ps = weewa_row_ps(max_fps, vts_def, hdr_mode);
+
+	if (!skew->row_period || !skew->readout)
+		return;
+
+	__v4l2_ctrl_s_ctrl(skew->row_period, min_t(u64, row_ps, S32_MAX));
+	__v4l2_ctrl_s_ctrl(skew->readout,
+			   min_t(u64, div_u64(row_ps * (height - 1), 1000),
+				 S32_MAX));
+}
+
+static inline void weewa_exp_us_init(struct v4l2_ctrl_handler *handler,
+				     const struct v4l2_ctrl_ops *ops,
+				     struct weewa_exp_us *eu)
+{
+	const struct v4l2_ctrl_config cfg = {
+		.ops	= ops,
+		.id	= WEEWA_CID_EXPOSURE_US,
+		.name	= "Exposure Time us",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.max	= S32_MAX,
+		.step	= 1,
+	};
+
+	eu->ctrl = v4l2_ctrl_new_custom(handler, &cfg, NULL);
+}
+
+static inline u32 weewa_us_to_lines(const struct weewa_exp_us *eu, u32 us)
+{
+	return ((u64)us * eu->lines_per_us + (1ULL << 31)) >> 32;
+}
+
+static inline u32 weewa_lines_to_us(const struct weewa_exp_us *eu, u32 lines)
+{
+	return min_t(u64, ((u64)lines * eu->us_per_line + (1ULL << 31)) >> 32,
+		     S32_MAX);
+}
+
+/*
+ * V4L2_CID_EXPOSURE changed to @lines: report it in microseconds. Called
+ * with the control handler lock held, from set_ctrl or on a mode change.
+ */
+static inline void weewa_exp_us_track(struct weewa_exp_us *eu, u32 lines)
+{
+	if (!eu->ctrl || eu->syncing)
+		return;
+
+	eu->syncing = true;
+	__v4l2_ctrl_s_ctrl(eu->ctrl, weewa_lines_to_us(eu, lines));
+	eu->syncing = false;
+}
+
+/* rebuild the line time, the exposure lines keep their value */
+static inline void weewa_exp_us_update(struct weewa_exp_us *eu,
+				       const struct v4l2_fract *max_fps,
+				       u32 vts_def, u32 lines)
+{
+	u64 line_ps = weewa_line_ps(max_fps, vts_def);
+
+	if (!line_ps)
+		return;
+
+	eu->us_per_line = div64_u64(line_ps << 32, 1000000);
+	eu->lines_per_us = div64_u64(1000000ULL << 32, line_ps);
+	weewa_exp_us_track(eu, lines);
+}
+
+/*
+ * WEEWA_CID_EXPOSURE_US written: V4L2_CID_EXPOSURE rounds the value to a
+ * legal line count and writes SHR, @ctrl keeps what that line count gives.
+ * A no-op when it is the echo of that control.
+ */
+static inline int weewa_exp_us_apply(struct weewa_exp_us *eu,
+				     struct v4l2_ctrl *exposure,
+				     struct v4l2_ctrl *ctrl)
+{
+	int ret;
+
+	if (eu->syncing)
+		return 0;
+
+	eu->syncing = true;
+	ret = __v4l2_ctrl_s_ctrl(exposure, weewa_us_to_lines(eu, ctrl->val));
+	eu->syncing = false;
+	if (!ret)
+		ctrl->val = weewa_lines_to_us(eu, exposure->val);
+
+	return ret;
+}
+
+/* lower rates offered by enum_frame_interval after each mode's max_fps */
+static const struct v4l2_fract weewa_std_intervals[] = {
+	{ 1001, 30000 },
+	{ 1, 25 },
+	{ 1, 24 },
+	{ 1001, 24000 },
+	{ 1, 15 },
+	{ 1, 10 },
+	{ 1, 5 },
+};
+
+/*
+ * VTS giving @interval within [vts_min, vts_max]. vts_min is vts_def
+ * unless a crop window shortens the frame below the mode's max_fps one.
+ */
+static inline u32 weewa_interval_to_vts(const struct v4l2_fract *max_fps,
+					u32 vts_def, u32 vts_min, u32 vts_max,
+					const struct v4l2_fract *interval)
+{
+	u64 vts;
+
+	if (!interval->numerator || !interval->denominator)
+		return vts_min;
+
+	vts = div64_u64((u64)vts_def * interval->numerator *
+			max_fps->denominator,
+			(u64)interval->denominator * max_fps->numerator);
+
+	return clamp_t(u64, vts, vts_min, vts_max);
+}
+
+static inline void weewa_vts_to_interval(const struct v4l2_fract *max_fps,
+					 u32 vts_def, u32 vts,
+					 struct v4l2_fract *interval)
+{
+	interval->numerator = max_fps->numerator;
+	interval->denominator = div_u64((u64)max_fps->denominator * vts_def,
+					vts);
+}
+
+static inline bool weewa_interval_slower(const struct v4l2_fract *a,
+					 const struct v4l2_fract *b)
+{
+	return (u64)a->numerator * b->denominator >
+	       (u64)b->numerator * a->denominator;
+}
+
+/* number of intervals offered for a mode */
+static inline u32 weewa_mode_intervals(const struct v4l2_fract *max_fps)
+{
+	u32 i, count = 1;
+
+	for (i = 0; i < ARRAY_SIZE(weewa_std_intervals); i++)
+		if (weewa_interval_slower(&weewa_std_intervals[i], max_fps))
+			count++;
+
+	return count;
+}
+
+/*
+ * Interval number @index of a mode: 0 is max_fps, then the standard rates
+ * below it. Returns false past the last one.
+ */
+static inline bool weewa_mode_interval(const struct v4l2_fract *max_fps,
+				       u32 index, struct v4l2_fract *interval)
+{
+	u32 i;
+
+	if (index == 0) {
+		*interval = *max_fps;
+		return true;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(weewa_std_intervals); i++) {
+		if (!weewa_interval_slower(&weewa_std_intervals[i], max_fps))
+			continue;
+		if (--index == 0) {
+			*interval = weewa_std_intervals[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+#endif /* __WEEWA_TIMING_H__ */